@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block.cpp"
+#include "mapfile.cpp"
+
+using namespace std;
+
+// tlz append: new text goes into new blocks after the container's footer,
+// and a new index and footer, which list the old blocks as well, end the
+// file again (see the layout in block.cpp). the old bytes are never
+// written, so an append costs the new text and an index, not the archive.
+// the payloads are synced before the index that makes them part of the
+// container, so a crash leaves the old container whole, with bytes after
+// it that the next append drops. those bytes never end in a footer: the
+// index and footer go out last, in one write. a file that does end in one,
+// which does not read, is a corrupt container, not an unfinished append,
+// and is refused unless recovery is asked for.
+
+// bytes read at a time while looking for the end of an unfinished append
+const size_t APPEND_SCAN_SIZE = size_t(1) << 20;
+
+// reads exactly len bytes at pos, or throws
+void pread_full(int fd, uint8_t *buf, size_t len, size_t pos)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t r = pread(fd, buf + done, len - done, pos + done);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r <= 0)
+        {
+            throw runtime_error(r < 0 ? strerror(errno) : "truncated container");
+        }
+        done += r;
+    }
+}
+
+// the index of the container that ends at end in fd
+ContainerIndex read_container_at(int fd, size_t end)
+{
+    string buf;
+    return read_index(end, [&](size_t pos, size_t len)
+    {
+        buf.resize(len);
+        pread_full(fd, (uint8_t *)buf.data(), len, pos);
+        return (const uint8_t *)buf.data();
+    });
+}
+
+// where the container in fd, of file_len bytes, ends, and its index: at
+// file_len, or, after an append that did not finish, at the last footer
+// in front of it that reads as one. with recover, a file that ends in a
+// footer that does not read is cut back the same way.
+size_t container_end(int fd, size_t file_len, ContainerIndex &index, bool recover)
+{
+    try
+    {
+        index = read_container_at(fd, file_len);
+        return file_len;
+    }
+    catch (const runtime_error &e)
+    {
+        uint8_t head[sizeof(CONTAINER_MAGIC)];
+        if (file_len < sizeof(head) + 1 + FOOTER_SIZE)
+        {
+            throw;
+        }
+        pread_full(fd, head, sizeof(head), 0);
+        if (memcmp(head, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) != 0)
+        {
+            throw;
+        }
+        uint8_t tail[sizeof(CONTAINER_MAGIC)];
+        pread_full(fd, tail, sizeof(tail), file_len - sizeof(tail));
+        if (!recover && memcmp(tail, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) == 0)
+        {
+            throw runtime_error(string(e.what()) + " (--recover drops the blocks it lists)");
+        }
+    }
+    // the footers end in the magic; chunks overlap by its length less one
+    // so that none is split between two
+    size_t low = sizeof(CONTAINER_MAGIC) + 1 + FOOTER_SIZE;
+    string chunk;
+    for (size_t hi = file_len - 1; hi >= low;)
+    {
+        size_t lo = max(low - sizeof(CONTAINER_MAGIC), hi - min(hi, APPEND_SCAN_SIZE));
+        chunk.resize(hi - lo);
+        pread_full(fd, (uint8_t *)chunk.data(), chunk.size(), lo);
+        for (size_t end = hi; end >= lo + sizeof(CONTAINER_MAGIC) && end >= low; end--)
+        {
+            if (memcmp(chunk.data() + end - lo - sizeof(CONTAINER_MAGIC), CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) != 0)
+            {
+                continue;
+            }
+            try
+            {
+                index = read_container_at(fd, end);
+                return end;
+            }
+            catch (const runtime_error &)
+            {
+            }
+        }
+        if (lo + sizeof(CONTAINER_MAGIC) <= low)
+        {
+            break;
+        }
+        hi = lo + sizeof(CONTAINER_MAGIC) - 1;
+    }
+    throw runtime_error("corrupt container footer");
+}
+
+// appends the text of in_fd (T_len bytes and mappable when regular, read
+// to its end otherwise) as new blocks of the container in archive_fd, which
+// must be open for reading and writing. the archive is locked meanwhile,
+// and put back as it was on any error. returns the bytes of an unfinished
+// earlier append that were dropped, or with recover, of a corrupt end.
+size_t append_to(int archive_fd, int in_fd, bool regular, size_t T_len, const CompressOptions &options, bool recover)
+{
+    if (flock(archive_fd, LOCK_EX) != 0)
+    {
+        throw runtime_error(strerror(errno));
+    }
+    struct stat st;
+    if (fstat(archive_fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        throw runtime_error("not a regular file");
+    }
+    ContainerIndex index;
+    size_t file_len = st.st_size;
+    size_t end = container_end(archive_fd, file_len, index, recover);
+    if ((end < file_len && ftruncate(archive_fd, end) != 0) || lseek(archive_fd, end, SEEK_SET) < 0)
+    {
+        throw runtime_error(strerror(errno));
+    }
+    try
+    {
+        ContainerWriter out(archive_fd, index, end);
+        if (regular)
+        {
+            MappedFile input(in_fd, T_len);
+            compress_to(out, input.data, input.size, options);
+        }
+        else
+        {
+            compress_stream(out, in_fd, options);
+        }
+        // no text, no new index: the container stays as it was
+        if (out.size() != end)
+        {
+            if (fdatasync(archive_fd) != 0)
+            {
+                throw runtime_error(strerror(errno));
+            }
+            out.finish();
+            if (fdatasync(archive_fd) != 0)
+            {
+                throw runtime_error(strerror(errno));
+            }
+        }
+    }
+    catch (...)
+    {
+        // should this fail too, the next append drops what is left
+        int ignored = ftruncate(archive_fd, end);
+        (void)ignored;
+        throw;
+    }
+    return file_len - end;
+}
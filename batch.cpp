@@ -0,0 +1,469 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "block.cpp"
+#include "mapfile.cpp"
+
+using namespace std;
+
+// batch archive layout (varint: LEB128, u64: little endian):
+//   "TLZA" | u8 version | one container per file, back to back | file table | footer
+//   file table: varint file_count | per file: varint name_len | name | varint container_len
+//   footer:     u64 table_len | u8 version | "TLZA"
+// every member is a complete container as tlz writes it for that file alone,
+// so a member decodes with the usual readers once its range is known.
+const char BATCH_MAGIC[4] = {'T', 'L', 'Z', 'A'};
+const uint8_t BATCH_VERSION = 1;
+const size_t BATCH_FOOTER_SIZE = 8 + 1 + sizeof(BATCH_MAGIC);
+
+// compressed tasks the writer may fall behind by, per worker; it bounds the
+// payloads and input mappings held at once
+const size_t BATCH_WINDOW_PER_THREAD = 4;
+
+struct BatchFile
+{
+    string path; // where it is read from
+    string name; // how the batch archive lists it
+    size_t size = 0;
+    size_t block_size = 1;
+    size_t blocks = 0;
+};
+
+// the name a batch archive lists path under: the path as given, less its
+// root and any leading .. parts, so it extracts under the target
+// directory; `tlz batch ../logs` lists ../logs/a as logs/a
+string member_name(const filesystem::path &path)
+{
+    filesystem::path name;
+    bool leading = true;
+    for (const auto &part : path.lexically_normal().relative_path())
+    {
+        if (leading && part == "..")
+        {
+            continue;
+        }
+        leading = false;
+        name /= part;
+    }
+    if (name.empty())
+    {
+        throw runtime_error(path.string() + ": no member name");
+    }
+    return name.string();
+}
+
+// the regular files named by inputs: a file stands for itself, a directory
+// for the files under it in name order, less those ending in skip_suffix,
+// and @list for the paths in file `list`, one per line (@- reads stdin)
+vector<BatchFile> list_batch_files(const vector<string> &inputs, const string &skip_suffix)
+{
+    vector<BatchFile> files;
+    auto add = [&](const filesystem::path &path)
+    {
+        BatchFile file;
+        file.path = path.string();
+        file.name = member_name(path);
+        file.size = filesystem::file_size(path);
+        files.push_back(file);
+    };
+    auto add_path = [&](const string &input)
+    {
+        filesystem::path path(input);
+        if (!filesystem::is_directory(path))
+        {
+            if (!filesystem::is_regular_file(path))
+            {
+                throw runtime_error(input + ": not a regular file");
+            }
+            add(path);
+            return;
+        }
+        vector<filesystem::path> found;
+        for (const auto &entry : filesystem::recursive_directory_iterator(path))
+        {
+            string name = entry.path().filename().string();
+            bool skipped = name.size() >= skip_suffix.size() &&
+                           name.compare(name.size() - skip_suffix.size(), skip_suffix.size(), skip_suffix) == 0;
+            if (entry.is_regular_file() && !skipped)
+            {
+                found.push_back(entry.path());
+            }
+        }
+        sort(found.begin(), found.end());
+        for (const auto &p : found)
+        {
+            add(p);
+        }
+    };
+    for (const string &input : inputs)
+    {
+        if (input.size() < 2 || input[0] != '@')
+        {
+            add_path(input);
+            continue;
+        }
+        ifstream list_file;
+        if (input != "@-")
+        {
+            list_file.open(input.substr(1));
+            if (!list_file)
+            {
+                throw runtime_error(input.substr(1) + ": cannot open");
+            }
+        }
+        istream &list = input == "@-" ? cin : list_file;
+        for (string line; getline(list, line);)
+        {
+            if (!line.empty())
+            {
+                add_path(line);
+            }
+        }
+    }
+    return files;
+}
+
+// writes all of bytes to fd
+void write_all_bytes(int fd, const string &bytes)
+{
+    for (size_t done = 0; done < bytes.size();)
+    {
+        ssize_t w = write(fd, bytes.data() + done, bytes.size() - done);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw runtime_error(strerror(errno));
+        }
+        done += w;
+    }
+}
+
+// compresses files as one list of tasks, a block of one file each, which
+// options.threads workers take in order from a shared counter, each in its
+// own CompressionContext: small files and the blocks of large ones
+// balance the same way, and no file waits for another to finish. the
+// calling thread writes the payloads in task order, to one container per
+// file at out_name(file) or, when archive_fd >= 0, to a single batch
+// archive there.
+template <class OutName>
+void compress_batch(vector<BatchFile> &files, const CompressOptions &options, int archive_fd, OutName out_name)
+{
+    struct Task
+    {
+        size_t file, block;
+    };
+    vector<Task> tasks;
+    for (size_t f = 0; f < files.size(); f++)
+    {
+        files[f].block_size = effective_block_size(options, files[f].size);
+        files[f].blocks = (files[f].size + files[f].block_size - 1) / files[f].block_size;
+        for (size_t b = 0; b < files[f].blocks; b++)
+        {
+            tasks.push_back({f, b});
+        }
+    }
+
+    // no more blocks are compressed at once than blocks_in_flight allows
+    // for the largest of them, so -M holds as it does for a single file
+    size_t largest = 0;
+    for (const BatchFile &file : files)
+    {
+        largest = max(largest, min(file.block_size, file.size));
+    }
+    unsigned workers = max<size_t>(1, min<size_t>(blocks_in_flight(options, largest), tasks.size()));
+    unsigned sort_threads = max<size_t>(1, options.threads / workers);
+    size_t window = BATCH_WINDOW_PER_THREAD * workers;
+    vector<string> payloads(tasks.size());
+    vector<char> ready(tasks.size(), 0);
+    // each file is mapped by the first of its blocks to start, outside the
+    // lock, and unmapped after the last one is compressed
+    vector<shared_ptr<MappedFile>> inputs(files.size());
+    unique_ptr<once_flag[]> mapped(new once_flag[files.size()]);
+    vector<size_t> blocks_left(files.size());
+    for (size_t f = 0; f < files.size(); f++)
+    {
+        blocks_left[f] = files[f].blocks;
+    }
+
+    mutex lock;
+    condition_variable progress;
+    size_t written = 0; // tasks written out
+    bool failed = false;
+    exception_ptr error;
+    atomic<size_t> next(0);
+
+    auto map_input = [&](size_t f)
+    {
+        const BatchFile &file = files[f];
+        bool regular;
+        size_t size;
+        int fd = open_input(file.path, regular, size);
+        if (fd < 0)
+        {
+            throw runtime_error(file.path + ": " + strerror(errno));
+        }
+        try
+        {
+            if (size != file.size)
+            {
+                throw runtime_error(file.path + ": changed while compressing");
+            }
+            inputs[f] = make_shared<MappedFile>(fd, size);
+        }
+        catch (...)
+        {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    };
+
+    auto work = [&]()
+    {
+        CompressionContext context;
+        size_t t;
+        while ((t = next++) < tasks.size())
+        {
+            try
+            {
+                {
+                    unique_lock<mutex> guard(lock);
+                    progress.wait(guard, [&]() { return failed || t < written + window; });
+                    if (failed)
+                    {
+                        return;
+                    }
+                }
+                size_t f = tasks[t].file;
+                call_once(mapped[f], map_input, f);
+                shared_ptr<MappedFile> input = inputs[f];
+                const BatchFile &file = files[f];
+                size_t begin = tasks[t].block * file.block_size;
+                size_t len = min(file.block_size, file.size - begin);
+                string payload;
+                compress_block(context, input->data + begin, len, options, payload, sort_threads);
+                // the block's pages are not needed again, though the file
+                // stays mapped for its other blocks
+                size_t page = sysconf(_SC_PAGESIZE);
+                uintptr_t first_page = (uintptr_t)(input->data + begin) / page * page;
+                uintptr_t end_page = (uintptr_t)(input->data + begin + len) / page * page;
+                if (end_page > first_page)
+                {
+                    madvise((void *)first_page, end_page - first_page, MADV_DONTNEED);
+                }
+                lock_guard<mutex> guard(lock);
+                payloads[t] = move(payload);
+                ready[t] = 1;
+                if (--blocks_left[f] == 0)
+                {
+                    inputs[f].reset();
+                }
+                progress.notify_all();
+            }
+            catch (...)
+            {
+                lock_guard<mutex> guard(lock);
+                if (!failed)
+                {
+                    error = current_exception();
+                }
+                failed = true;
+                progress.notify_all();
+                return;
+            }
+        }
+    };
+    vector<thread> pool;
+    for (unsigned i = 0; i < workers && !tasks.empty(); i++)
+    {
+        pool.emplace_back(work);
+    }
+
+    auto write_all = [&]()
+    {
+        string table;
+        put_varint(table, files.size());
+        if (archive_fd >= 0)
+        {
+            string head(BATCH_MAGIC, sizeof(BATCH_MAGIC));
+            head.push_back((char)BATCH_VERSION);
+            write_all_bytes(archive_fd, head);
+        }
+        size_t t = 0;
+        for (size_t f = 0; f < files.size(); f++)
+        {
+            int fd = archive_fd;
+            if (archive_fd < 0)
+            {
+                string name = out_name(files[f]);
+                fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0)
+                {
+                    throw runtime_error(name + ": " + strerror(errno));
+                }
+            }
+            ContainerWriter out(fd, files[f].block_size, container_version(options));
+            for (size_t b = 0; b < files[f].blocks; b++, t++)
+            {
+                string payload;
+                {
+                    unique_lock<mutex> guard(lock);
+                    progress.wait(guard, [&]() { return failed || ready[t]; });
+                    if (failed)
+                    {
+                        return;
+                    }
+                    payload = move(payloads[t]);
+                }
+                size_t begin = b * files[f].block_size;
+                out.add({payload}, {min(files[f].block_size, files[f].size - begin)});
+                lock_guard<mutex> guard(lock);
+                written = t + 1;
+                progress.notify_all();
+            }
+            out.finish();
+            if (archive_fd < 0)
+            {
+                close(fd);
+            }
+            put_varint(table, files[f].name.size());
+            table += files[f].name;
+            put_varint(table, out.size());
+        }
+        if (archive_fd >= 0)
+        {
+            put_u64(table, table.size());
+            table.push_back((char)BATCH_VERSION);
+            table.append(BATCH_MAGIC, sizeof(BATCH_MAGIC));
+            write_all_bytes(archive_fd, table);
+        }
+    };
+    try
+    {
+        write_all();
+    }
+    catch (...)
+    {
+        lock_guard<mutex> guard(lock);
+        if (!failed)
+        {
+            error = current_exception();
+        }
+        failed = true;
+        progress.notify_all();
+    }
+    for (auto &th : pool)
+    {
+        th.join();
+    }
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+}
+
+// a batch archive's members: where each container sits and what it is
+// called
+struct BatchMember
+{
+    string name;
+    size_t offset = 0, length = 0;
+};
+
+bool is_batch_archive(const uint8_t *in, size_t in_len)
+{
+    return in_len >= sizeof(BATCH_MAGIC) && memcmp(in, BATCH_MAGIC, sizeof(BATCH_MAGIC)) == 0;
+}
+
+vector<BatchMember> read_batch_table(const uint8_t *in, size_t in_len)
+{
+    size_t head_len = sizeof(BATCH_MAGIC) + 1;
+    if (!is_batch_archive(in, in_len) || in_len < head_len + BATCH_FOOTER_SIZE)
+    {
+        throw runtime_error("not a tlz batch archive");
+    }
+    ByteReader footer(in + in_len - BATCH_FOOTER_SIZE, in + in_len);
+    size_t table_len = footer.u64();
+    uint8_t version = footer.u8();
+    if (memcmp(footer.take(sizeof(BATCH_MAGIC)), BATCH_MAGIC, sizeof(BATCH_MAGIC)) != 0 ||
+        version != in[sizeof(BATCH_MAGIC)] || table_len > in_len - head_len - BATCH_FOOTER_SIZE)
+    {
+        throw runtime_error("corrupt batch archive footer");
+    }
+    if (version != BATCH_VERSION)
+    {
+        throw runtime_error("unsupported batch archive version " + to_string(version));
+    }
+    size_t members_end = in_len - BATCH_FOOTER_SIZE - table_len;
+    ByteReader table(in + members_end, in + members_end + table_len);
+    size_t count = table.varint();
+    if (count > table_len / 2)
+    {
+        throw runtime_error("corrupt batch archive table");
+    }
+    vector<BatchMember> members(count);
+    size_t offset = head_len;
+    for (BatchMember &m : members)
+    {
+        size_t name_len = table.varint();
+        m.name.assign((const char *)table.take(name_len), name_len);
+        m.offset = offset;
+        m.length = table.varint();
+        if (m.length > members_end - offset)
+        {
+            throw runtime_error("truncated batch archive");
+        }
+        offset += m.length;
+    }
+    return members;
+}
+
+// the path a member extracts to under dir; names that would leave it are
+// refused
+filesystem::path member_path(const string &dir, const string &name)
+{
+    filesystem::path rel = filesystem::path(name).lexically_normal();
+    if (rel.empty() || rel.is_absolute() || *rel.begin() == "..")
+    {
+        throw runtime_error(name + ": unsafe member name");
+    }
+    return filesystem::path(dir) / rel;
+}
+
+// writes every member of a batch archive to its name under dir
+void extract_batch(const uint8_t *in, size_t in_len, const string &dir, unsigned threads)
+{
+    for (const BatchMember &m : read_batch_table(in, in_len))
+    {
+        filesystem::path path = member_path(dir, m.name);
+        string text = decompress_blocks(in + m.offset, m.length, threads);
+        if (path.has_parent_path())
+        {
+            filesystem::create_directories(path.parent_path());
+        }
+        ofstream out(path, ofstream::out | ofstream::trunc | ofstream::binary);
+        if (!out.write(text.data(), text.size()))
+        {
+            throw runtime_error(path.string() + ": cannot write");
+        }
+    }
+}
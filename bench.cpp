@@ -0,0 +1,762 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "block.cpp"
+
+using namespace std;
+
+// reproducible compression benchmark. every corpus is generated locally
+// from a fixed seed, and each (corpus, size) case runs in a child process
+// of its own, so the peak RSS wait4 reports is that case's alone. a case
+// times the phases of compress_block one by one and the results go out
+// as JSON; `compare` flags regressions between two such files.
+//   g++ -std=c++20 -O2 -pthread -o bench bench.cpp
+//   ./bench [-c corpus,...] [-s 1M,16M,...] [-j threads] [-w huffman|balanced] [-e gamma|rans|adaptive] [-m wt|mtf]
+//           [-r repeats] [-o results.json]
+//   ./bench compare before.json after.json [-t percent, default 10]
+
+const char *CORPORA[] = {"random", "lowentropy", "repetitive", "dna", "log", "text"};
+const char *PHASES[] = {"sort_bwt", "init_wt", "encode_levels", "write_wt"};
+const size_t PHASE_COUNT = sizeof(PHASES) / sizeof(PHASES[0]);
+const char *CODINGS[] = {"gamma", "rans", "adaptive"}; // by LevelCoding
+// with -m mtf there is no tree to build, init_wt takes no time, and
+// encode_levels times mtf_encode
+
+size_t parse_bytes(const string &s)
+{
+    size_t end;
+    size_t v = stoull(s, &end);
+    string unit = s.substr(end);
+    size_t shift = unit == "K" || unit == "k" ? 10 : unit == "M" || unit == "m" ? 20 : unit == "G" || unit == "g" ? 30 : 0;
+    return v << shift;
+}
+
+vector<string> split_list(const string &s)
+{
+    vector<string> out;
+    for (size_t begin = 0, comma; begin <= s.size(); begin = comma + 1)
+    {
+        comma = min(s.find(',', begin), s.size());
+        out.push_back(s.substr(begin, comma - begin));
+    }
+    return out;
+}
+
+// the corpora. all of them depend on nothing but (name, n), so two runs
+// of the bench, on any machine, compress the same bytes: the draws are
+// sequenced one per statement and doubles come from unit(), since the
+// standard distributions differ between libraries
+
+double unit(mt19937_64 &rng)
+{
+    return (rng() >> 11) * 0x1.0p-53;
+}
+
+// appends words drawn from a Zipf-like distribution over `vocabulary`
+struct WordSource
+{
+    vector<string> vocabulary;
+    vector<double> cumulative;
+
+    WordSource(mt19937_64 &rng, size_t words)
+    {
+        double total = 0;
+        for (size_t k = 1; k <= words; k++)
+        {
+            size_t len = 2 + rng() % 5;
+            if (rng() % 4 == 0)
+            {
+                len += rng() % 6;
+            }
+            string w;
+            for (size_t i = 0; i < len; i++)
+            {
+                // vowels every other letter or so, for a text-like bigram mix
+                w.push_back(i % 2 == 1 && rng() % 3 ? "aeiou"[rng() % 5] : "bcdfghklmnprstvwy"[rng() % 17]);
+            }
+            vocabulary.push_back(w);
+            total += 1.0 / k;
+            cumulative.push_back(total);
+        }
+        for (double &c : cumulative)
+        {
+            c /= total;
+        }
+    }
+
+    const string &next(mt19937_64 &rng)
+    {
+        double u = unit(rng);
+        size_t k = lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin();
+        return vocabulary[min(k, vocabulary.size() - 1)];
+    }
+};
+
+string generate(const string &corpus, size_t n)
+{
+    // FNV-1a of the name: std::hash may differ between standard libraries
+    uint64_t seed = 14695981039346656037ull;
+    for (char c : corpus)
+    {
+        seed = (seed ^ (uint8_t)c) * 1099511628211ull;
+    }
+    mt19937_64 rng(seed ^ n);
+    string out;
+    out.reserve(n + 256);
+    if (corpus == "random")
+    {
+        while (out.size() < n)
+        {
+            uint64_t w = rng();
+            out.append((const char *)&w, 8);
+        }
+    }
+    else if (corpus == "lowentropy")
+    {
+        // 16 symbols, each half as likely as the one before: about 2 bits
+        // per byte
+        while (out.size() < n)
+        {
+            uint64_t w = rng() | (1ull << 15);
+            out.push_back("etaoinshrdlucmfw"[__builtin_ctzll(w)]);
+        }
+    }
+    else if (corpus == "repetitive")
+    {
+        // versions of one 64 KiB document, each copy with a few edits
+        string base;
+        WordSource words(rng, 2000);
+        while (base.size() < (64 << 10))
+        {
+            base += words.next(rng);
+            base.push_back(rng() % 12 ? ' ' : '\n');
+        }
+        while (out.size() < n)
+        {
+            for (size_t edits = rng() % 8; edits > 0; edits--)
+            {
+                size_t at = rng() % base.size();
+                base[at] = "abcdefghijklmnopqrstuvwxyz"[rng() % 26];
+            }
+            out += base;
+        }
+    }
+    else if (corpus == "dna")
+    {
+        // FASTA records: an order-2 Markov chain over ACGT with occasional N
+        // runs, 60 bases per line
+        static const char *BASES = "ACGT";
+        double p[16][4];
+        for (auto &row : p)
+        {
+            double sum = 0;
+            for (double &x : row)
+            {
+                x = 0.2 + unit(rng);
+                sum += x;
+            }
+            for (double &x : row)
+            {
+                x /= sum;
+            }
+        }
+        size_t context = 0, record = 0, column = 0;
+        while (out.size() < n)
+        {
+            if (out.size() >= record * (1 << 20))
+            {
+                out += ">chr" + to_string(++record) + " generated\n";
+                column = 0;
+            }
+            if (rng() % 100000 == 0)
+            {
+                for (size_t k = 50 + rng() % 500; k > 0; k--)
+                {
+                    out.push_back('N');
+                    if (++column == 60)
+                    {
+                        out.push_back('\n');
+                        column = 0;
+                    }
+                }
+            }
+            double u = unit(rng);
+            size_t b = 0;
+            for (; b < 3 && u > p[context][b]; b++)
+            {
+                u -= p[context][b];
+            }
+            out.push_back(BASES[b]);
+            context = (context * 4 + b) % 16;
+            if (++column == 60)
+            {
+                out.push_back('\n');
+                column = 0;
+            }
+        }
+    }
+    else if (corpus == "log")
+    {
+        // access-log lines: increasing timestamps and fields from small sets
+        static const char *LEVELS[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+        static const char *METHODS[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+        static const char *PATHS[] = {"/api/v1/items", "/api/v1/users", "/api/v1/orders", "/health", "/static/app.js", "/login"};
+        static const int STATUS[] = {200, 200, 200, 201, 204, 304, 400, 404, 500};
+        uint64_t millis = 1700000000000ull;
+        char line[256];
+        while (out.size() < n)
+        {
+            millis += rng() % 50;
+            time_t seconds = millis / 1000;
+            struct tm t;
+            gmtime_r(&seconds, &t);
+            const char *level = LEVELS[rng() % 6];
+            unsigned worker = rng() % 16;
+            const char *method = METHODS[rng() % 6];
+            const char *path = PATHS[rng() % 6];
+            unsigned id = rng() % 100000;
+            int status = STATUS[rng() % 9];
+            unsigned ms = rng() % 2000;
+            unsigned ip[3];
+            for (unsigned &x : ip)
+            {
+                x = rng() % 256;
+            }
+            int len = snprintf(line, sizeof(line),
+                               "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %-5s [worker-%u] %s %s/%u %d %ums ip=10.%u.%u.%u\n",
+                               t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+                               (int)(millis % 1000), level, worker, method, path, id, status, ms, ip[0] % 4, ip[1],
+                               ip[2]);
+            out.append(line, len);
+        }
+    }
+    else if (corpus == "text")
+    {
+        // sentences of Zipf-distributed words in paragraphs
+        WordSource words(rng, 30000);
+        bool sentence_start = true;
+        while (out.size() < n)
+        {
+            string w = words.next(rng);
+            if (sentence_start)
+            {
+                w[0] = toupper(w[0]);
+            }
+            out += w;
+            sentence_start = false;
+            size_t r = rng() % 100;
+            if (r < 6)
+            {
+                out += r == 0 ? "?" : ".";
+                sentence_start = true;
+                out += rng() % 8 ? " " : "\n\n";
+            }
+            else
+            {
+                out += r < 12 ? ", " : " ";
+            }
+        }
+    }
+    else
+    {
+        throw runtime_error("unknown corpus " + corpus);
+    }
+    out.resize(n);
+    return out;
+}
+
+struct BenchOptions
+{
+    unsigned threads = 1;
+    WaveletShape shape = WT_BALANCED;
+    LevelCoding coding = LEVELS_GAMMA;
+    BlockBackend backend = BACKEND_WAVELET;
+    size_t repeats = 1;
+};
+
+double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// one run of the compress_block phases over T; seconds[p] gets the best
+// time of phase p so far, and the payload size is returned
+template <class I>
+size_t run_phases(const string &T, const BenchOptions &options, double *seconds)
+{
+    size_t n = T.size();
+    const uint8_t *text = (const uint8_t *)T.data();
+    vector<size_t> rows((n - 1) / unbwt_step(n));
+    SuffixSamples samples;
+    WaveletTree wt;
+    wt.shape = options.shape;
+    string out, coded;
+    double t[PHASE_COUNT];
+
+    auto start = chrono::steady_clock::now();
+    vector<I> sa(n + 1);
+    size_t primary = sort_block(text, n, sa, rows, samples, options.threads);
+    t[0] = seconds_since(start);
+
+    if (options.backend == BACKEND_MTF)
+    {
+        t[1] = 0;
+        start = chrono::steady_clock::now();
+        mtf_encode(reinterpret_cast<const uint8_t *>(sa.data()), n, coded);
+        t[2] = seconds_since(start);
+    }
+    else
+    {
+        start = chrono::steady_clock::now();
+        build_block_wt(wt, sa, n);
+        t[1] = seconds_since(start);
+
+        start = chrono::steady_clock::now();
+        if (options.coding == LEVELS_RANS)
+        {
+            compress_rans(wt);
+        }
+        else if (options.coding == LEVELS_ADAPTIVE)
+        {
+            compress_adaptive(wt);
+        }
+        else
+        {
+            compress_gamma(wt);
+        }
+        t[2] = seconds_since(start);
+    }
+
+    start = chrono::steady_clock::now();
+    put_varint(out, n);
+    put_varint(out, primary);
+    for (size_t row : rows)
+    {
+        put_varint(out, row);
+    }
+    if (options.backend == BACKEND_MTF)
+    {
+        out += coded;
+    }
+    else
+    {
+        write_wt(wt, out);
+    }
+    write_suffix_samples(out, samples);
+    t[3] = seconds_since(start);
+
+    for (size_t p = 0; p < PHASE_COUNT; p++)
+    {
+        seconds[p] = min(seconds[p], t[p]);
+    }
+    return out.size();
+}
+
+// the JSON object of one case, without its peak RSS
+string run_case(const string &corpus, size_t n, const BenchOptions &options)
+{
+    string T = generate(corpus, n);
+    double seconds[PHASE_COUNT];
+    fill(seconds, seconds + PHASE_COUNT, INFINITY);
+    size_t compressed = 0;
+    for (size_t r = 0; r < options.repeats; r++)
+    {
+        compressed = n < numeric_limits<uint32_t>::max() ? run_phases<uint32_t>(T, options, seconds)
+                                                         : run_phases<uint64_t>(T, options, seconds);
+    }
+
+    char buf[256];
+    double total = 0;
+    string json = "{\"corpus\": \"" + corpus + "\", \"bytes\": " + to_string(n) +
+                  ", \"compressed_bytes\": " + to_string(compressed);
+    snprintf(buf, sizeof(buf), ", \"ratio\": %.4f, \"phases\": {", (double)n / compressed);
+    json += buf;
+    for (size_t p = 0; p < PHASE_COUNT; p++)
+    {
+        total += seconds[p];
+        snprintf(buf, sizeof(buf), "%s\"%s\": {\"seconds\": %.6f, \"mb_per_s\": %.2f}", p ? ", " : "", PHASES[p],
+                 seconds[p], seconds[p] > 0 ? n / seconds[p] / 1e6 : 0);
+        json += buf;
+    }
+    snprintf(buf, sizeof(buf), ", \"total\": {\"seconds\": %.6f, \"mb_per_s\": %.2f}}", total, n / total / 1e6);
+    return json + buf;
+}
+
+// runs a case in a child and adds the child's peak RSS to its result
+string run_isolated(const string &corpus, size_t n, const BenchOptions &options)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        throw runtime_error(strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        int status = 0;
+        try
+        {
+            string json = run_case(corpus, n, options);
+            status = write(fds[1], json.data(), json.size()) == (ssize_t)json.size() ? 0 : 1;
+        }
+        catch (const exception &e)
+        {
+            fprintf(stderr, "%s %zu: %s\n", corpus.c_str(), n, e.what());
+            status = 1;
+        }
+        _exit(status);
+    }
+    close(fds[1]);
+    string json;
+    char buf[4096];
+    for (ssize_t got; (got = read(fds[0], buf, sizeof(buf))) > 0;)
+    {
+        json.append(buf, got);
+    }
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || json.empty())
+    {
+        throw runtime_error("case " + corpus + " " + to_string(n) + " failed");
+    }
+    // ru_maxrss is in KiB on Linux
+    return json + ", \"peak_rss_bytes\": " + to_string((size_t)usage.ru_maxrss * 1024) + "}";
+}
+
+// just enough JSON to read the bench's own output back
+struct Json
+{
+    enum Kind
+    {
+        NUL,
+        BOOL,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    } kind = NUL;
+    double number = 0;
+    string text;
+    vector<Json> items;
+    vector<pair<string, Json>> fields;
+
+    const Json &operator[](const string &key) const
+    {
+        static const Json missing;
+        for (auto &f : fields)
+        {
+            if (f.first == key)
+            {
+                return f.second;
+            }
+        }
+        return missing;
+    }
+};
+
+struct JsonParser
+{
+    const string &s;
+    size_t pos = 0;
+
+    JsonParser(const string &s) : s(s) {}
+
+    void skip_space()
+    {
+        while (pos < s.size() && isspace((unsigned char)s[pos]))
+        {
+            pos++;
+        }
+    }
+
+    void expect(char c)
+    {
+        skip_space();
+        if (pos >= s.size() || s[pos] != c)
+        {
+            throw runtime_error(string("bad JSON: expected ") + c + " at " + to_string(pos));
+        }
+        pos++;
+    }
+
+    string parse_string()
+    {
+        expect('"');
+        string out;
+        while (pos < s.size() && s[pos] != '"')
+        {
+            if (s[pos] == '\\' && pos + 1 < s.size())
+            {
+                pos++;
+            }
+            out.push_back(s[pos++]);
+        }
+        expect('"');
+        return out;
+    }
+
+    Json parse()
+    {
+        Json v;
+        skip_space();
+        if (pos >= s.size())
+        {
+            throw runtime_error("bad JSON: unexpected end");
+        }
+        char c = s[pos];
+        if (c == '{')
+        {
+            v.kind = Json::OBJECT;
+            pos++;
+            skip_space();
+            if (s[pos] == '}')
+            {
+                pos++;
+                return v;
+            }
+            do
+            {
+                string key = parse_string();
+                expect(':');
+                v.fields.emplace_back(key, parse());
+                skip_space();
+            } while (s[pos++] == ',');
+            if (s[pos - 1] != '}')
+            {
+                throw runtime_error("bad JSON: expected } at " + to_string(pos));
+            }
+        }
+        else if (c == '[')
+        {
+            v.kind = Json::ARRAY;
+            pos++;
+            skip_space();
+            if (s[pos] == ']')
+            {
+                pos++;
+                return v;
+            }
+            do
+            {
+                v.items.push_back(parse());
+                skip_space();
+            } while (s[pos++] == ',');
+            if (s[pos - 1] != ']')
+            {
+                throw runtime_error("bad JSON: expected ] at " + to_string(pos));
+            }
+        }
+        else if (c == '"')
+        {
+            v.kind = Json::STRING;
+            v.text = parse_string();
+        }
+        else if (s.compare(pos, 4, "true") == 0 || s.compare(pos, 5, "false") == 0)
+        {
+            v.kind = Json::BOOL;
+            v.number = c == 't';
+            pos += c == 't' ? 4 : 5;
+        }
+        else if (s.compare(pos, 4, "null") == 0)
+        {
+            pos += 4;
+        }
+        else
+        {
+            v.kind = Json::NUMBER;
+            char *end;
+            v.number = strtod(s.c_str() + pos, &end);
+            if (end == s.c_str() + pos)
+            {
+                throw runtime_error("bad JSON at " + to_string(pos));
+            }
+            pos = end - s.c_str();
+        }
+        return v;
+    }
+};
+
+Json read_json(const string &filename)
+{
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f)
+    {
+        throw runtime_error(filename + ": " + strerror(errno));
+    }
+    string s;
+    char buf[4096];
+    for (size_t got; (got = fread(buf, 1, sizeof(buf), f)) > 0;)
+    {
+        s.append(buf, got);
+    }
+    fclose(f);
+    return JsonParser(s).parse();
+}
+
+// compares the cases two result files share. a phase regresses when its
+// throughput drops by more than threshold percent, peak RSS when it grows
+// by more than that, and the compressed size when it grows at all, since
+// it does not depend on timing. returns the number of regressions.
+int compare(const string &before_name, const string &after_name, double threshold)
+{
+    Json before = read_json(before_name), after = read_json(after_name);
+    map<pair<string, double>, const Json *> old_cases;
+    for (const Json &c : before["results"].items)
+    {
+        old_cases[{c["corpus"].text, c["bytes"].number}] = &c;
+    }
+
+    int regressions = 0;
+    printf("%-11s %10s %-15s %12s %12s %8s\n", "corpus", "bytes", "metric", "before", "after", "change");
+    for (const Json &c : after["results"].items)
+    {
+        auto it = old_cases.find({c["corpus"].text, c["bytes"].number});
+        if (it == old_cases.end())
+        {
+            continue;
+        }
+        const Json &old = *it->second;
+        auto report = [&](const string &metric, double was, double now, bool higher_is_better, double limit)
+        {
+            double change = was != 0 ? 100 * (now - was) / was : 0;
+            bool regressed = higher_is_better ? change < -limit : change > limit;
+            regressions += regressed;
+            printf("%-11s %10.0f %-15s %12.2f %12.2f %+7.1f%%%s\n", c["corpus"].text.c_str(), c["bytes"].number,
+                   metric.c_str(), was, now, change, regressed ? "  REGRESSION" : "");
+        };
+        for (const char *phase : PHASES)
+        {
+            report(phase, old["phases"][phase]["mb_per_s"].number, c["phases"][phase]["mb_per_s"].number, true,
+                   threshold);
+        }
+        report("total", old["phases"]["total"]["mb_per_s"].number, c["phases"]["total"]["mb_per_s"].number, true,
+               threshold);
+        report("compressed", old["compressed_bytes"].number, c["compressed_bytes"].number, false, 0);
+        report("peak_rss_mb", old["peak_rss_bytes"].number / 1e6, c["peak_rss_bytes"].number / 1e6, false,
+               threshold);
+    }
+    printf("%d regression%s (threshold %.1f%%)\n", regressions, regressions == 1 ? "" : "s", threshold);
+    return regressions;
+}
+
+int main(int argc, char const *argv[])
+{
+    try
+    {
+        if (argc > 1 && string(argv[1]) == "compare")
+        {
+            if (argc != 4 && !(argc == 6 && string(argv[4]) == "-t"))
+            {
+                printf("usage: bench compare before.json after.json [-t percent]\n");
+                return 2;
+            }
+            return compare(argv[2], argv[3], argc == 6 ? stod(argv[5]) : 10) ? 1 : 0;
+        }
+
+        vector<string> corpora(begin(CORPORA), end(CORPORA));
+        vector<size_t> sizes = {1 << 20, 16 << 20, 64 << 20};
+        BenchOptions options;
+        string output_name;
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-c" && i + 1 < argc)
+            {
+                corpora = split_list(argv[++i]);
+            }
+            else if (arg == "-s" && i + 1 < argc)
+            {
+                sizes.clear();
+                for (const string &s : split_list(argv[++i]))
+                {
+                    sizes.push_back(parse_bytes(s));
+                }
+            }
+            else if (arg == "-j" && i + 1 < argc)
+            {
+                options.threads = max(1, atoi(argv[++i]));
+            }
+            else if (arg == "-w" && i + 1 < argc)
+            {
+                options.shape = string(argv[++i]) == "huffman" ? WT_HUFFMAN : WT_BALANCED;
+            }
+            else if (arg == "-e" && i + 1 < argc)
+            {
+                string coding = argv[++i];
+                options.coding = (LevelCoding)(find(begin(CODINGS), end(CODINGS), coding) - begin(CODINGS));
+                if (options.coding > LEVELS_ADAPTIVE)
+                {
+                    options.coding = LEVELS_GAMMA;
+                }
+            }
+            else if (arg == "-m" && i + 1 < argc)
+            {
+                options.backend = string(argv[++i]) == "mtf" ? BACKEND_MTF : BACKEND_WAVELET;
+            }
+            else if (arg == "-r" && i + 1 < argc)
+            {
+                options.repeats = max(1, atoi(argv[++i]));
+            }
+            else if (arg == "-o" && i + 1 < argc)
+            {
+                output_name = argv[++i];
+            }
+            else
+            {
+                printf("usage: bench [-c corpus,...] [-s size,...] [-j threads] [-w huffman|balanced] [-e gamma|rans|adaptive] [-m wt|mtf] [-r repeats] [-o results.json]\n"
+                       "       bench compare before.json after.json [-t percent]\n");
+                return 2;
+            }
+        }
+
+        string json = "{\"kernels\": \"" + string(kernels().name) + "\", \"threads\": " + to_string(options.threads) +
+                      ", \"shape\": \"" + (options.shape == WT_HUFFMAN ? "huffman" : "balanced") +
+                      "\", \"coding\": \"" + CODINGS[options.coding] +
+                      "\", \"backend\": \"" + (options.backend == BACKEND_MTF ? "mtf" : "wt") +
+                      "\", \"repeats\": " + to_string(options.repeats) + ", \"results\": [";
+        bool first = true;
+        for (const string &corpus : corpora)
+        {
+            for (size_t n : sizes)
+            {
+                if (n == 0)
+                {
+                    continue;
+                }
+                string result = run_isolated(corpus, n, options);
+                fprintf(stderr, "%s\n", result.c_str());
+                json += (first ? "\n  " : ",\n  ") + result;
+                first = false;
+            }
+        }
+        json += "\n]}\n";
+
+        FILE *out = output_name.empty() ? stdout : fopen(output_name.c_str(), "wb");
+        if (!out)
+        {
+            throw runtime_error(output_name + ": " + strerror(errno));
+        }
+        fwrite(json.data(), 1, json.size(), out);
+        if (out != stdout)
+        {
+            fclose(out);
+        }
+    }
+    catch (const exception &e)
+    {
+        fprintf(stderr, "bench: %s\n", e.what());
+        return 2;
+    }
+    return 0;
+}
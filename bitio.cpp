@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// an MSB-first bit stream: the first bit written is the top bit of the
+// first byte. bits gather in a 64-bit accumulator, top aligned, and leave
+// it one big-endian word at a time.
+struct BitWriter
+{
+    vector<uint8_t> bytes;
+    uint64_t acc = 0;
+    size_t fill = 0; // bits held in acc
+    size_t bits = 0; // bits written in total
+
+    size_t size() const
+    {
+        return bits;
+    }
+
+    // the low `width` bits of v, most significant first (width <= 64)
+    void put(uint64_t v, size_t width)
+    {
+        if (width == 0)
+        {
+            return;
+        }
+        if (width < 64)
+        {
+            v &= (1ull << width) - 1;
+        }
+        bits += width;
+        size_t room = 64 - fill;
+        if (width < room)
+        {
+            acc |= v << (room - width);
+            fill += width;
+            return;
+        }
+        acc |= v >> (width - room);
+        flush_word();
+        fill = width - room;
+        acc = fill ? v << (64 - fill) : 0;
+    }
+
+    // Elias gamma code of v >= 1: l zeros, then the l + 1 bits of v, where
+    // l = floor(log2 v). the leading zeros come free with a 2l+1 bit write.
+    void put_gamma(uint64_t v)
+    {
+        size_t l = 63 - __builtin_clzll(v);
+        if (2 * l + 1 <= 64)
+        {
+            put(v, 2 * l + 1);
+        }
+        else
+        {
+            put(0, l);
+            put(v, l + 1);
+        }
+    }
+
+    // Elias delta code of v >= 1: the bit length L of v in gamma, then the
+    // L - 1 bits of v below its leading one
+    void put_delta(uint64_t v)
+    {
+        size_t l = 64 - __builtin_clzll(v);
+        put_gamma(l);
+        put(v, l - 1);
+    }
+
+    // Golomb-Rice code of v with parameter k: v >> k in unary (that many
+    // zeros and a one), then the k low bits of v
+    void put_rice(uint64_t v, size_t k)
+    {
+        uint64_t q = v >> k;
+        for (; q >= 63; q -= 63)
+        {
+            put(0, 63);
+        }
+        put(1, q + 1);
+        put(v, k);
+    }
+
+    // empties the writer for reuse, keeping its buffer
+    void clear()
+    {
+        bytes.clear();
+        acc = 0;
+        fill = 0;
+        bits = 0;
+    }
+
+    // pads the last byte with zeros; the writer is done afterwards
+    void finish()
+    {
+        for (size_t k = 0; k < (fill + 7) / 8; k++)
+        {
+            bytes.push_back((uint8_t)(acc >> (56 - 8 * k)));
+        }
+        acc = 0;
+        fill = 0;
+    }
+
+private:
+    void flush_word()
+    {
+        uint64_t w = __builtin_bswap64(acc);
+        size_t end = bytes.size();
+        bytes.resize(end + 8);
+        memcpy(bytes.data() + end, &w, 8);
+    }
+};
+
+// the 64 bits of `in` starting at bit `pos`, most significant first; bits
+// past the end read as 0
+inline uint64_t peek_bits(const uint8_t *in, size_t in_len, size_t pos)
+{
+    size_t byte = pos / 8;
+    uint64_t w = 0;
+    if (byte + 8 <= in_len)
+    {
+        memcpy(&w, in + byte, 8);
+        w = __builtin_bswap64(w);
+    }
+    else
+    {
+        for (size_t k = 0; k < 8; k++)
+        {
+            w = (w << 8) | (byte + k < in_len ? in[byte + k] : 0);
+        }
+    }
+    return w << (pos % 8);
+}
+
+// reads a BitWriter stream of bit_num bits. every read goes through a
+// 64-bit window at the current position; reads past bit_num return false.
+struct BitReader
+{
+    const uint8_t *in;
+    size_t in_len;
+    size_t bit_num;
+    size_t pos = 0;
+
+    BitReader(const uint8_t *in, size_t bit_num) : in(in), in_len((bit_num + 7) / 8), bit_num(bit_num) {}
+
+    // the next width bits (width <= 57)
+    bool get(size_t width, uint64_t &v)
+    {
+        if (pos + width > bit_num)
+        {
+            return false;
+        }
+        v = width == 0 ? 0 : peek_bits(in, in_len, pos) >> (64 - width);
+        pos += width;
+        return true;
+    }
+
+    // one gamma code: clz of the window gives l, and the value is read in
+    // the same window when the code fits
+    bool get_gamma(uint64_t &v)
+    {
+        uint64_t w = peek_bits(in, in_len, pos);
+        size_t l = w ? __builtin_clzll(w) : 64;
+        if (l == 64 || pos + 2 * l + 1 > bit_num)
+        {
+            return false;
+        }
+        if (2 * l + 1 <= 57)
+        {
+            v = (w << l) >> (63 - l);
+        }
+        else
+        {
+            // codes longer than the window: take the l+1 value bits directly
+            v = peek_bits(in, in_len, pos + l) >> (63 - l);
+        }
+        pos += 2 * l + 1;
+        return true;
+    }
+
+    // one delta code, for values below 2^58
+    bool get_delta(uint64_t &v)
+    {
+        uint64_t l, low;
+        if (!get_gamma(l) || l > 58 || !get(l - 1, low))
+        {
+            return false;
+        }
+        v = (uint64_t)1 << (l - 1) | low;
+        return true;
+    }
+
+    // one Rice code with parameter k <= 57; the unary part is counted a
+    // window at a time
+    bool get_rice(size_t k, uint64_t &v)
+    {
+        uint64_t q = 0, w;
+        while ((w = peek_bits(in, in_len, pos)) == 0)
+        {
+            q += 64 - pos % 8;
+            pos += 64 - pos % 8;
+            if (pos >= bit_num)
+            {
+                return false;
+            }
+        }
+        size_t zeros = __builtin_clzll(w);
+        q += zeros;
+        pos += zeros + 1;
+        uint64_t low;
+        if (pos > bit_num || q >> (63 - k) != 0 || !get(k, low))
+        {
+            return false;
+        }
+        v = q << k | low;
+        return true;
+    }
+};
+
+// the bits of x in reverse order, to move bits between the LSB-first
+// BitVector words and the MSB-first streams
+inline uint64_t reverse_bits(uint64_t x)
+{
+    x = (x >> 1 & 0x5555555555555555ull) | (x & 0x5555555555555555ull) << 1;
+    x = (x >> 2 & 0x3333333333333333ull) | (x & 0x3333333333333333ull) << 2;
+    x = (x >> 4 & 0x0f0f0f0f0f0f0f0full) | (x & 0x0f0f0f0f0f0f0f0full) << 4;
+    return __builtin_bswap64(x);
+}
+
+void put_u64(string &out, uint64_t v)
+{
+    char bytes[8];
+    for (size_t i = 0; i < 8; i++)
+    {
+        bytes[i] = (char)(v >> (8 * i));
+    }
+    out.append(bytes, 8);
+}
+
+// LEB128: seven bits per byte, low first, high bit set on all but the last
+void put_varint(string &out, uint64_t v)
+{
+    char bytes[10];
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7)
+    {
+        bytes[n++] = (char)(v | 0x80);
+    }
+    bytes[n++] = (char)v;
+    out.append(bytes, n);
+}
+
+// what ByteReader throws when it runs out of bytes, as opposed to finding
+// bad ones: a stream reader takes it to mean that more have to come, at
+// least `missing` bytes more
+struct TruncatedInput : runtime_error
+{
+    size_t missing;
+
+    TruncatedInput(size_t missing = 1) : runtime_error("truncated archive"), missing(missing) {}
+};
+
+// a bounds-checked cursor over archive bytes
+struct ByteReader
+{
+    const uint8_t *p;
+    const uint8_t *end;
+
+    ByteReader(const uint8_t *p, const uint8_t *end) : p(p), end(end) {}
+
+    size_t left() const
+    {
+        return end - p;
+    }
+
+    // the next n bytes
+    const uint8_t *take(size_t n)
+    {
+        if (left() < n)
+        {
+            throw TruncatedInput(n - left());
+        }
+        p += n;
+        return p - n;
+    }
+
+    uint8_t u8()
+    {
+        return *take(1);
+    }
+
+    uint64_t u64()
+    {
+        const uint8_t *b = take(8);
+        uint64_t v = 0;
+        for (size_t i = 0; i < 8; i++)
+        {
+            v |= (uint64_t)b[i] << (8 * i);
+        }
+        return v;
+    }
+
+    uint64_t varint()
+    {
+        uint64_t v = 0;
+        for (size_t shift = 0; shift < 64; shift += 7)
+        {
+            uint8_t b = u8();
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+            {
+                return v;
+            }
+        }
+        throw runtime_error("corrupt varint");
+    }
+};
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "simd.cpp"
+
+using namespace std;
+
+// a plain bit array packed into 64-bit words; bit i is bit i % 64 of
+// words[i / 64], and the unused tail of the last word is kept zero
+struct BitVector
+{
+    vector<uint64_t> words;
+    size_t length = 0;
+
+    BitVector() {}
+
+    BitVector(size_t n) : words((n + 63) / 64, 0), length(n) {}
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    bool operator[](size_t i) const
+    {
+        return (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    void push_back(bool bit)
+    {
+        if (length % 64 == 0)
+        {
+            words.push_back(0);
+        }
+        words[length / 64] |= (uint64_t)bit << (length % 64);
+        length++;
+    }
+
+    // sets bits [pos, pos + len)
+    void set_range(size_t pos, size_t len)
+    {
+        size_t end = pos + len;
+        while (pos < end)
+        {
+            size_t bits = min<size_t>(64 - pos % 64, end - pos);
+            uint64_t mask = bits == 64 ? ~0ull : ((1ull << bits) - 1) << (pos % 64);
+            words[pos / 64] |= mask;
+            pos += bits;
+        }
+    }
+
+    // ors the low `width` bits of x into bits [pos, pos + width), width <= 64
+    void or_bits(size_t pos, uint64_t x, size_t width)
+    {
+        if (width == 0)
+        {
+            return;
+        }
+        x &= ~0ull >> (64 - width);
+        words[pos / 64] |= x << (pos % 64);
+        if (pos % 64 + width > 64)
+        {
+            words[pos / 64 + 1] |= x >> (64 - pos % 64);
+        }
+    }
+
+    // the `width` bits from pos on as the low bits of a word, width <= 64
+    uint64_t bits_at(size_t pos, size_t width) const
+    {
+        if (width == 0)
+        {
+            return 0;
+        }
+        uint64_t x = words[pos / 64] >> (pos % 64);
+        if (pos % 64 + width > 64)
+        {
+            x |= words[pos / 64 + 1] << (64 - pos % 64);
+        }
+        return x & (~0ull >> (64 - width));
+    }
+
+    // calls run(len) for every maximal run of equal bits, in order. x ^ (x
+    // << 1 | carry) marks where a bit differs from its predecessor, tzcnt
+    // walks the marks, and stretches of all-equal words are skipped with
+    // find_word_not.
+    template <class F>
+    void for_each_run(F run) const
+    {
+        if (length == 0)
+        {
+            return;
+        }
+        const BitKernels &k = kernels();
+        size_t start = 0;
+        uint64_t carry = words[0] & 1;
+        for (size_t w = 0; w < words.size(); w++)
+        {
+            uint64_t x = words[w];
+            uint64_t d = x ^ ((x << 1) | carry);
+            if (w == words.size() - 1 && length % 64 != 0)
+            {
+                d &= (1ull << (length % 64)) - 1;
+            }
+            for (; d != 0; d &= d - 1)
+            {
+                size_t p = 64 * w + __builtin_ctzll(d);
+                run(p - start);
+                start = p;
+            }
+            carry = x >> 63;
+            uint64_t fill = carry ? ~0ull : 0;
+            if (w + 1 < words.size() && words[w + 1] == fill)
+            {
+                w = k.find_word_not(words.data(), w + 1, words.size(), fill) - 1;
+            }
+        }
+        run(length - start);
+    }
+
+    // set bits in [pos, pos + len)
+    size_t count_range(size_t pos, size_t len) const
+    {
+        size_t end = pos + len, total = 0;
+        for (; pos < end && pos % 64 != 0; pos += min<size_t>(64 - pos % 64, end - pos))
+        {
+            total += __builtin_popcountll(bits_at(pos, min<size_t>(64 - pos % 64, end - pos)));
+        }
+        if (end - pos >= 64)
+        {
+            total += kernels().popcount(words.data() + pos / 64, (end - pos) / 64);
+            pos += (end - pos) / 64 * 64;
+        }
+        return total + (pos < end ? __builtin_popcountll(bits_at(pos, end - pos)) : 0);
+    }
+
+    size_t count() const
+    {
+        return kernels().popcount(words.data(), words.size());
+    }
+
+    void clear()
+    {
+        words.clear();
+        length = 0;
+    }
+};
+
+// position of the k-th (0-based) set bit of w
+inline size_t select_in_word(uint64_t w, size_t k)
+{
+    for (; k > 0; k--)
+    {
+        w &= w - 1;
+    }
+    return __builtin_ctzll(w);
+}
+
+// rank9 directory (Vigna, "Broadword implementation of rank/select
+// queries"): per 512-bit superblock one absolute count and seven 9-bit
+// counts relative to it, i.e. 25% space on top of the bits. rank is two
+// directory reads and one popcount; select binary searches the superblocks.
+struct Rank9
+{
+    const BitVector *B = nullptr;
+    vector<uint64_t> counts;
+
+    Rank9() {}
+
+    Rank9(const BitVector &bits)
+    {
+        build(bits);
+    }
+
+    void build(const BitVector &bits)
+    {
+        B = &bits;
+        size_t superblocks = bits.words.size() / 8 + 1;
+        counts.assign(2 * superblocks, 0);
+        uint64_t total = 0;
+        for (size_t k = 0; k < superblocks; k++)
+        {
+            counts[2 * k] = total;
+            uint64_t sub = 0, relative = 0;
+            for (size_t j = 0; j < 8; j++)
+            {
+                if (j > 0)
+                {
+                    sub |= relative << (9 * (j - 1));
+                }
+                size_t w = 8 * k + j;
+                relative += w < bits.words.size() ? __builtin_popcountll(bits.words[w]) : 0;
+            }
+            counts[2 * k + 1] = sub;
+            total += relative;
+        }
+    }
+
+    // ones in [0, i)
+    size_t rank1(size_t i) const
+    {
+        size_t k = i / 512, j = (i / 64) % 8;
+        size_t r = counts[2 * k];
+        if (j > 0)
+        {
+            r += (counts[2 * k + 1] >> (9 * (j - 1))) & 0x1ff;
+        }
+        if (i % 64 != 0)
+        {
+            r += __builtin_popcountll(B->words[i / 64] & ((1ull << (i % 64)) - 1));
+        }
+        return r;
+    }
+
+    size_t rank0(size_t i) const
+    {
+        return i - rank1(i);
+    }
+
+    // position of the k-th (0-based) one, or of the k-th zero if bit is
+    // false: binary search for the last superblock with at most k of them
+    // before it, then scan its words; k must be less than their count
+    size_t select(bool bit, size_t k) const
+    {
+        auto before = [&](size_t sb)
+        { return bit ? counts[2 * sb] : 512 * sb - counts[2 * sb]; };
+        size_t lo = 0, hi = counts.size() / 2;
+        while (hi - lo > 1)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (before(mid) <= k)
+            {
+                lo = mid;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        k -= before(lo);
+        for (size_t w = 8 * lo;; w++)
+        {
+            uint64_t word = bit ? B->words[w] : ~B->words[w];
+            size_t ones = __builtin_popcountll(word);
+            if (k < ones)
+            {
+                return 64 * w + select_in_word(word, k);
+            }
+            k -= ones;
+        }
+    }
+};
+
+// bits needed to store values up to v
+inline size_t bits_for(uint64_t v)
+{
+    return v == 0 ? 1 : 64 - __builtin_clzll(v);
+}
+
+// fixed-width unsigned integers packed back to back into 64-bit words; set
+// ors into the slot, so each slot is written once
+struct IntVector
+{
+    vector<uint64_t> words;
+    size_t width = 1;
+    size_t length = 0;
+
+    IntVector() {}
+
+    IntVector(size_t n, size_t w) : words((n * w + 63) / 64 + 1, 0), width(w), length(n) {}
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    uint64_t get(size_t i) const
+    {
+        size_t bit = i * width, w = bit / 64, shift = bit % 64;
+        uint64_t v = words[w] >> shift;
+        if (shift + width > 64)
+        {
+            v |= words[w + 1] << (64 - shift);
+        }
+        return width == 64 ? v : v & ((1ull << width) - 1);
+    }
+
+    void set(size_t i, uint64_t v)
+    {
+        size_t bit = i * width, w = bit / 64, shift = bit % 64;
+        words[w] |= v << shift;
+        if (shift + width > 64)
+        {
+            words[w + 1] |= v >> (64 - shift);
+        }
+    }
+};
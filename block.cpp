@@ -0,0 +1,1158 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bytesort.cpp"
+#include "dna.cpp"
+#include "extsort.cpp"
+#include "mtf.cpp"
+#include "mywt.cpp"
+#include "unbwt.cpp"
+
+using namespace std;
+
+// container layout, version 3 (varint: LEB128, u64: little endian):
+//   "TLZC" | u8 version | block payloads, in input order | index | footer
+//   index:  varint block_size | varint block_count
+//           block_count * (varint raw_len | varint comp_len)
+//   footer: u64 index_len | u8 version | "TLZC"
+// the footer has a fixed size, so a reader finds the index with two small
+// reads and any block from there, and a writer can stream the payloads
+// before it knows the index. a block payload is
+//   varint raw_len | varint primary | varint rows[] | write_wt output
+//   (or mtf_encode output, which starts with MTF_TAG)
+//   varint rate, and when rate != 0:
+//     u64 words of the marked-row bits (raw_len + 1 of them)
+//     varint width | u64 words of SA[row] / rate for the marked rows
+//     varint width | u64 words of the rows of suffixes 0, rate, 2 * rate, ...
+// where primary is the BWT row of the (dropped) sentinel and rows[s] is the
+// row of suffix (s + 1) * unbwt_step(raw_len), for every such suffix short of
+// raw_len.
+//
+// a packed DNA block (see dna.cpp) is instead
+//   varint raw_len | varint 0 | side text payload | varint base_count
+//   base payload, when base_count != 0
+// where both payloads are laid out as above, the second over the 2-bit
+// codes; no other block has primary 0. containers without such blocks are
+// written as version 1, which readers from before them take.
+//
+// tlz append (see append.cpp) adds blocks to a container without touching
+// its bytes: the new payloads, index and footer go after the old footer,
+// and the new index lists the old index and footer as an entry of raw_len
+// 0, which holds no text, between the old blocks and the new. such a
+// footer is version 3, whatever the head says; raw_len 0 means nothing
+// special under any other footer.
+const char CONTAINER_MAGIC[4] = {'T', 'L', 'Z', 'C'};
+const uint8_t CONTAINER_VERSION = 3;
+const uint8_t CONTAINER_VERSION_DNA = 2;
+const uint8_t CONTAINER_VERSION_BYTES = 1;
+const size_t FOOTER_SIZE = 8 + 1 + sizeof(CONTAINER_MAGIC);
+
+// the largest block chosen when no block size is given. a block needs
+// about BLOCK_MEMORY_FACTOR times its length while it is compressed: the
+// 32-bit SA, the wavelet tree levels and the input.
+const size_t LARGE_BLOCK_SIZE = size_t(1) << 30;
+const size_t BLOCK_MEMORY_FACTOR = 6;
+
+// what codes a block's BWT
+enum BlockBackend : uint8_t
+{
+    BACKEND_WAVELET = 0, // a wavelet tree, which count, locate and extract query
+    BACKEND_MTF = 1,     // move-to-front, zero runs and Huffman, for speed
+};
+
+// what a block's text is taken to be
+enum BlockAlphabet : uint8_t
+{
+    ALPHABET_BYTES = 0, // any bytes
+    ALPHABET_DNA = 1,   // bases, packed 2 bits each, with the rest on the side
+};
+
+struct CompressOptions
+{
+    size_t block_size = 0; // 0: see effective_block_size
+    unsigned threads = 1;
+    WaveletShape shape = WT_BALANCED;
+    LevelCoding coding = LEVELS_GAMMA;
+    BlockBackend backend = BACKEND_WAVELET;
+    BlockAlphabet alphabet = ALPHABET_BYTES;
+    size_t sample_rate = 0; // 0: no suffix samples, count queries only
+    bool stats = false;     // suffix sorting statistics as JSON on stderr
+    size_t memory_budget = 0; // 0: none; see sorts_external
+    string scratch_dir;       // for sorts_external; empty: $TMPDIR or /tmp
+};
+
+// every rate-th suffix of a block: marked rows hold a suffix 0 mod rate, sa
+// lists those suffixes (divided by rate) in row order and isa[k] is the row
+// of suffix k * rate. together they make the block a self-index.
+struct SuffixSamples
+{
+    size_t rate = 0;
+    BitVector marked;
+    IntVector sa, isa;
+};
+
+// run fn(b) for every b < count on `threads` workers. work is handed out
+// through a shared counter, so uneven blocks do not stall the pool.
+template <class F>
+void for_each_block(size_t count, unsigned threads, F fn)
+{
+    atomic<size_t> next(0);
+    exception_ptr error;
+    mutex error_lock;
+    auto worker = [&]()
+    {
+        size_t b;
+        while ((b = next++) < count)
+        {
+            try
+            {
+                fn(b);
+            }
+            catch (...)
+            {
+                lock_guard<mutex> guard(error_lock);
+                error = current_exception();
+                next = count;
+            }
+        }
+    };
+
+    threads = max<size_t>(1, min<size_t>(threads, count));
+    vector<thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &th : pool)
+    {
+        th.join();
+    }
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+}
+
+// what a block keeps of its suffix array, picked up as the rows settle so
+// that the array is never scanned on its own: the unbwt starting rows and
+// the samples. rows arrive last first, so the samples fill from the back
+struct SettledRows
+{
+    std::size_t n, step, rate, sampled = 0;
+    vector<std::size_t> &rows;
+    SuffixSamples &samples;
+
+    SettledRows(std::size_t n, vector<std::size_t> &rows, SuffixSamples &samples)
+        : n(n), step(unbwt_step(n)), rate(samples.rate), rows(rows), samples(samples)
+    {
+        if (rate != 0)
+        {
+            sampled = (n + rate - 1) / rate;
+            samples.marked = BitVector(n + 1);
+            samples.sa = IntVector(sampled, bits_for(sampled - 1));
+            samples.isa = IntVector(sampled, bits_for(n));
+        }
+    }
+
+    // row i holds suffix sa_i
+    void operator()(std::size_t i, std::size_t sa_i)
+    {
+        if (sa_i % step == 0 && sa_i != 0 && sa_i != n)
+        {
+            rows[sa_i / step - 1] = i;
+        }
+        if (rate != 0 && sa_i % rate == 0 && sa_i != n)
+        {
+            samples.marked.set_range(i, 1);
+            samples.sa.set(--sampled, sa_i / rate);
+            samples.isa.set(sa_i / rate, i);
+        }
+    }
+};
+
+// the BWT of a block, written over the front of sa by bwt_bytes on
+// `threads` threads, with the rows and samples taken as it goes. returns
+// the row of suffix 0, which has the sentinel as its BWT character. T is
+// the block's bytes or a PackedBases
+template <class Text, class I, class Stats = NoStats>
+std::size_t sort_block(Text T, std::size_t n, vector<I> &sa, vector<std::size_t> &rows,
+                       SuffixSamples &samples, unsigned threads, Stats &stats = default_stats<Stats>())
+{
+    SettledRows settled(n, rows, samples);
+    return bwt_bytes(T, (I)n, sa.data(), threads, [&](std::size_t i, std::size_t sa_i) { settled(i, sa_i); }, stats);
+}
+
+// whether a block of n characters is sorted in scratch files by
+// bwt_external: when its suffix array alone would pass the memory budget
+bool sorts_external(const CompressOptions &options, std::size_t n)
+{
+    std::size_t width = n < numeric_limits<uint32_t>::max() ? 4 : 8;
+    return options.memory_budget != 0 && (n + 1) > options.memory_budget / width;
+}
+
+// the wavelet tree of a sorted block: its BWT is the first n bytes of sa and
+// the next n bytes serve as the split scratch, so the only n-sized buffer of
+// the whole block is sa itself. unless `keep`, sa is freed once the tree is
+// built, before the levels are coded
+template <class I>
+void build_block_wt(WaveletTree &wt, vector<I> &sa, std::size_t n, bool keep = false)
+{
+    uint8_t *bwt = reinterpret_cast<uint8_t *>(sa.data());
+    init_wt(wt, bwt, n, bwt + n);
+    if (!keep)
+    {
+        vector<I>().swap(sa);
+    }
+}
+
+// blocks up to this length leave their buffers in the CompressionContext;
+// a longer one frees them as it goes, as its allocations are noise next to
+// its sort and the peak stays at BLOCK_MEMORY_FACTOR bytes per byte
+const size_t CONTEXT_POOL_LIMIT = size_t(1) << 26;
+
+// the buffers compress_block works in, kept from one block to the next: the
+// suffix array, which holds the BWT and the tree's split scratch in turn,
+// the wavelet tree's levels and their codes, the unbwt rows and the
+// mtf_encode output, and the packed bases and side text of ALPHABET_DNA.
+// they only grow, and every block overwrites what it uses, so a run of
+// small inputs allocates and faults in its working memory once rather than
+// per input. one context serves one block at a time.
+struct CompressionContext
+{
+    vector<uint32_t> sa32;
+    vector<uint64_t> sa64;
+    vector<std::size_t> rows;
+    WaveletTree wt;
+    string coded;
+    vector<uint64_t> bases;
+    string side;
+};
+
+// makes sa at least n entries long; a shorter one is replaced rather than
+// grown, since its contents need not be kept
+template <class I>
+void reserve_sa(vector<I> &sa, std::size_t n)
+{
+    if (sa.size() < n)
+    {
+        sa.clear();
+        sa.resize(n);
+    }
+}
+
+void write_suffix_samples(string &out, const SuffixSamples &samples)
+{
+    put_varint(out, samples.rate);
+    if (samples.rate == 0)
+    {
+        return;
+    }
+    for (uint64_t w : samples.marked.words)
+    {
+        put_u64(out, w);
+    }
+    for (const IntVector *v : {&samples.sa, &samples.isa})
+    {
+        put_varint(out, v->width);
+        for (uint64_t w : v->words)
+        {
+            put_u64(out, w);
+        }
+    }
+}
+
+// the payload of T_len characters of T, a byte pointer or a PackedBases,
+// into the end of out; see compress_block
+template <class Text>
+void compress_text(CompressionContext &context, Text T, size_t T_len, const CompressOptions &options, string &out,
+                   unsigned sort_threads, string *stats_json)
+{
+    // the index width follows the block length: a 32-bit SA halves the
+    // working set for every block below 4 GiB
+    std::size_t n = T_len;
+    bool pooled = n <= CONTEXT_POOL_LIMIT;
+    vector<std::size_t> &rows = context.rows;
+    rows.resize((n - 1) / unbwt_step(n));
+    std::size_t primary;
+    SuffixSamples samples;
+    samples.rate = options.sample_rate;
+    WaveletTree &wt = context.wt;
+    wt.shape = options.shape;
+    string &coded = context.coded; // the mtf_encode output, with BACKEND_MTF
+    coded.clear();
+    auto sort_external = [&]()
+    {
+        // the BWT and the tree's split scratch are file mappings, whose
+        // pages the kernel may write back and drop as it likes
+        ScratchFile bwt_file(options.scratch_dir);
+        SettledRows settled(n, rows, samples);
+        primary = bwt_external(T, n, options.memory_budget, options.scratch_dir, bwt_file,
+                               [&](std::size_t i, std::size_t sa_i) { settled(i, sa_i); });
+        if (options.stats && stats_json)
+        {
+            *stats_json = "{\"sorter\": \"external\"}";
+        }
+        uint8_t *bwt = bwt_file.map(n);
+        if (options.backend == BACKEND_MTF)
+        {
+            mtf_encode(bwt, n, coded);
+        }
+        else
+        {
+            ScratchFile split_file(options.scratch_dir);
+            init_wt(wt, bwt, n, split_file.map(n));
+        }
+    };
+    auto sort = [&](auto &sa)
+    {
+        reserve_sa(sa, n + 1);
+        if (options.stats && stats_json)
+        {
+            SortStats stats;
+            primary = sort_block(T, n, sa, rows, samples, sort_threads, stats);
+            *stats_json = stats.json();
+        }
+        else
+        {
+            primary = sort_block(T, n, sa, rows, samples, sort_threads);
+        }
+        if (options.backend == BACKEND_MTF)
+        {
+            mtf_encode(reinterpret_cast<const uint8_t *>(sa.data()), n, coded);
+        }
+        else
+        {
+            build_block_wt(wt, sa, n, true);
+        }
+        if (!pooled)
+        {
+            decay_t<decltype(sa)>().swap(sa);
+        }
+    };
+    if (sorts_external(options, n))
+    {
+        sort_external();
+    }
+    else if (n < numeric_limits<uint32_t>::max())
+    {
+        sort(context.sa32);
+    }
+    else
+    {
+        sort(context.sa64);
+    }
+
+    if (options.backend == BACKEND_WAVELET && options.coding == LEVELS_RANS)
+    {
+        compress_rans(wt);
+    }
+    else if (options.backend == BACKEND_WAVELET && options.coding == LEVELS_ADAPTIVE)
+    {
+        compress_adaptive(wt);
+    }
+    else if (options.backend == BACKEND_WAVELET)
+    {
+        compress_gamma(wt);
+    }
+
+    // the payload is assembled in one buffer, sized up front
+    size_t size = 10 * (rows.size() + 2) + 33 + 10 * 256 + 10 * wt.depth() + 10 + coded.size();
+    for (auto &level : wt.encoded)
+    {
+        size += level.bytes.size();
+    }
+    if (samples.rate != 0)
+    {
+        size += 8 * (samples.marked.words.size() + samples.sa.words.size() + samples.isa.words.size()) + 20;
+    }
+    out.reserve(out.size() + size);
+    put_varint(out, T_len);
+    put_varint(out, primary);
+    for (std::size_t row : rows)
+    {
+        put_varint(out, row);
+    }
+    if (options.backend == BACKEND_MTF)
+    {
+        out += coded;
+    }
+    else
+    {
+        write_wt(wt, out);
+    }
+    write_suffix_samples(out, samples);
+    if (!pooled)
+    {
+        context = CompressionContext();
+    }
+}
+
+// compresses one block into the end of out, suffix sorting it on
+// sort_threads threads in the buffers of `context`. with options.stats the
+// statistics of the sort are left in *stats_json. a block is never empty:
+// T_len == 0 throws invalid_argument.
+void compress_block(CompressionContext &context, const uint8_t *T, size_t T_len, const CompressOptions &options,
+                    string &out, unsigned sort_threads = 1, string *stats_json = nullptr)
+{
+    if (T_len == 0)
+    {
+        throw invalid_argument("compress_block: empty block");
+    }
+    if (options.alphabet != ALPHABET_DNA)
+    {
+        compress_text(context, T, T_len, options, out, sort_threads, stats_json);
+        return;
+    }
+    CompressOptions part = options;
+    part.alphabet = ALPHABET_BYTES;
+    part.sample_rate = 0;
+    // the split is taken out of the context while its parts are coded, as
+    // a block larger than CONTEXT_POOL_LIMIT resets it
+    vector<uint64_t> bases = move(context.bases);
+    string side = move(context.side);
+    size_t m = split_dna(T, T_len, bases, side);
+    put_varint(out, T_len);
+    put_varint(out, 0);
+    compress_text(context, (const uint8_t *)side.data(), side.size(), part, out, sort_threads, nullptr);
+    put_varint(out, m);
+    if (m != 0)
+    {
+        compress_text(context, PackedBases{bases.data()}, m, part, out, sort_threads, stats_json);
+    }
+    if (T_len <= CONTEXT_POOL_LIMIT)
+    {
+        context.bases = move(bases);
+        context.side = move(side);
+    }
+}
+
+// compresses one block on its own, suffix sorting it on sort_threads
+// threads. with options.stats the statistics of the sort are left in
+// *stats_json.
+string compress_block(const uint8_t *T, size_t T_len, const CompressOptions &options, unsigned sort_threads = 1,
+                      string *stats_json = nullptr)
+{
+    CompressionContext context;
+    string out;
+    compress_block(context, T, T_len, options, out, sort_threads, stats_json);
+    return out;
+}
+
+// the version a container of blocks compressed with options is written
+// as: the oldest that reads it
+uint8_t container_version(const CompressOptions &options)
+{
+    return options.alphabet == ALPHABET_DNA ? CONTAINER_VERSION_DNA : CONTAINER_VERSION_BYTES;
+}
+
+// the magic and version a container starts with
+string container_head(uint8_t version)
+{
+    string head(CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    head.push_back((char)version);
+    return head;
+}
+
+// the index and footer that end a container of block_count blocks, whose
+// raw_len | comp_len pairs are in table
+string container_index(size_t block_size, size_t block_count, const string &table, uint8_t version)
+{
+    string index;
+    put_varint(index, block_size);
+    put_varint(index, block_count);
+    index += table;
+    put_u64(index, index.size());
+    index.push_back((char)version);
+    index.append(CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    return index;
+}
+
+// where every block of a container sits, in the container and in the text
+struct ContainerIndex
+{
+    size_t block_size = 0;
+    size_t raw_total = 0;
+    vector<size_t> raw_len, raw_offset, comp_len, comp_offset;
+
+    size_t size() const
+    {
+        return raw_len.size();
+    }
+
+    // the block holding text offset pos (pos < raw_total)
+    size_t block_at(size_t pos) const
+    {
+        return upper_bound(raw_offset.begin(), raw_offset.end(), pos) - raw_offset.begin() - 1;
+    }
+};
+
+// writes a container to fd as its blocks come in: the head first, every
+// batch of payloads with one writev per IOV_MAX buffers, and the index with
+// its footer at the end. nothing but the index table is kept, so the output
+// may be a pipe.
+class ContainerWriter
+{
+public:
+    ContainerWriter(int fd, size_t block_size, uint8_t version) : fd(fd), block_size(block_size), version(version)
+    {
+        string head = container_head(version);
+        vector<iovec> parts = {{head.data(), head.size()}};
+        write_parts(parts);
+    }
+
+    // continues the container whose index is `index` and whose footer ends
+    // at footer_end, where fd must be: the old index and footer become an
+    // entry of no text, and finish() writes an index of the old blocks and
+    // the new, as version 3
+    ContainerWriter(int fd, const ContainerIndex &index, size_t footer_end)
+        : fd(fd), block_size(index.block_size), version(CONTAINER_VERSION), written_total(footer_end)
+    {
+        // the old index lists its own skipped regions the same way
+        size_t offset = sizeof(CONTAINER_MAGIC) + 1;
+        for (size_t b = 0; b <= index.size(); b++)
+        {
+            size_t begin = b < index.size() ? index.comp_offset[b] : footer_end;
+            if (begin > offset)
+            {
+                put_varint(table, 0);
+                put_varint(table, begin - offset);
+                block_count++;
+            }
+            if (b < index.size())
+            {
+                put_varint(table, index.raw_len[b]);
+                put_varint(table, index.comp_len[b]);
+                block_count++;
+                offset = begin + index.comp_len[b];
+            }
+        }
+    }
+
+    // payloads[k] holds raw_len[k] bytes of text
+    void add(const vector<string> &payloads, const vector<size_t> &raw_len)
+    {
+        vector<iovec> parts;
+        for (size_t k = 0; k < payloads.size(); k++)
+        {
+            put_varint(table, raw_len[k]);
+            put_varint(table, payloads[k].size());
+            parts.push_back({(void *)payloads[k].data(), payloads[k].size()});
+        }
+        block_count += payloads.size();
+        write_parts(parts);
+    }
+
+    void finish()
+    {
+        string index = container_index(block_size, block_count, table, version);
+        vector<iovec> parts = {{index.data(), index.size()}};
+        write_parts(parts);
+    }
+
+    // bytes written so far
+    size_t size() const
+    {
+        return written_total;
+    }
+
+private:
+    int fd;
+    size_t block_size;
+    uint8_t version;
+    size_t block_count = 0;
+    string table; // raw_len | comp_len of every block so far
+    size_t written_total = 0;
+
+    void write_parts(vector<iovec> &parts)
+    {
+        size_t first = 0;
+        while (first < parts.size())
+        {
+            int count = (int)min<size_t>(parts.size() - first, IOV_MAX);
+            ssize_t written = writev(fd, &parts[first], count);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw runtime_error(strerror(errno));
+            }
+            // drop what was written, which may end inside a buffer
+            written_total += written;
+            size_t done = written;
+            for (; first < parts.size() && done >= parts[first].iov_len; first++)
+            {
+                done -= parts[first].iov_len;
+            }
+            if (done > 0)
+            {
+                parts[first].iov_base = (char *)parts[first].iov_base + done;
+                parts[first].iov_len -= done;
+            }
+        }
+    }
+};
+
+// the block size to use for options.block_size over T_len bytes of input
+// (SIZE_MAX when unknown): input up to LARGE_BLOCK_SIZE is one block, and
+// longer input is cut into blocks of that size. it depends on nothing but
+// the input, so the archive does not change with the machine.
+size_t effective_block_size(const CompressOptions &options, size_t T_len)
+{
+    if (options.block_size != 0)
+    {
+        return options.block_size;
+    }
+    return min(max<size_t>(T_len, 1), LARGE_BLOCK_SIZE);
+}
+
+// how many blocks of block_size to compress at once: one per thread, but
+// no more than fit, at BLOCK_MEMORY_FACTOR bytes per input byte, into
+// options.memory_budget or else three quarters of physical memory. a block
+// sorted in scratch files counts as the whole budget
+size_t blocks_in_flight(const CompressOptions &options, size_t block_size)
+{
+    if (options.memory_budget != 0)
+    {
+        size_t need = sorts_external(options, block_size) ? options.memory_budget
+                                                          : max<size_t>(block_size, 1) * BLOCK_MEMORY_FACTOR;
+        return max<size_t>(1, min<size_t>(options.threads, options.memory_budget / need));
+    }
+    long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0)
+    {
+        return options.threads;
+    }
+    size_t budget = (size_t)pages / 4 * 3 * (size_t)page_size;
+    size_t fit = budget / max<size_t>(block_size, 1) / BLOCK_MEMORY_FACTOR;
+    return max<size_t>(1, min<size_t>(options.threads, fit));
+}
+
+// with options.stats, prints one JSON document on stderr listing the sort
+// statistics of every block, a batch at a time as the blocks finish
+struct StatsWriter
+{
+    bool enabled;
+    size_t blocks = 0;
+
+    StatsWriter(bool enabled) : enabled(enabled) {}
+
+    void add(const vector<string> &stats, const vector<size_t> &raw_len)
+    {
+        for (size_t k = 0; enabled && k < stats.size(); k++)
+        {
+            fprintf(stderr, "%s{\"block\": %zu, \"bytes\": %zu, \"sort\": %s}",
+                    blocks == 0 ? "{\"blocks\": [\n" : ",\n", blocks, raw_len[k], stats[k].c_str());
+            blocks++;
+        }
+    }
+
+    void finish()
+    {
+        if (enabled)
+        {
+            fprintf(stderr, "%s]}\n", blocks == 0 ? "{\"blocks\": [" : "\n");
+        }
+    }
+};
+
+// compresses T (typically a read-only mapping of the input file) into
+// blocks added to out. the blocks go through in batches, and the pages of
+// each finished batch are dropped from the mapping, so the resident set
+// stays near one batch of working memory however long T is.
+void compress_to(ContainerWriter &out, const uint8_t *T, size_t T_len, const CompressOptions &options)
+{
+    size_t block_size = effective_block_size(options, T_len);
+    size_t block_count = (T_len + block_size - 1) / block_size;
+    size_t batch = blocks_in_flight(options, block_size);
+    StatsWriter stats_out(options.stats);
+    vector<CompressionContext> contexts(min(batch, block_count));
+
+    for (size_t first = 0; first < block_count; first += batch)
+    {
+        size_t k_count = min(batch, block_count - first);
+        vector<string> payloads(k_count), stats(k_count);
+        vector<size_t> raw_len(k_count);
+        for_each_block(k_count, options.threads, [&](size_t k)
+        {
+            size_t begin = (first + k) * block_size;
+            raw_len[k] = min(block_size, T_len - begin);
+            compress_block(contexts[k], T + begin, raw_len[k], options, payloads[k],
+                           max<size_t>(1, options.threads / k_count), &stats[k]);
+        });
+        out.add(payloads, raw_len);
+        stats_out.add(stats, raw_len);
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = (uintptr_t)(T + first * block_size) / page * page;
+        uintptr_t end = (uintptr_t)(T + min(T_len, (first + k_count) * block_size)) / page * page;
+        if (end > begin)
+        {
+            madvise((void *)begin, end - begin, MADV_DONTNEED);
+        }
+    }
+    stats_out.finish();
+}
+
+// compresses T into a container on fd
+void compress_to(int fd, const uint8_t *T, size_t T_len, const CompressOptions &options)
+{
+    ContainerWriter out(fd, effective_block_size(options, T_len), container_version(options));
+    compress_to(out, T, T_len, options);
+    out.finish();
+}
+
+// reads up to len bytes from in_fd, stopping short only at end of input
+size_t read_full(int in_fd, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t r = read(in_fd, buf + got, len - got);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw runtime_error(strerror(errno));
+        }
+        if (r == 0)
+        {
+            break;
+        }
+        got += r;
+    }
+    return got;
+}
+
+// compresses everything read from in_fd, which may be a pipe, into blocks
+// added to out. input of unknown length is cut into LARGE_BLOCK_SIZE
+// blocks unless options.block_size says otherwise; one batch of blocks is
+// read, compressed and written at a time.
+void compress_stream(ContainerWriter &out, int in_fd, const CompressOptions &options)
+{
+    size_t block_size = effective_block_size(options, SIZE_MAX);
+    size_t batch = blocks_in_flight(options, block_size);
+    StatsWriter stats_out(options.stats);
+
+    // left uninitialised, so a short input touches only the pages it fills
+    vector<unique_ptr<uint8_t[]>> buffers(batch);
+    vector<CompressionContext> contexts(batch);
+    bool more = true;
+    while (more)
+    {
+        vector<size_t> raw_len;
+        for (size_t k = 0; k < batch && more; k++)
+        {
+            if (!buffers[k])
+            {
+                buffers[k].reset(new uint8_t[block_size]);
+            }
+            size_t got = read_full(in_fd, buffers[k].get(), block_size);
+            more = got == block_size;
+            if (got > 0)
+            {
+                raw_len.push_back(got);
+            }
+        }
+        vector<string> payloads(raw_len.size()), stats(raw_len.size());
+        for_each_block(raw_len.size(), options.threads, [&](size_t k)
+        {
+            compress_block(contexts[k], buffers[k].get(), raw_len[k], options, payloads[k],
+                           max<size_t>(1, options.threads / raw_len.size()), &stats[k]);
+        });
+        out.add(payloads, raw_len);
+        stats_out.add(stats, raw_len);
+    }
+    stats_out.finish();
+}
+
+// compresses everything read from in_fd into a container on out_fd
+void compress_stream(int in_fd, int out_fd, const CompressOptions &options)
+{
+    ContainerWriter out(out_fd, effective_block_size(options, SIZE_MAX), container_version(options));
+    compress_stream(out, in_fd, options);
+    out.finish();
+}
+
+// the fixed fields in front of a block's wavelet tree
+struct BlockHeader
+{
+    size_t raw_len = 0;
+    size_t primary = 0;
+    size_t step = 1;
+    vector<size_t> rows;
+};
+
+// parses the header of a block payload, leaving `in` at its tree
+void read_block_header(ByteReader &in, size_t raw_len, BlockHeader &header)
+{
+    header.raw_len = in.varint();
+    if (header.raw_len != raw_len || raw_len == 0)
+    {
+        throw runtime_error("block length mismatch");
+    }
+    header.primary = in.varint();
+    if (header.primary > raw_len)
+    {
+        throw runtime_error("corrupt block");
+    }
+    header.step = unbwt_step(raw_len);
+    header.rows.resize((raw_len - 1) / header.step);
+    for (size_t &row : header.rows)
+    {
+        row = in.varint();
+        if (row > raw_len || row == header.primary)
+        {
+            throw runtime_error("corrupt block");
+        }
+    }
+}
+
+// parses the suffix samples that follow a block's tree
+void read_suffix_samples(ByteReader &in, size_t raw_len, SuffixSamples &samples)
+{
+    samples.rate = in.varint();
+    if (samples.rate == 0)
+    {
+        return;
+    }
+    size_t count = (raw_len + samples.rate - 1) / samples.rate;
+    samples.marked = BitVector(raw_len + 1);
+    for (uint64_t &w : samples.marked.words)
+    {
+        w = in.u64();
+    }
+    for (IntVector *v : {&samples.sa, &samples.isa})
+    {
+        size_t width = in.varint();
+        if (width == 0 || width > 64)
+        {
+            throw runtime_error("corrupt suffix samples");
+        }
+        *v = IntVector(count, width);
+        for (uint64_t &w : v->words)
+        {
+            w = in.u64();
+        }
+    }
+    if (samples.marked.count() != count)
+    {
+        throw runtime_error("corrupt suffix samples");
+    }
+}
+
+// whether the payload at in is a packed DNA block, the only kind with
+// primary 0
+bool is_dna_block(const uint8_t *in, const uint8_t *end)
+{
+    ByteReader payload(in, end);
+    payload.varint();
+    return payload.varint() == 0;
+}
+
+// the side text and base payloads of a packed DNA block, which are blocks
+// of bytes themselves
+struct DnaParts
+{
+    const uint8_t *side = nullptr, *side_end = nullptr;
+    size_t side_len = 0;
+    const uint8_t *bases = nullptr, *bases_end = nullptr;
+    size_t base_count = 0;
+};
+
+size_t payload_length(const uint8_t *in, const uint8_t *end);
+
+// finds the parts of the packed DNA block at in, which holds raw_len bytes
+DnaParts read_dna_parts(const uint8_t *in, const uint8_t *end, size_t raw_len)
+{
+    ByteReader payload(in, end);
+    if (payload.varint() != raw_len || raw_len == 0)
+    {
+        throw runtime_error("block length mismatch");
+    }
+    payload.varint();
+    DnaParts parts;
+    parts.side = payload.p;
+    parts.side_len = ByteReader(payload.p, end).varint();
+    // a side text takes at most 3 bytes per byte of the block, where bases
+    // and exceptions alternate
+    if (parts.side_len > 3 * raw_len + 20 || is_dna_block(payload.p, end))
+    {
+        throw runtime_error("corrupt DNA block");
+    }
+    payload.take(payload_length(payload.p, end));
+    parts.side_end = payload.p;
+    parts.base_count = payload.varint();
+    if (parts.base_count > raw_len)
+    {
+        throw runtime_error("corrupt DNA block");
+    }
+    parts.bases = parts.bases_end = payload.p;
+    if (parts.base_count != 0)
+    {
+        if (ByteReader(payload.p, end).varint() != parts.base_count || is_dna_block(payload.p, end))
+        {
+            throw runtime_error("corrupt DNA block");
+        }
+        payload.take(payload_length(payload.p, end));
+        parts.bases_end = payload.p;
+    }
+    return parts;
+}
+
+// the length of the current-layout block payload at in[0, end - in),
+// found by walking its fields without decoding the BWT. throws
+// TruncatedInput while the payload runs past end
+size_t payload_length(const uint8_t *in, const uint8_t *end)
+{
+    ByteReader payload(in, end);
+    BlockHeader header;
+    size_t raw_len = ByteReader(in, end).varint();
+    if (is_dna_block(in, end))
+    {
+        DnaParts parts = read_dna_parts(in, end, raw_len);
+        return parts.bases_end - in;
+    }
+    read_block_header(payload, raw_len, header);
+    if (is_mtf_block(payload))
+    {
+        skip_mtf(payload, raw_len);
+    }
+    else
+    {
+        skip_wt(payload, raw_len);
+    }
+    size_t rate = payload.varint();
+    if (rate != 0)
+    {
+        size_t count = (raw_len + rate - 1) / rate;
+        payload.take(8 * ((raw_len + 64) / 64));
+        for (size_t v = 0; v < 2; v++)
+        {
+            size_t width = payload.varint();
+            if (width == 0 || width > 64)
+            {
+                throw runtime_error("corrupt suffix samples");
+            }
+            payload.take(8 * ((count * width + 63) / 64 + 1));
+        }
+    }
+    return payload.p - in;
+}
+
+// decodes one block payload into out[0, raw_len)
+void decompress_block(const uint8_t *in, const uint8_t *end, uint8_t *out, size_t raw_len)
+{
+    if (is_dna_block(in, end))
+    {
+        // the bases decode into the back of out, where merge_dna expects
+        // them
+        DnaParts parts = read_dna_parts(in, end, raw_len);
+        vector<uint8_t> side(parts.side_len);
+        decompress_block(parts.side, parts.side_end, side.data(), side.size());
+        if (parts.base_count != 0)
+        {
+            decompress_block(parts.bases, parts.bases_end, out + raw_len - parts.base_count, parts.base_count);
+        }
+        merge_dna(side.data(), side.size(), out, raw_len, parts.base_count);
+        return;
+    }
+    ByteReader payload(in, end);
+    BlockHeader header;
+    read_block_header(payload, raw_len, header);
+
+    vector<uint8_t> bwt(raw_len);
+    if (is_mtf_block(payload))
+    {
+        mtf_decode(payload, bwt.data(), raw_len);
+    }
+    else
+    {
+        WaveletTree wt;
+        read_wt(wt, payload, raw_len);
+        vector<uint8_t> scratch(raw_len);
+        wt_sequence(wt, bwt.data(), scratch.data());
+    }
+
+    unbwt(bwt.data(), raw_len, header.primary, header.rows, header.step, out);
+}
+
+// parses an index table; the payloads are laid out back to back over
+// [payload_begin, payload_end) of the container. with skips, entries of
+// raw_len 0 are regions an append left behind and are passed over.
+ContainerIndex parse_index(ByteReader &in, size_t payload_begin, size_t payload_end, bool skips = false)
+{
+    ContainerIndex index;
+    index.block_size = in.varint();
+    size_t block_count = in.varint();
+    if (block_count > in.left() / 2)
+    {
+        throw runtime_error("truncated container");
+    }
+
+    index.raw_len.reserve(block_count);
+    index.raw_offset.reserve(block_count);
+    index.comp_len.reserve(block_count);
+    index.comp_offset.reserve(block_count);
+    size_t offset = payload_begin;
+    for (size_t b = 0; b < block_count; b++)
+    {
+        size_t raw_len = in.varint(), comp_len = in.varint();
+        if (payload_end - offset < comp_len)
+        {
+            throw runtime_error("truncated container");
+        }
+        if (raw_len != 0 || !skips)
+        {
+            index.raw_len.push_back(raw_len);
+            index.comp_len.push_back(comp_len);
+            index.raw_offset.push_back(index.raw_total);
+            index.comp_offset.push_back(offset);
+            index.raw_total += raw_len;
+        }
+        offset += comp_len;
+    }
+    return index;
+}
+
+// reads the index of a container of in_len bytes through read_at(pos, len),
+// which returns the bytes [pos, pos + len) until its next call: the head,
+// the footer and the index table
+template <class ReadAt>
+ContainerIndex read_index(size_t in_len, ReadAt read_at)
+{
+    size_t head_len = sizeof(CONTAINER_MAGIC) + 1;
+    if (in_len < sizeof(CONTAINER_MAGIC) ||
+        memcmp(read_at(0, sizeof(CONTAINER_MAGIC)), CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) != 0)
+    {
+        throw runtime_error("not a tlz container");
+    }
+    if (in_len < head_len + FOOTER_SIZE)
+    {
+        throw runtime_error("truncated container");
+    }
+    uint8_t version = read_at(sizeof(CONTAINER_MAGIC), 1)[0];
+    const uint8_t *bytes = read_at(in_len - FOOTER_SIZE, FOOTER_SIZE);
+    ByteReader footer(bytes, bytes + FOOTER_SIZE);
+    size_t index_len = footer.u64();
+    uint8_t footer_version = footer.u8();
+    if (memcmp(footer.take(sizeof(CONTAINER_MAGIC)), CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) != 0 ||
+        (footer_version != version && footer_version != CONTAINER_VERSION) ||
+        index_len > in_len - head_len - FOOTER_SIZE)
+    {
+        throw runtime_error("corrupt container footer");
+    }
+    if (version != CONTAINER_VERSION_DNA && version != CONTAINER_VERSION_BYTES)
+    {
+        throw runtime_error("unsupported container version " + to_string(version));
+    }
+    size_t payload_end = in_len - FOOTER_SIZE - index_len;
+    bytes = read_at(payload_end, index_len);
+    ByteReader table(bytes, bytes + index_len);
+    return parse_index(table, head_len, payload_end, footer_version == CONTAINER_VERSION);
+}
+
+ContainerIndex read_container(const uint8_t *in, size_t in_len)
+{
+    return read_index(in_len, [&](size_t pos, size_t len)
+    {
+        if (pos > in_len || len > in_len - pos)
+        {
+            throw runtime_error("truncated container");
+        }
+        return in + pos;
+    });
+}
+
+// reads only the index of a container file
+ContainerIndex read_container(istream &in)
+{
+    in.seekg(0, ios::end);
+    size_t in_len = in.tellg();
+    string buf;
+    return read_index(in_len, [&](size_t pos, size_t len)
+    {
+        buf.resize(len);
+        in.seekg(pos, ios::beg);
+        if (!in.read(buf.data(), len))
+        {
+            throw runtime_error("truncated container");
+        }
+        return (const uint8_t *)buf.data();
+    });
+}
+
+// decodes a whole container held in memory
+string decompress_blocks(const uint8_t *in, size_t in_len, unsigned threads)
+{
+    ContainerIndex index = read_container(in, in_len);
+    string out(index.raw_total, 0);
+    for_each_block(index.size(), threads, [&](size_t b)
+    {
+        const uint8_t *block = in + index.comp_offset[b];
+        decompress_block(block, block + index.comp_len[b], (uint8_t *)out.data() + index.raw_offset[b], index.raw_len[b]);
+    });
+    return out;
+}
+
+// decodes text[offset, offset + len) of a container file, reading its index
+// and the payloads of the blocks that overlap the range and nothing else
+string decompress_range(istream &in, size_t offset, size_t len, unsigned threads)
+{
+    ContainerIndex index = read_container(in);
+    offset = min(offset, index.raw_total);
+    len = min(len, index.raw_total - offset);
+    if (len == 0)
+    {
+        return string();
+    }
+    size_t first = index.block_at(offset), last = index.block_at(offset + len - 1);
+
+    vector<string> payload(last - first + 1), text(last - first + 1);
+    for (size_t b = first; b <= last; b++)
+    {
+        payload[b - first].resize(index.comp_len[b]);
+        in.seekg(index.comp_offset[b], ios::beg);
+        if (!in.read(payload[b - first].data(), index.comp_len[b]))
+        {
+            throw runtime_error("truncated container");
+        }
+    }
+    for_each_block(payload.size(), threads, [&](size_t k)
+    {
+        const uint8_t *block = (const uint8_t *)payload[k].data();
+        text[k].resize(index.raw_len[first + k]);
+        decompress_block(block, block + payload[k].size(), (uint8_t *)text[k].data(), text[k].size());
+        string().swap(payload[k]);
+    });
+
+    string out;
+    out.reserve(len);
+    for (size_t b = first; b <= last; b++)
+    {
+        size_t begin = max(offset, index.raw_offset[b]) - index.raw_offset[b];
+        size_t end = min(offset + len, index.raw_offset[b] + index.raw_len[b]) - index.raw_offset[b];
+        out.append(text[b - first], begin, end - begin);
+    }
+    return out;
+}
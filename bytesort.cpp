@@ -0,0 +1,674 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <type_traits>
+
+#include "bitvector.cpp"
+#include "suffix.cpp"
+#include "threadpool.cpp"
+
+using namespace std;
+
+// SA-IS over a read-only text of characters below sigma. Solver rewrites
+// its text with bucket indices and so needs an I-wide copy of it; this one
+// reads T in place and keeps the L/S types in a bitvector and the buckets
+// in two sigma-entry tables, taken from `scratch` when it is long enough.
+// sa gets the n + 1 suffixes of T plus a sentinel, sa[0] = n.
+//
+// the reduced string is built inside sa, and recursed on with the free
+// middle of sa as the next level's scratch; when the buckets do not fit
+// there, it goes to the in-place Solver instead.
+//
+// the passes are parallel on a shared pool: histogram, types, LMS seeding,
+// compaction, naming and mapping back run on ranges, and induced sorting
+// goes in batches, where the workers read the batch's suffixes, their
+// types and preceding characters, which is where the cache misses are,
+// and one thread then moves them into the buckets. the output is the same
+// for any pool size.
+//
+// T is only ever indexed, so Text may be any type whose operator[] gives
+// the characters, such as a PackedBases of 2-bit codes.
+template <class C, class I, class Stats = NoStats, class Text = const C *>
+class InducedSorter
+{
+public:
+    static constexpr I EMPTY = numeric_limits<I>::max();
+
+    Text T;
+    I n;
+    I *sa;
+    size_t sigma;
+    ThreadPool &pool;
+    Stats &stats;
+    BitVector stype; // bit i: suffix i is S-type, as is the sentinel's
+    I *bucket_begin, *bucket_end;
+
+    InducedSorter(Text T, I n, I *sa, size_t sigma, ThreadPool &pool, I *scratch = nullptr, size_t scratch_len = 0,
+                  Stats &stats = default_stats<Stats>())
+        : T(T), n(n), sa(sa), sigma(sigma), pool(pool), stats(stats), stype(n + 1)
+    {
+        if (scratch_len < 2 * sigma)
+        {
+            bucket_storage.resize(2 * sigma);
+            scratch = bucket_storage.data();
+        }
+        bucket_begin = scratch;
+        bucket_end = scratch + sigma;
+    }
+
+    bool is_lms(I i) const
+    {
+        return i > 0 && stype[i] && !stype[i - 1];
+    }
+
+    void solve()
+    {
+        stats.level_begin("induced", n, sigma);
+        if (place_sorted_lms())
+        {
+            induce();
+        }
+        stats.level_end();
+    }
+
+    // solve(), handing every row to settled(i, j, c) as soon as it is
+    // final: row i holds suffix j, and c = T[j - 1] is its BWT character
+    // (0 for j = 0). rows come in descending order, and settled may
+    // overwrite sa at entries i and up
+    template <class F>
+    void solve(F settled)
+    {
+        stats.level_begin("induced", n, sigma);
+        if (place_sorted_lms())
+        {
+            induce(settled);
+        }
+        else
+        {
+            settled(0, n, 0);
+        }
+        stats.level_end();
+    }
+
+private:
+    // everything up to the last induced sort: the LMS suffixes, sorted, at
+    // the ends of their buckets. false for the empty text, whose sa is
+    // complete already
+    bool place_sorted_lms()
+    {
+        sa[0] = n;
+        if (n == 0)
+        {
+            return false;
+        }
+        classify();
+
+        // sort the LMS substrings by one round of induced sorting
+        fill_empty(1, n + 1);
+        place_seeds();
+        induce();
+
+        // compact them into sa[0, n1), in sorted order
+        I n1;
+        {
+            [[maybe_unused]] auto timer = stats.time("compact");
+            n1 = compact(0, n + 1, [&](I j) { return is_lms(j); });
+        }
+
+        // name them: equal substrings share a name, the sentinel gets 0.
+        // LMS positions are at least two apart, so pos / 2 is a free slot
+        // of sa[n1, n]
+        fill_empty(n1, n + 1);
+        I name = name_substrings(n1);
+
+        // gather the names in text order at the end of sa: that is the
+        // reduced string, ending in its sentinel
+        I *t1 = sa + n + 1 - n1;
+        {
+            [[maybe_unused]] auto timer = stats.time("construct_t1");
+            compact(n1, n + 1, [&](I j) { return j != EMPTY; });
+            memmove(t1, sa + n1, n1 * sizeof(I));
+        }
+        stats.level_reduced(n1, name, name + 1 < n1);
+
+        // suffix sort it into sa[0, n1). its last character is its sentinel,
+        // so the rest of it is a text for the next level as it stands
+        size_t free_len = n + 1 - 2 * n1;
+        if (name + 1 < n1 && free_len >= 2 * (name + 1))
+        {
+            InducedSorter<I, I, Stats>(t1, n1 - 1, sa, name + 1, pool, sa + n1, free_len, stats).solve();
+        }
+        else if (name + 1 < n1)
+        {
+            fill(sa, sa + n1, 0);
+            if (n1 <= (I)numeric_limits<uint16_t>::max())
+            {
+                solve_reduced<uint16_t>(t1, n1, name);
+            }
+            else if (sizeof(I) > sizeof(uint32_t) && n1 <= (I)numeric_limits<uint32_t>::max())
+            {
+                solve_reduced<uint32_t>(t1, n1, name);
+            }
+            else
+            {
+                Solver<I, I, Stats>(span<I>(t1, n1), span<I>(sa, n1), name, stats).solve(true);
+            }
+        }
+        else
+        {
+            for (I i = 0; i < n1; i++)
+            {
+                sa[t1[i]] = i;
+            }
+        }
+
+        // turn the ranks back into text positions and drop every LMS
+        // suffix at the end of its bucket, largest first
+        {
+            [[maybe_unused]] auto timer = stats.time("place_lms");
+            list_lms(t1);
+            run_ranges(split(n1, 1), [&](size_t, size_t begin, size_t end)
+            {
+                for (size_t k = begin; k < end; k++)
+                {
+                    sa[k] = t1[sa[k]];
+                }
+            });
+            fill_empty(n1, n + 1);
+            reset_ends();
+            for (I k = n1; k-- > 1;)
+            {
+                I p = sa[k];
+                sa[k] = EMPTY;
+                sa[--bucket_end[T[p]]] = p;
+            }
+            sa[0] = n;
+        }
+        return true;
+    }
+
+    // one induced suffix of a batch: the SA entry j it came from, and p =
+    // j - 1 with its character c, or p = EMPTY when nothing is induced
+    struct Induced
+    {
+        I j, p;
+        C c;
+    };
+    static constexpr size_t BATCH_PER_THREAD = 1 << 14;
+    // alphabets up to this size are counted in per-range tables; larger
+    // ones in one shared table
+    static constexpr size_t RANGE_COUNTS_SIGMA = 1 << 12;
+
+    vector<I> bucket_storage;
+
+    // [0, len) cut into about one range per thread, each a multiple of
+    // align long but the last; trailing ranges may be empty
+    struct Ranges
+    {
+        size_t len, parts, step;
+
+        size_t begin(size_t r) const
+        {
+            return min(len, r * step);
+        }
+
+        size_t end(size_t r) const
+        {
+            return r + 1 == parts ? len : min(len, (r + 1) * step);
+        }
+    };
+
+    Ranges split(size_t len, size_t align) const
+    {
+        size_t parts = min<size_t>(pool.size(), max<size_t>(1, len / (align * 16)));
+        return {len, parts, (len / parts + align - 1) / align * align};
+    }
+
+    // fn(r, begin, end) for every range, on the pool
+    template <class F>
+    void run_ranges(const Ranges &ranges, F fn)
+    {
+        pool.run(ranges.parts, [&](size_t r) { fn(r, ranges.begin(r), ranges.end(r)); });
+    }
+
+    void classify()
+    {
+        [[maybe_unused]] auto timer = stats.time("classify");
+        // bucket sizes, from per-range histograms for a small alphabet.
+        // ranges are 64-aligned, so each owns whole words of stype
+        Ranges ranges = split(n, 64);
+        if (sigma <= RANGE_COUNTS_SIGMA)
+        {
+            vector<I> count(ranges.parts * sigma, 0);
+            run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+            {
+                I *c = count.data() + r * sigma;
+                for (size_t i = begin; i < end; i++)
+                {
+                    c[T[i]]++;
+                }
+            });
+            for (size_t c = 0; c < sigma; c++)
+            {
+                bucket_begin[c] = 0;
+                for (size_t r = 0; r < ranges.parts; r++)
+                {
+                    bucket_begin[c] += count[r * sigma + c];
+                }
+            }
+        }
+        else
+        {
+            fill(bucket_begin, bucket_begin + sigma, 0);
+            run_ranges(ranges, [&](size_t, size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; i++)
+                {
+                    atomic_ref<I>(bucket_begin[T[i]]).fetch_add(1, memory_order_relaxed);
+                }
+            });
+        }
+        I sum = 1; // slot 0 is the sentinel's
+        for (size_t c = 0; c < sigma; c++)
+        {
+            I count = bucket_begin[c];
+            bucket_begin[c] = sum;
+            sum += count;
+        }
+
+        // types right to left within each range. suffix i takes the type of
+        // i + 1 when T[i] == T[i + 1], so a range whose last characters
+        // continue into the next range leaves that run L for now, and the
+        // runs are settled afterwards from the last range back
+        vector<I> run_begin(ranges.parts, EMPTY);
+        stype.set_range(n, 1);
+        run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+        {
+            if (begin == end)
+            {
+                return;
+            }
+            bool known = end == n || T[end - 1] != T[end];
+            bool s = end < n && T[end - 1] < T[end];
+            for (size_t i = end; i-- > begin;)
+            {
+                if (i + 1 < end && T[i] != T[i + 1])
+                {
+                    s = T[i] < T[i + 1];
+                    if (!known)
+                    {
+                        run_begin[r] = i + 1;
+                        known = true;
+                    }
+                }
+                if (s)
+                {
+                    stype.words[i / 64] |= 1ull << (i % 64);
+                }
+            }
+            if (!known)
+            {
+                run_begin[r] = begin;
+            }
+        });
+        for (size_t r = ranges.parts; r-- > 0;)
+        {
+            size_t end = ranges.end(r);
+            if (run_begin[r] != EMPTY && stype[end])
+            {
+                stype.set_range(run_begin[r], end - run_begin[r]);
+            }
+        }
+    }
+
+    void reset_ends()
+    {
+        for (size_t c = 0; c + 1 < sigma; c++)
+        {
+            bucket_end[c] = bucket_begin[c + 1];
+        }
+        bucket_end[sigma - 1] = n + 1;
+    }
+
+    void fill_empty(size_t begin, size_t end)
+    {
+        run_ranges(split(end - begin, 1), [&](size_t, size_t b, size_t e)
+        {
+            fill(sa + begin + b, sa + begin + e, EMPTY);
+        });
+    }
+
+    // the LMS suffixes of T at the ends of their buckets, in descending
+    // text order within each bucket
+    void place_seeds()
+    {
+        [[maybe_unused]] auto timer = stats.time("place_seeds");
+        reset_ends();
+        Ranges ranges = split(n, 64);
+        if (sigma > RANGE_COUNTS_SIGMA || ranges.parts == 1)
+        {
+            for (I i = n; i-- > 1;)
+            {
+                if (is_lms(i))
+                {
+                    sa[--bucket_end[T[i]]] = i;
+                }
+            }
+            return;
+        }
+        vector<I> count(ranges.parts * sigma, 0);
+        run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+        {
+            I *c = count.data() + r * sigma;
+            for (size_t i = max<size_t>(begin, 1); i < end; i++)
+            {
+                if (is_lms(i))
+                {
+                    c[T[i]]++;
+                }
+            }
+        });
+        // range r fills its share of each bucket below those of the ranges
+        // after it
+        for (size_t c = 0; c < sigma; c++)
+        {
+            I end = bucket_end[c];
+            for (size_t r = ranges.parts; r-- > 0;)
+            {
+                I k = count[r * sigma + c];
+                count[r * sigma + c] = end;
+                end -= k;
+            }
+        }
+        run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+        {
+            I *c = count.data() + r * sigma;
+            for (size_t i = end; i-- > max<size_t>(begin, 1);)
+            {
+                if (is_lms(i))
+                {
+                    sa[--c[T[i]]] = i;
+                }
+            }
+        });
+    }
+
+    // moves the entries of sa[begin, end) that satisfy keep to the front of
+    // the range, in order, and returns how many there are. every range
+    // packs its own entries first; the packed runs then slide down one
+    // after the other
+    template <class F>
+    I compact(size_t begin, size_t end, F keep)
+    {
+        Ranges ranges = split(end - begin, 1);
+        vector<size_t> kept(ranges.parts, 0);
+        run_ranges(ranges, [&](size_t r, size_t b, size_t e)
+        {
+            I *out = sa + begin + b;
+            for (I *x = sa + begin + b; x < sa + begin + e; x++)
+            {
+                if (keep(*x))
+                {
+                    *out++ = *x;
+                }
+            }
+            kept[r] = out - (sa + begin + b);
+        });
+        size_t out = begin;
+        for (size_t r = 0; r < ranges.parts; r++)
+        {
+            memmove(sa + out, sa + begin + ranges.begin(r), kept[r] * sizeof(I));
+            out += kept[r];
+        }
+        return out - begin;
+    }
+
+    // names the sorted LMS substrings in sa[0, n1) into sa[n1 + pos / 2]
+    // and returns the largest name. the comparisons are counted per range
+    // first, so each range knows the name it starts from
+    I name_substrings(I n1)
+    {
+        [[maybe_unused]] auto timer = stats.time("name_substrings");
+        Ranges ranges = split(n1, 64);
+        vector<I> names(ranges.parts + 1, 0);
+        run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+        {
+            for (size_t k = max<size_t>(begin, 1); k < end; k++)
+            {
+                names[r + 1] += !same_lms_substring(sa[k - 1], sa[k]);
+            }
+        });
+        for (size_t r = 0; r < ranges.parts; r++)
+        {
+            names[r + 1] += names[r];
+        }
+        run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+        {
+            I name = names[r];
+            for (size_t k = max<size_t>(begin, 1); k < end; k++)
+            {
+                name += !same_lms_substring(sa[k - 1], sa[k]);
+                sa[n1 + sa[k] / 2] = name;
+            }
+        });
+        sa[n1 + n / 2] = 0;
+        return names[ranges.parts];
+    }
+
+    // the LMS positions 1 <= i <= n, in text order, into out
+    void list_lms(I *out)
+    {
+        auto lms_word = [&](size_t w)
+        {
+            uint64_t x = stype.words[w];
+            return x & ~((x << 1) | (w > 0 ? stype.words[w - 1] >> 63 : 1));
+        };
+        Ranges ranges = split(stype.words.size(), 64);
+        vector<I> offset(ranges.parts + 1, 0);
+        run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+        {
+            for (size_t w = begin; w < end; w++)
+            {
+                offset[r + 1] += __builtin_popcountll(lms_word(w));
+            }
+        });
+        for (size_t r = 0; r < ranges.parts; r++)
+        {
+            offset[r + 1] += offset[r];
+        }
+        run_ranges(ranges, [&](size_t r, size_t begin, size_t end)
+        {
+            I *p = out + offset[r];
+            for (size_t w = begin; w < end; w++)
+            {
+                for (uint64_t x = lms_word(w); x != 0; x &= x - 1)
+                {
+                    *p++ = 64 * w + __builtin_ctzll(x);
+                }
+            }
+        });
+    }
+
+    // L-type suffixes left to right from the bucket heads, then S-type
+    // suffixes right to left from the bucket tails. a row is final once the
+    // second scan reaches it, which is when settled, if given, sees it
+    template <class F = nullptr_t>
+    void induce(F settled = nullptr)
+    {
+        constexpr bool visit = !is_same_v<F, nullptr_t>;
+        [[maybe_unused]] auto timer = stats.time("induce");
+        I *head = bucket_end;
+        copy(bucket_begin, bucket_begin + sigma, head);
+        if (pool.size() == 1)
+        {
+            for (I i = 0; i <= n; i++)
+            {
+                I j = sa[i];
+                if (j != EMPTY && j > 0 && !stype[j - 1])
+                {
+                    sa[head[T[j - 1]]++] = j - 1;
+                }
+            }
+            reset_ends();
+            for (I i = n + 1; i-- > 0;)
+            {
+                I j = sa[i];
+                if constexpr (visit)
+                {
+                    settled(i, j, j > 0 ? T[j - 1] : 0);
+                }
+                if (j != EMPTY && j > 0 && stype[j - 1])
+                {
+                    sa[--bucket_end[T[j - 1]]] = j - 1;
+                }
+            }
+            return;
+        }
+
+        size_t batch = BATCH_PER_THREAD * pool.size();
+        vector<Induced> induced(batch);
+        for (size_t begin = 0; begin <= n; begin += batch)
+        {
+            size_t end = min<size_t>(n + 1, begin + batch);
+            gather(induced.data(), begin, end, false);
+            for (size_t i = begin; i < end; i++)
+            {
+                Induced x = recheck(induced[i - begin], i, false);
+                if (x.p != EMPTY)
+                {
+                    sa[head[x.c]++] = x.p;
+                }
+            }
+        }
+        reset_ends();
+        for (size_t end = n + 1; end > 0;)
+        {
+            size_t begin = end > batch ? end - batch : 0;
+            gather(induced.data(), begin, end, true, visit);
+            for (size_t i = end; i-- > begin;)
+            {
+                Induced x = recheck(induced[i - begin], i, true, visit);
+                if constexpr (visit)
+                {
+                    settled(i, x.j, x.c);
+                }
+                if (x.p != EMPTY)
+                {
+                    sa[--bucket_end[x.c]] = x.p;
+                }
+            }
+            end = begin;
+        }
+    }
+
+    // what the suffix before each of sa[begin, end) is, when its type is s.
+    // with chars, c is the preceding character whatever its type
+    void gather(Induced *out, size_t begin, size_t end, bool s, bool chars = false)
+    {
+        run_ranges(split(end - begin, 64), [&](size_t, size_t b, size_t e)
+        {
+            for (size_t i = begin + b; i < begin + e; i++)
+            {
+                out[i - begin] = induced_by(sa[i], s, chars);
+            }
+        });
+    }
+
+    Induced induced_by(I j, bool s, bool chars = false) const
+    {
+        if (j != EMPTY && j > 0 && stype[j - 1] == s)
+        {
+            return {j, j - 1, T[j - 1]};
+        }
+        return {j, EMPTY, chars && j != EMPTY && j > 0 ? T[j - 1] : C(0)};
+    }
+
+    // a gathered entry, redone when the scan has written sa[i] since: a
+    // batch may induce into itself
+    Induced recheck(Induced x, size_t i, bool s, bool chars = false) const
+    {
+        return sa[i] == x.j ? x : induced_by(sa[i], s, chars);
+    }
+
+    // LMS substrings run from one LMS position to the next, inclusive; the
+    // sentinel's is unique
+    bool same_lms_substring(I a, I b) const
+    {
+        for (I d = 0;; d++)
+        {
+            if (a + d == n || b + d == n)
+            {
+                return false;
+            }
+            if (T[a + d] != T[b + d] || stype[a + d] != stype[b + d])
+            {
+                return false;
+            }
+            if (d > 0 && (is_lms(a + d) || is_lms(b + d)))
+            {
+                return is_lms(a + d) && is_lms(b + d);
+            }
+        }
+    }
+
+    // packs the names into U characters at the start of their own region
+    // (U is never wider than I, so the forward copy is safe) and sorts them
+    template <class U>
+    void solve_reduced(I *t1, I n1, I max_name)
+    {
+        U *packed = reinterpret_cast<U *>(t1);
+        for (I i = 0; i < n1; i++)
+        {
+            packed[i] = (U)t1[i];
+        }
+        Solver<U, I, Stats>(span<U>(packed, n1), span<I>(sa, n1), (U)max_name, stats).solve(true);
+    }
+};
+
+// how many characters a text type has: a byte pointer 256, a packed text
+// its own sigma
+template <class Text>
+constexpr size_t text_sigma = Text::sigma;
+template <>
+constexpr size_t text_sigma<const uint8_t *> = 256;
+
+// the suffix array of n bytes, sorted on `threads` threads
+template <class I, class Stats = NoStats>
+void sort_bytes(const uint8_t *T, I n, I *sa, unsigned threads = 1, Stats &stats = default_stats<Stats>())
+{
+    ThreadPool pool(threads);
+    InducedSorter<uint8_t, I, Stats>(T, n, sa, 256, pool, nullptr, 0, stats).solve();
+}
+
+// the BWT of n characters, taken from the last induced sort of sort_bytes as its
+// rows settle rather than by a pass over the finished suffix array. the n
+// BWT bytes, the sentinel's row left out, end up at the front of sa viewed
+// as bytes; each row's byte is parked at (width - 1) * (n + 1) + i, past
+// the entries the sort still needs, and slid down at the end. row(i, j)
+// sees every row i and its suffix j, in descending order. returns the row
+// of suffix 0, whose BWT character is the sentinel. T is a byte pointer or
+// a packed text such as PackedBases
+template <class Text, class I, class F, class Stats = NoStats>
+I bwt_bytes(Text T, I n, I *sa, unsigned threads, F row, Stats &stats = default_stats<Stats>())
+{
+    ThreadPool pool(threads);
+    uint8_t *parked = reinterpret_cast<uint8_t *>(sa) + (sizeof(I) - 1) * ((size_t)n + 1);
+    I primary = 0;
+    InducedSorter<uint8_t, I, Stats, Text>(T, n, sa, text_sigma<Text>, pool, nullptr, 0, stats).solve([&](size_t i, I j, uint8_t c)
+    {
+        row(i, j);
+        if (j == 0)
+        {
+            primary = i;
+        }
+        parked[i] = c;
+    });
+    uint8_t *bwt = reinterpret_cast<uint8_t *>(sa);
+    memmove(bwt, parked, primary);
+    memmove(bwt + primary, parked + primary + 1, n - primary);
+    return primary;
+}
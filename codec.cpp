@@ -0,0 +1,411 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "block.cpp"
+
+using namespace std;
+
+// the library interface: a Compressor takes text and gives back a
+// container, a Decompressor the other way round, both a chunk at a time
+// through caller buffers and without touching a file. an instance holds
+// all of its state, and the code under it keeps none of its own, so any
+// number of them may run on different threads; one instance is not to be
+// shared between threads.
+//
+//     Compressor c(options);
+//     for each chunk:
+//         for (size_t used = 0; used < len;)
+//         {
+//             used += c.write(chunk + used, len - used);
+//             while (size_t got = c.read(buf, sizeof(buf))) sink(buf, got);
+//         }
+//     c.finish();
+//     while (size_t got = c.read(buf, sizeof(buf))) sink(buf, got);
+//
+// and the same with a Decompressor, whose finish() comes last and throws if
+// the container was cut short.
+
+// buffers at most one block of text and the compressed blocks not read yet.
+// write() takes no more than fills the current block while a compressed one
+// waits, so unread output holds back input rather than piling up; flush()
+// and finish() end the current block early, whatever is waiting.
+class Compressor
+{
+public:
+    explicit Compressor(const CompressOptions &options = CompressOptions())
+        : options(options), block_size(effective_block_size(options, SIZE_MAX)), version(container_version(options)),
+          output(container_head(version))
+    {
+    }
+
+    // takes up to len bytes of text and returns how many it took
+    size_t write(const void *data, size_t len)
+    {
+        if (finished)
+        {
+            throw runtime_error("write after finish");
+        }
+        const char *p = (const char *)data;
+        size_t taken = 0;
+        while (taken < len)
+        {
+            if (input.size() == block_size)
+            {
+                if (pending() != 0)
+                {
+                    break;
+                }
+                compress_input();
+            }
+            size_t step = min(len - taken, block_size - input.size());
+            input.append(p + taken, step);
+            taken += step;
+        }
+        if (input.size() == block_size && pending() == 0)
+        {
+            compress_input();
+        }
+        return taken;
+    }
+
+    // compresses the text taken so far as a block of its own, so that all
+    // of it can be read back out
+    void flush()
+    {
+        if (!input.empty())
+        {
+            compress_input();
+        }
+    }
+
+    // ends the container; what remains of it is then left to read()
+    void finish()
+    {
+        if (!finished)
+        {
+            flush();
+            output += container_index(block_size, block_count, table, version);
+            finished = true;
+        }
+    }
+
+    // copies up to cap bytes of the container into out and returns how many
+    size_t read(void *out, size_t cap)
+    {
+        size_t n = min(cap, pending());
+        memcpy(out, output.data() + output_pos, n);
+        output_pos += n;
+        if (output_pos == output.size())
+        {
+            output.clear();
+            output_pos = 0;
+        }
+        return n;
+    }
+
+    // starts a new container, keeping the buffers and the CompressionContext
+    // of the last one, so that a run of small inputs allocates once
+    void reset()
+    {
+        input.clear();
+        output.clear();
+        output += container_head(version);
+        output_pos = 0;
+        block_count = 0;
+        table.clear();
+        finished = false;
+    }
+
+    // bytes of the container ready to read
+    size_t pending() const
+    {
+        return output.size() - output_pos;
+    }
+
+    // whether the whole container has been read
+    bool done() const
+    {
+        return finished && pending() == 0;
+    }
+
+private:
+    CompressOptions options;
+    size_t block_size;
+    uint8_t version;
+    string input;  // text of the block being filled
+    string output; // container bytes not read yet, from output_pos
+    size_t output_pos = 0;
+    size_t block_count = 0;
+    string table; // raw_len | comp_len of every block so far
+    bool finished = false;
+    CompressionContext context;
+
+    void compress_input()
+    {
+        size_t begin = output.size();
+        compress_block(context, (const uint8_t *)input.data(), input.size(), options, output, options.threads);
+        put_varint(table, input.size());
+        put_varint(table, output.size() - begin);
+        block_count++;
+        input.clear();
+    }
+};
+
+// the least a Decompressor takes at a time while the payload it is filling
+// does not yet tell how long it is
+const size_t STREAM_STEP = size_t(1) << 16;
+
+// decodes a container as it arrives: each payload is known complete from
+// its own fields, and once `threads` of them are in, or the input ends
+// with an index, they are decoded at once; the stream ends with the index
+// its blocks imply. write() takes no more than completes the payload or
+// index being filled (at least STREAM_STEP), and nothing while decoded text
+// waits, so it buffers one round of payloads and its text. an index with
+// more container after it is one an append left behind, and is passed over
+// as the entry of no text the final index lists it as. only the current
+// container layout streams.
+class Decompressor
+{
+public:
+    explicit Decompressor(unsigned threads = 1) : threads(max(1u, threads)) {}
+
+    // takes up to len bytes of the container and returns how many it took
+    size_t write(const void *data, size_t len)
+    {
+        if (pending() != 0 || len == 0)
+        {
+            return 0;
+        }
+        size_t step = min(len, max(wanted, STREAM_STEP));
+        input.append((const char *)data, step);
+        advance();
+        return step;
+    }
+
+    // copies up to cap bytes of text into out and returns how many; 0 once
+    // everything written so far is out
+    size_t read(void *out, size_t cap)
+    {
+        size_t n = min(cap, pending());
+        memcpy(out, output.data() + output_pos, n);
+        output_pos += n;
+        if (output_pos == output.size())
+        {
+            output.clear();
+            output_pos = 0;
+            advance();
+        }
+        return n;
+    }
+
+    // declares the end of the container, once read() has returned 0:
+    // throws unless it was complete
+    void finish()
+    {
+        if (pending() != 0)
+        {
+            throw runtime_error("decoded text left unread");
+        }
+        if (!at_end())
+        {
+            throw runtime_error("truncated container");
+        }
+    }
+
+    // bytes of text ready to read
+    size_t pending() const
+    {
+        return output.size() - output_pos;
+    }
+
+    // whether the container ended and all of its text has been read
+    bool done() const
+    {
+        return at_end() && pending() == 0;
+    }
+
+private:
+    unsigned threads;
+    string input;         // container bytes, decoded up to input_pos
+    size_t input_pos = 0; // the start of the next payload
+    size_t scan_pos = 0;  // the end of the complete payloads found after it
+    size_t wanted = 0;    // bytes the payload or index at scan_pos lacks, at least
+    vector<size_t> begin, comp_len, raw_len; // the complete payloads found
+    string output; // text of the blocks decoded last, from output_pos
+    size_t output_pos = 0;
+    bool started = false;
+    bool appended = false; // whether an earlier index was passed over
+    uint8_t version = 0;   // the container's, once started
+    size_t block_count = 0;
+    string table; // raw_len | comp_len of every block so far, to match the index
+
+    // how the bytes from input[pos] compare with the index and footer that
+    // would end the container there
+    enum IndexMatch
+    {
+        NOT_INDEX,
+        INDEX_PREFIX,
+        INDEX_COMPLETE,
+    };
+
+    // index_len is set to the length of a complete index, which more of the
+    // container may follow. the index is compared piece by piece, as
+    // container_index() lays it out, and table in place: a payload differs
+    // within its first bytes, so a scan costs O(1) per payload, not a copy
+    // of the table.
+    IndexMatch match_index(size_t pos, size_t &index_len) const
+    {
+        const uint8_t *in = (const uint8_t *)input.data();
+        size_t left = input.size() - pos, block_size;
+        try
+        {
+            block_size = ByteReader(in + pos, in + input.size()).varint();
+        }
+        catch (const TruncatedInput &)
+        {
+            return INDEX_PREFIX;
+        }
+        catch (const runtime_error &)
+        {
+            return NOT_INDEX;
+        }
+        string head, footer;
+        put_varint(head, block_size);
+        put_varint(head, block_count);
+        put_u64(footer, head.size() + table.size());
+        footer.push_back((char)(appended ? CONTAINER_VERSION : version));
+        footer.append(CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+        const string *pieces[] = {&head, &table, &footer};
+        size_t at = pos;
+        for (const string *piece : pieces)
+        {
+            size_t n = min(piece->size(), input.size() - at);
+            if (memcmp(piece->data(), in + at, n) != 0)
+            {
+                return NOT_INDEX;
+            }
+            at += n;
+        }
+        index_len = head.size() + table.size() + footer.size();
+        return left >= index_len ? INDEX_COMPLETE : INDEX_PREFIX;
+    }
+
+    // whether the input left is exactly the index that ends the container
+    bool at_end() const
+    {
+        size_t index_len;
+        return started && begin.empty() && match_index(input_pos, index_len) == INDEX_COMPLETE &&
+               input_pos + index_len == input.size();
+    }
+
+    // finds the payloads completed since the last call, and decodes them
+    // once there are `threads` of them or the input ends with an index,
+    // unless text is waiting
+    void advance()
+    {
+        if (!started)
+        {
+            size_t head_len = sizeof(CONTAINER_MAGIC) + 1;
+            if (input.size() < head_len)
+            {
+                wanted = head_len - input.size();
+                return;
+            }
+            if (memcmp(input.data(), CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) != 0)
+            {
+                throw runtime_error("not a streamable tlz container");
+            }
+            version = input[sizeof(CONTAINER_MAGIC)];
+            if (version != CONTAINER_VERSION_DNA && version != CONTAINER_VERSION_BYTES)
+            {
+                throw runtime_error("unsupported container version " + to_string(version));
+            }
+            input_pos = scan_pos = head_len;
+            started = true;
+        }
+        if (pending() != 0)
+        {
+            return;
+        }
+        const uint8_t *in = (const uint8_t *)input.data();
+        bool at_index = false;
+        wanted = 0;
+        while (begin.size() < threads && scan_pos < input.size())
+        {
+            size_t index_len;
+            IndexMatch index = match_index(scan_pos, index_len);
+            if (index == INDEX_COMPLETE)
+            {
+                // the end, unless more of the container comes
+                if (scan_pos + index_len == input.size())
+                {
+                    at_index = true;
+                    break;
+                }
+                put_varint(table, 0);
+                put_varint(table, index_len);
+                block_count++;
+                appended = true;
+                scan_pos += index_len;
+                continue;
+            }
+            size_t len;
+            try
+            {
+                len = payload_length(in + scan_pos, in + input.size());
+            }
+            catch (const TruncatedInput &e)
+            {
+                wanted = e.missing;
+                break;
+            }
+            catch (const runtime_error &)
+            {
+                // the start of the index need not parse as a payload
+                if (index == INDEX_PREFIX)
+                {
+                    break;
+                }
+                throw;
+            }
+            begin.push_back(scan_pos);
+            comp_len.push_back(len);
+            raw_len.push_back(ByteReader(in + scan_pos, in + scan_pos + len).varint());
+            put_varint(table, raw_len.back());
+            put_varint(table, len);
+            block_count++;
+            scan_pos += len;
+        }
+        if (begin.size() < threads && !at_index)
+        {
+            return;
+        }
+        vector<size_t> raw_offset(begin.size());
+        size_t raw_total = 0;
+        for (size_t k = 0; k < begin.size(); k++)
+        {
+            raw_offset[k] = raw_total;
+            raw_total += raw_len[k];
+        }
+        output.resize(raw_total);
+        for_each_block(begin.size(), threads, [&](size_t k)
+        {
+            decompress_block(in + begin[k], in + begin[k] + comp_len[k], (uint8_t *)output.data() + raw_offset[k], raw_len[k]);
+        });
+        begin.clear();
+        comp_len.clear();
+        raw_len.clear();
+        input_pos = scan_pos;
+        // what was decoded is dropped once it outweighs what is left
+        if (input_pos >= input.size() - input_pos)
+        {
+            input.erase(0, input_pos);
+            scan_pos -= input_pos;
+            input_pos = 0;
+        }
+    }
+};
@@ -1,67 +1,489 @@
-#include "suffix.cpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mapfile.cpp"
 #include "mywt.cpp"
+#include "block.cpp"
+#include "codec.cpp"
+#include "batch.cpp"
+#include "append.cpp"
+#include "fmindex.cpp"
 
-int main(int argc, char const *argv[])
+// accepts plain byte counts or a K/M/G suffix
+size_t parse_size(const char *s)
 {
+    char *end;
+    size_t v = strtoull(s, &end, 10);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        break;
+    default:
+        break;
+    }
+    return v;
+}
 
-    string filename, output_name;
-    if (argc == 1)
+// tlz count|locate archive pattern and tlz extract archive offset len:
+// queries on the archived text that do not decompress it
+int query_command(const string &command, const string &filename, const string &arg1, const string &arg2, unsigned threads)
+{
+    bool regular;
+    size_t archive_len;
+    int fd = open_input(filename, regular, archive_len);
+    if (fd < 0 || !regular)
     {
-        printf("enter filename.");
+        printf("file not find.");
         return -1;
     }
+    try
+    {
+        if (command == "extract")
+        {
+            // a slice opens only the blocks it overlaps, read in place
+            MappedFile archive(fd, archive_len);
+            close(fd);
+            string text = extract(archive.data, archive.size, parse_size(arg1.c_str()), parse_size(arg2.c_str()), threads);
+            fwrite(text.data(), 1, text.size(), stdout);
+            return 0;
+        }
+        vector<FMIndex> blocks;
+        {
+            MappedFile archive(fd, archive_len, MADV_SEQUENTIAL);
+            close(fd);
+            open_fm_indexes(archive.data, archive.size, threads, blocks);
+        }
+        if (command == "count")
+        {
+            printf("%zu\n", count(blocks, arg1));
+        }
+        else
+        {
+            for (size_t pos : locate(blocks, arg1))
+            {
+                printf("%zu\n", pos);
+            }
+        }
+    }
+    catch (const exception &e)
+    {
+        printf("%s: %s\n", filename.c_str(), e.what());
+        return -1;
+    }
+    return 0;
+}
 
-    filename = argv[1];
-    output_name = filename + ".gama.lz";
-
-    std::size_t T_len;
-    char *T;
-    ifstream infile;
-
-    infile.open(filename.c_str(), ios::in);
-    if (!infile)
+// tlz list archive: the members of a batch archive, a line each with the
+// length of the file and its name
+int list_command(const string &filename)
+{
+    bool regular;
+    size_t archive_len;
+    int fd = open_input(filename, regular, archive_len);
+    if (fd < 0 || !regular)
     {
         printf("file not find.");
-        exit(-1);
+        return -1;
+    }
+    try
+    {
+        MappedFile archive(fd, archive_len);
+        close(fd);
+        for (const BatchMember &m : read_batch_table(archive.data, archive.size))
+        {
+            printf("%zu %s\n", read_container(archive.data + m.offset, m.length).raw_total, m.name.c_str());
+        }
+    }
+    catch (const exception &e)
+    {
+        printf("%s: %s\n", filename.c_str(), e.what());
+        return -1;
     }
+    return 0;
+}
 
-    infile.seekg(0, ios::end);
-    T_len = infile.tellg();
+int main(int argc, char const *argv[])
+{
+    if (argc == 3 && string(argv[1]) == "list")
+    {
+        return list_command(argv[2]);
+    }
+    if (argc > 1 && (string(argv[1]) == "count" || string(argv[1]) == "locate" || string(argv[1]) == "extract"))
+    {
+        string command = argv[1];
+        if (argc != (command == "extract" ? 5 : 4))
+        {
+            printf("usage: tlz count|locate archive pattern\n       tlz extract archive offset len\n");
+            return -1;
+        }
+        return query_command(command, argv[2], argv[3], command == "extract" ? argv[4] : "", max(1u, thread::hardware_concurrency()));
+    }
 
-    T = new char[T_len + 1]();
-    infile.seekg(0, ios::beg);
-    infile.read(T, T_len);
-    T[T_len] = 0;
+    string filename, output_name;
+    CompressOptions options;
+    options.threads = max(1u, thread::hardware_concurrency());
+    bool decompress = false;
+    string range;
+    // tlz batch takes any number of paths, see batch_command
+    bool batch = argc > 1 && string(argv[1]) == "batch";
+    bool append = argc > 1 && string(argv[1]) == "append";
+    // tlz append --recover cuts a corrupt end back to the last good footer
+    bool recover = false;
+    vector<string> inputs;
 
-    infile.close();
+    for (int i = batch || append ? 2 : 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-d")
+        {
+            decompress = true;
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            output_name = argv[++i];
+        }
+        else if (arg == "-b" && i + 1 < argc)
+        {
+            options.block_size = parse_size(argv[++i]);
+        }
+        else if (arg == "-j" && i + 1 < argc)
+        {
+            options.threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "-w" && i + 1 < argc)
+        {
+            string shape = argv[++i];
+            if (shape != "huffman" && shape != "balanced")
+            {
+                printf("unknown wavelet tree shape %s\n", shape.c_str());
+                return -1;
+            }
+            options.shape = shape == "huffman" ? WT_HUFFMAN : WT_BALANCED;
+        }
+        else if (arg == "-e" && i + 1 < argc)
+        {
+            string coding = argv[++i];
+            if (coding != "gamma" && coding != "rans" && coding != "adaptive")
+            {
+                printf("unknown level coding %s\n", coding.c_str());
+                return -1;
+            }
+            options.coding = coding == "rans" ? LEVELS_RANS : coding == "adaptive" ? LEVELS_ADAPTIVE : LEVELS_GAMMA;
+        }
+        else if (arg == "-m" && i + 1 < argc)
+        {
+            string backend = argv[++i];
+            if (backend != "wt" && backend != "mtf")
+            {
+                printf("unknown back end %s\n", backend.c_str());
+                return -1;
+            }
+            options.backend = backend == "mtf" ? BACKEND_MTF : BACKEND_WAVELET;
+        }
+        else if (arg == "-a" && i + 1 < argc)
+        {
+            string alphabet = argv[++i];
+            if (alphabet != "bytes" && alphabet != "dna")
+            {
+                printf("unknown alphabet %s\n", alphabet.c_str());
+                return -1;
+            }
+            options.alphabet = alphabet == "dna" ? ALPHABET_DNA : ALPHABET_BYTES;
+        }
+        else if (arg == "-r" && i + 1 < argc)
+        {
+            range = argv[++i];
+        }
+        else if (arg == "-s" && i + 1 < argc)
+        {
+            options.sample_rate = parse_size(argv[++i]);
+        }
+        else if (arg == "-M" && i + 1 < argc)
+        {
+            options.memory_budget = parse_size(argv[++i]);
+        }
+        else if (arg == "-T" && i + 1 < argc)
+        {
+            options.scratch_dir = argv[++i];
+        }
+        else if (arg == "--stats")
+        {
+            options.stats = true;
+        }
+        else if (arg == "--recover" && append)
+        {
+            recover = true;
+        }
+        else
+        {
+            filename = arg;
+            inputs.push_back(arg);
+        }
+    }
 
-    uint32_t sigma = 256;
-    std::size_t n = T_len;
+    // the options are checked once, whatever the command: suffix samples
+    // go only with the wavelet tree over bytes
+    if (options.backend == BACKEND_MTF && options.sample_rate != 0)
+    {
+        printf("-s needs the wavelet tree back end, -m wt\n");
+        return -1;
+    }
+    if (options.alphabet == ALPHABET_DNA && options.sample_rate != 0)
+    {
+        printf("-s needs the byte alphabet, -a bytes\n");
+        return -1;
+    }
+    const string suffix = ".gama.lz";
+    if (batch)
+    {
+        if (inputs.empty() || decompress || !range.empty() || options.stats)
+        {
+            printf("usage: tlz batch [-o archive] [-b block_size] [-j threads] [-w huffman|balanced] [-e gamma|rans|adaptive] [-m wt|mtf] [-a bytes|dna] [-s sample_rate] [-M memory] [-T scratch_dir] file|directory|@list...\n");
+            return -1;
+        }
+        // every file gets its own container next to it, or, with -o, all
+        // of them go into one batch archive
+        int archive_fd = -1;
+        try
+        {
+            vector<BatchFile> files = list_batch_files(inputs, suffix);
+            if (!output_name.empty())
+            {
+                archive_fd = output_name == "-" ? STDOUT_FILENO : open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (archive_fd < 0)
+                {
+                    throw runtime_error(output_name + ": " + strerror(errno));
+                }
+            }
+            compress_batch(files, options, archive_fd, [&](const BatchFile &file) { return file.path + suffix; });
+        }
+        catch (const exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            return -1;
+        }
+        if (archive_fd >= 0)
+        {
+            close(archive_fd);
+        }
+        return 0;
+    }
 
-    vector<uint32_t> t(n + 1);
-    for (std::size_t i = 0; i < n; i++)
+    if (append)
     {
-        t[i] = (uint32_t)T[i];
+        if (inputs.size() != 2 || decompress || !range.empty() || !output_name.empty())
+        {
+            printf("usage: tlz append [-b block_size] [-j threads] [-w huffman|balanced] [-e gamma|rans|adaptive] [-m wt|mtf] [-a bytes|dna] [-s sample_rate] [-M memory] [-T scratch_dir] [--stats] [--recover] archive file|-\n");
+            return -1;
+        }
+        // the new text of a growing file, such as the last hour of a log,
+        // goes into new blocks at the end of its archive
+        const string &archive_name = inputs[0];
+        bool regular;
+        size_t T_len;
+        int in_fd = open_input(inputs[1], regular, T_len);
+        if (in_fd < 0)
+        {
+            printf("file not find.");
+            return -1;
+        }
+        int archive_fd = open(archive_name.c_str(), O_RDWR);
+        if (archive_fd < 0)
+        {
+            printf("%s: %s\n", archive_name.c_str(), strerror(errno));
+            return -1;
+        }
+        try
+        {
+            size_t dropped = append_to(archive_fd, in_fd, regular, T_len, options, recover);
+            if (dropped != 0)
+            {
+                fprintf(stderr, "%s: dropped %zu bytes %s\n", archive_name.c_str(), dropped,
+                        recover ? "after the last good footer" : "of an unfinished append");
+            }
+        }
+        catch (const exception &e)
+        {
+            fprintf(stderr, "%s: %s\n", archive_name.c_str(), e.what());
+            close(archive_fd);
+            return -1;
+        }
+        close(in_fd);
+        close(archive_fd);
+        return 0;
     }
-    t[n] = 0;
 
-    vector<std::size_t> sa(n + 1, 0);
+    if (filename.empty())
+    {
+        printf("usage: tlz [-d] [-o output] [-b block_size] [-j threads] [-w huffman|balanced] [-e gamma|rans|adaptive] [-m wt|mtf] [-a bytes|dna] [-s sample_rate] [-M memory] [-T scratch_dir] [--stats] filename|-\n"
+               "       tlz -d -r offset:len [-o output] filename\n");
+        return -1;
+    }
 
-    auto solver = Solver(span(t), span(sa), sigma);
-    solver.solve(true);
+    // -d -r offset:len decodes only the blocks covering the range, to
+    // stdout unless -o is given
+    if (decompress && !range.empty())
+    {
+        size_t colon = range.find(':');
+        if (colon == string::npos)
+        {
+            fprintf(stderr, "bad range %s, expected offset:len\n", range.c_str());
+            return -1;
+        }
+        ifstream infile(filename, ios::in | ios::binary);
+        if (!infile)
+        {
+            fprintf(stderr, "file not find.\n");
+            return -1;
+        }
+        string text;
+        try
+        {
+            text = decompress_range(infile, parse_size(range.substr(0, colon).c_str()),
+                                    parse_size(range.substr(colon + 1).c_str()), options.threads);
+        }
+        catch (const exception &e)
+        {
+            fprintf(stderr, "%s: %s\n", filename.c_str(), e.what());
+            return -1;
+        }
+        if (output_name.empty())
+        {
+            fwrite(text.data(), 1, text.size(), stdout);
+        }
+        else
+        {
+            ofstream out(output_name, ofstream::out | ofstream::trunc | ofstream::binary);
+            out.write(text.data(), text.size());
+        }
+        return 0;
+    }
 
-    vector<std::size_t> bwt(n + 1, 0);
-    std::size_t bwt_len = bwt.size();
-    for (std::size_t i = 0; i < bwt_len; i++)
+    // "-" reads standard input, which need not be seekable, and writes
+    // the archive to standard output unless -o says otherwise
+    bool output_given = !output_name.empty();
+    if (output_name.empty() && filename == "-")
+    {
+        output_name = "-";
+    }
+    else if (output_name.empty() && !decompress)
     {
-        bwt[i] = T[(sa[i] - 1 + (n + 1)) % (n + 1)];
+        output_name = filename + suffix;
+    }
+    else if (output_name.empty())
+    {
+        bool has_suffix = filename.size() > suffix.size() &&
+                          filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+        output_name = has_suffix ? filename.substr(0, filename.size() - suffix.size()) : filename + ".out";
     }
 
-    vector<boost::dynamic_bitset<>> wt;
-    wt.reserve(T_len);
-    init_wt(wt, bwt, 1);
+    bool regular;
+    size_t T_len;
+    int in_fd = open_input(filename, regular, T_len);
+    if (in_fd < 0)
+    {
+        printf("file not find.");
+        exit(-1);
+    }
 
-    compress_gamma(wt);
+    if (decompress)
+    {
+        string text;
+        ofstream out;
+        // the output is opened on the first write, as a batch archive has
+        // none of its own
+        auto put = [&](const char *data, size_t len)
+        {
+            if (output_name == "-")
+            {
+                fwrite(data, 1, len, stdout);
+                return;
+            }
+            if (!out.is_open())
+            {
+                out.open(output_name, ofstream::out | ofstream::trunc | ofstream::binary);
+            }
+            out.write(data, len);
+        };
+        try
+        {
+            if (regular)
+            {
+                MappedFile archive(in_fd, T_len, MADV_SEQUENTIAL);
+                if (is_batch_archive(archive.data, archive.size))
+                {
+                    // a batch archive extracts into the -o directory
+                    extract_batch(archive.data, archive.size, output_given ? output_name : ".", options.threads);
+                    close(in_fd);
+                    return 0;
+                }
+                text = decompress_blocks(archive.data, archive.size, options.threads);
+            }
+            else
+            {
+                // a piped archive is decoded as its blocks arrive, up to one
+                // per thread at a time
+                Decompressor stream(options.threads);
+                vector<char> buf(1 << 16), decoded(1 << 20);
+                for (size_t got; (got = read_full(in_fd, (uint8_t *)buf.data(), buf.size())) > 0;)
+                {
+                    for (size_t used = 0; used < got;)
+                    {
+                        used += stream.write(buf.data() + used, got - used);
+                        for (size_t n; (n = stream.read(decoded.data(), decoded.size())) > 0;)
+                        {
+                            put(decoded.data(), n);
+                        }
+                    }
+                }
+                stream.finish();
+            }
+        }
+        catch (const exception &e)
+        {
+            fprintf(stderr, "%s: %s\n", filename.c_str(), e.what());
+            return -1;
+        }
+        close(in_fd);
+        // an empty text still leaves an empty file
+        put(text.data(), text.size());
+        return 0;
+    }
 
-    write_wt(wt, output_name.c_str());
-}
\ No newline at end of file
+    int fd = output_name == "-" ? STDOUT_FILENO : open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("%s: %s\n", output_name.c_str(), strerror(errno));
+        return -1;
+    }
+    try
+    {
+        if (regular)
+        {
+            MappedFile input(in_fd, T_len);
+            compress_to(fd, input.data, input.size, options);
+        }
+        else
+        {
+            compress_stream(in_fd, fd, options);
+        }
+    }
+    catch (const exception &e)
+    {
+        fprintf(stderr, "%s: %s\n", output_name.c_str(), e.what());
+        close(fd);
+        return -1;
+    }
+    close(in_fd);
+    close(fd);
+}
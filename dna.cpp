@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bitio.cpp"
+
+using namespace std;
+
+// packed DNA blocks (-a dna): a block is split into its bases, the A, C, G
+// and T of either case as 2-bit codes, and the rest, which FASTA keeps
+// sparse: line breaks, header lines and runs of N or other IUPAC codes.
+// the bases are suffix sorted straight from their packed form, 32 to a
+// word, and coded as a block over a 4-character alphabet, whose balanced
+// wavelet tree has two levels; the rest goes into a side text, coded as a
+// block of bytes. the side text is
+//   varint run_count | per run: varint upper | varint lower
+//   varint exception_count | per exception: varint gap | varint len | bytes
+// where a run is `lower` lowercase bases after `upper` uppercase ones, and
+// an exception is `len` bytes of the block after `gap` more bases.
+const size_t DNA_SIGMA = 4;
+const char DNA_BASES[DNA_SIGMA + 1] = "ACGT";
+const uint8_t NOT_BASE = 0xff;
+
+// the 2-bit code of every byte, NOT_BASE for the exceptions
+struct DnaCodes
+{
+    uint8_t code[256];
+
+    constexpr DnaCodes() : code()
+    {
+        for (size_t c = 0; c < 256; c++)
+        {
+            code[c] = NOT_BASE;
+        }
+        for (uint8_t b = 0; b < DNA_SIGMA; b++)
+        {
+            code[(uint8_t)DNA_BASES[b]] = b;
+            code[(uint8_t)DNA_BASES[b] | 0x20] = b;
+        }
+    }
+};
+constexpr DnaCodes DNA_CODES;
+
+// a text of 2-bit codes, 32 to a word with the first in the low bits, as
+// the suffix sorter reads it
+struct PackedBases
+{
+    static constexpr size_t sigma = DNA_SIGMA;
+    const uint64_t *words;
+
+    uint8_t operator[](size_t i) const
+    {
+        return words[i / 32] >> (2 * (i % 32)) & 3;
+    }
+};
+
+// splits T[0, n) into its packed bases, of which there are the returned
+// count, and the side text; both buffers are overwritten, so they may be
+// reused from block to block
+size_t split_dna(const uint8_t *T, size_t n, vector<uint64_t> &bases, string &side)
+{
+    bases.assign(n / 32 + 1, 0);
+    string exceptions;
+    size_t m = 0, exception_count = 0, gap = 0;
+    string runs;
+    size_t run_count = 0, upper = 0, lower = 0;
+    for (size_t i = 0; i < n;)
+    {
+        uint8_t code = DNA_CODES.code[T[i]];
+        if (code != NOT_BASE)
+        {
+            bases[m / 32] |= (uint64_t)code << (2 * (m % 32));
+            m++;
+            gap++;
+            if (T[i] & 0x20)
+            {
+                lower++;
+            }
+            else if (lower != 0)
+            {
+                put_varint(runs, upper);
+                put_varint(runs, lower);
+                run_count++;
+                upper = 1;
+                lower = 0;
+            }
+            else
+            {
+                upper++;
+            }
+            i++;
+            continue;
+        }
+        // a header line is an exception up to its line break, whatever
+        // letters it holds
+        size_t j = i;
+        while (j < n && DNA_CODES.code[T[j]] == NOT_BASE)
+        {
+            if (T[j] == '>' && (j == 0 || T[j - 1] == '\n'))
+            {
+                const uint8_t *eol = (const uint8_t *)memchr(T + j, '\n', n - j);
+                j = eol ? eol - T + 1 : n;
+            }
+            else
+            {
+                j++;
+            }
+        }
+        put_varint(exceptions, gap);
+        put_varint(exceptions, j - i);
+        exceptions.append((const char *)T + i, j - i);
+        exception_count++;
+        gap = 0;
+        i = j;
+    }
+    if (lower != 0)
+    {
+        put_varint(runs, upper);
+        put_varint(runs, lower);
+        run_count++;
+    }
+    side.clear();
+    put_varint(side, run_count);
+    side += runs;
+    put_varint(side, exception_count);
+    side += exceptions;
+    return m;
+}
+
+// rebuilds a block of n bytes whose m base codes are at out[n - m, n) from
+// its side text
+void merge_dna(const uint8_t *side, size_t side_len, uint8_t *out, size_t n, size_t m)
+{
+    uint8_t *bases = out + n - m;
+    for (size_t k = 0; k < m; k++)
+    {
+        if (bases[k] >= DNA_SIGMA)
+        {
+            throw runtime_error("corrupt DNA block");
+        }
+        bases[k] = DNA_BASES[bases[k]];
+    }
+    ByteReader in(side, side + side_len);
+    size_t run_count = in.varint();
+    for (size_t r = 0, k = 0; r < run_count; r++)
+    {
+        size_t upper = in.varint(), lower = in.varint();
+        if (upper > m - k || lower > m - k - upper)
+        {
+            throw runtime_error("corrupt DNA block");
+        }
+        k += upper;
+        for (size_t end = k + lower; k < end; k++)
+        {
+            bases[k] |= 0x20;
+        }
+    }
+    // the bases slide down as the exceptions go in front of them; dst never
+    // passes src, which the lengths are checked to keep
+    size_t exception_count = in.varint();
+    size_t dst = 0, src = n - m;
+    for (size_t e = 0; e < exception_count; e++)
+    {
+        size_t gap = in.varint(), len = in.varint();
+        if (gap > n - src || len > src - dst)
+        {
+            throw runtime_error("corrupt DNA block");
+        }
+        memmove(out + dst, out + src, gap);
+        dst += gap;
+        src += gap;
+        memcpy(out + dst, in.take(len), len);
+        dst += len;
+    }
+    if (dst != src || in.left() != 0)
+    {
+        throw runtime_error("corrupt DNA block");
+    }
+}
@@ -0,0 +1,587 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+// suffix sorting in scratch files, for blocks whose suffix array does not
+// fit in memory. it is prefix doubling with discarding (Dementiev,
+// Kärkkäinen, Mehnert and Sanders, "Better external memory suffix array
+// construction"): every suffix is named by the rank of its first h
+// characters, and a round pairs each name with the one h further on and
+// renames by the pairs, doubling h. a suffix whose name is unique is final
+// and leaves the rounds, kept only while a neighbour still needs it. all
+// of it is external sorts of fixed-size records and scans over them, so the
+// scratch files are read and written front to back in large pieces, and
+// the text is read front to back too.
+
+// the smallest read of a merge, which bounds how many runs it takes at once
+const size_t SCRATCH_READ_SIZE = size_t(1) << 20;
+
+// the directory scratch files go in when none is given
+string default_scratch_dir()
+{
+    const char *dir = getenv("TMPDIR");
+    return dir && *dir ? dir : "/tmp";
+}
+
+// a file in dir that is unlinked as soon as it is made, so it goes away
+// with its descriptor however the process ends
+class ScratchFile
+{
+public:
+    explicit ScratchFile(const string &dir)
+    {
+        string path = (dir.empty() ? default_scratch_dir() : dir) + "/tlz-XXXXXX";
+        fd = mkstemp(path.data());
+        if (fd < 0)
+        {
+            throw runtime_error(path + ": " + strerror(errno));
+        }
+        unlink(path.c_str());
+    }
+
+    ScratchFile(const ScratchFile &) = delete;
+    ScratchFile &operator=(const ScratchFile &) = delete;
+
+    ~ScratchFile()
+    {
+        if (mapped)
+        {
+            munmap(mapped, mapped_len);
+        }
+        close(fd);
+    }
+
+    void write_at(size_t pos, const void *data, size_t len)
+    {
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t w = pwrite(fd, (const char *)data + done, len - done, pos + done);
+            if (w < 0 && errno != EINTR)
+            {
+                throw runtime_error(string("scratch file: ") + strerror(errno));
+            }
+            done += max<ssize_t>(w, 0);
+        }
+        size = max(size, pos + len);
+    }
+
+    void read_at(size_t pos, void *data, size_t len) const
+    {
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t r = pread(fd, (char *)data + done, len - done, pos + done);
+            if (r == 0 || (r < 0 && errno != EINTR))
+            {
+                throw runtime_error("scratch file: short read");
+            }
+            done += max<ssize_t>(r, 0);
+        }
+    }
+
+    // a shared writable mapping of the first len bytes, which the file is
+    // grown to; it lasts as long as the file
+    uint8_t *map(size_t len)
+    {
+        if (mapped)
+        {
+            throw logic_error("scratch file mapped twice");
+        }
+        if (len > size && ftruncate(fd, len) != 0)
+        {
+            throw runtime_error(string("scratch file: ") + strerror(errno));
+        }
+        size = max(size, len);
+        void *p = mmap(nullptr, max<size_t>(len, 1), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            throw runtime_error(string("scratch file: ") + strerror(errno));
+        }
+        mapped = p;
+        mapped_len = max<size_t>(len, 1);
+        return (uint8_t *)p;
+    }
+
+private:
+    int fd;
+    size_t size = 0;
+    void *mapped = nullptr;
+    size_t mapped_len = 0;
+};
+
+// sorts records of a trivially copyable R by less in about `memory` bytes:
+// push() collects them in a buffer that is sorted and written out as a run
+// whenever it fills, and after sort() next() merges the runs, first in
+// passes over SCRATCH_READ_SIZE pieces while there are more than fit at
+// once. input that fits in the buffer never touches the disk.
+template <class R, class Less>
+class ExternalSorter
+{
+public:
+    ExternalSorter(size_t memory, const string &dir, Less less = Less())
+        : memory(max(memory, 2 * SCRATCH_READ_SIZE)), dir(dir), less(less)
+    {
+    }
+
+    void push(const R &r)
+    {
+        if (buffer.empty())
+        {
+            buffer.reserve(memory / sizeof(R));
+        }
+        buffer.push_back(r);
+        if (buffer.size() == memory / sizeof(R))
+        {
+            spill();
+        }
+        pushed++;
+    }
+
+    // records pushed so far
+    size_t size() const
+    {
+        return pushed;
+    }
+
+    // ends the input
+    void sort()
+    {
+        if (runs.empty())
+        {
+            std::sort(buffer.begin(), buffer.end(), less);
+            return;
+        }
+        spill();
+        vector<R>().swap(buffer);
+        size_t fan_in = max<size_t>(2, memory / SCRATCH_READ_SIZE);
+        while (runs.size() > fan_in)
+        {
+            // merge the runs a fan-in at a time into a new file
+            auto merged = make_unique<ScratchFile>(dir);
+            vector<pair<size_t, size_t>> next_runs;
+            size_t pos = 0;
+            for (size_t first = 0; first < runs.size(); first += fan_in)
+            {
+                vector<pair<size_t, size_t>> group(runs.begin() + first, runs.begin() + min(runs.size(), first + fan_in));
+                start_merge(group);
+                vector<R> out;
+                out.reserve(SCRATCH_READ_SIZE / sizeof(R));
+                size_t begin = pos;
+                R r;
+                while (merge_next(r))
+                {
+                    out.push_back(r);
+                    if (out.size() == out.capacity())
+                    {
+                        merged->write_at(pos * sizeof(R), out.data(), out.size() * sizeof(R));
+                        pos += out.size();
+                        out.clear();
+                    }
+                }
+                merged->write_at(pos * sizeof(R), out.data(), out.size() * sizeof(R));
+                pos += out.size();
+                next_runs.push_back({begin, pos});
+            }
+            file = move(merged);
+            runs = move(next_runs);
+        }
+        start_merge(runs);
+    }
+
+    // the next record in order; false once they are all out
+    bool next(R &r)
+    {
+        if (!file)
+        {
+            if (taken == buffer.size())
+            {
+                return false;
+            }
+            r = buffer[taken++];
+            return true;
+        }
+        return merge_next(r);
+    }
+
+private:
+    size_t memory;
+    string dir;
+    Less less;
+    vector<R> buffer;
+    size_t taken = 0, pushed = 0;
+    unique_ptr<ScratchFile> file;
+    vector<pair<size_t, size_t>> runs; // record ranges of file
+
+    // a run being merged, read a piece at a time
+    struct Reader
+    {
+        size_t pos, end;
+        vector<R> piece;
+        size_t at = 0;
+    };
+    vector<Reader> readers;
+    size_t piece_len = 0;
+
+    struct ByHead
+    {
+        const vector<Reader> *readers;
+        Less less;
+
+        bool operator()(size_t a, size_t b) const
+        {
+            return less((*readers)[b].piece[(*readers)[b].at], (*readers)[a].piece[(*readers)[a].at]);
+        }
+    };
+    priority_queue<size_t, vector<size_t>, ByHead> heads{ByHead{&readers, Less()}};
+
+    void spill()
+    {
+        if (buffer.empty())
+        {
+            return;
+        }
+        if (!file)
+        {
+            file = make_unique<ScratchFile>(dir);
+        }
+        std::sort(buffer.begin(), buffer.end(), less);
+        size_t begin = runs.empty() ? 0 : runs.back().second;
+        file->write_at(begin * sizeof(R), buffer.data(), buffer.size() * sizeof(R));
+        runs.push_back({begin, begin + buffer.size()});
+        buffer.clear();
+    }
+
+    bool refill(Reader &reader)
+    {
+        size_t len = min(piece_len, reader.end - reader.pos);
+        reader.piece.resize(len);
+        reader.at = 0;
+        file->read_at(reader.pos * sizeof(R), reader.piece.data(), len * sizeof(R));
+        reader.pos += len;
+        return len != 0;
+    }
+
+    void start_merge(const vector<pair<size_t, size_t>> &group)
+    {
+        readers.assign(group.size(), Reader());
+        heads = priority_queue<size_t, vector<size_t>, ByHead>(ByHead{&readers, less});
+        piece_len = max<size_t>(1, memory / group.size() / sizeof(R));
+        for (size_t k = 0; k < group.size(); k++)
+        {
+            readers[k].pos = group[k].first;
+            readers[k].end = group[k].second;
+            if (refill(readers[k]))
+            {
+                heads.push(k);
+            }
+        }
+    }
+
+    bool merge_next(R &r)
+    {
+        if (heads.empty())
+        {
+            return false;
+        }
+        size_t k = heads.top();
+        heads.pop();
+        Reader &reader = readers[k];
+        r = reader.piece[reader.at++];
+        if (reader.at < reader.piece.size() || refill(reader))
+        {
+            heads.push(k);
+        }
+        return true;
+    }
+};
+
+// a suffix and its name, the rank of its first h characters among all
+// suffixes: the suffixes that sort below it. the top bit of pos says the
+// name is unique
+struct NamedSuffix
+{
+    uint64_t name, pos;
+};
+
+const uint64_t UNIQUE_NAME = uint64_t(1) << 63;
+
+// a suffix that is not final, with the names of its first h characters and
+// of the h after them (+1; 0 past the end)
+struct PairedSuffix
+{
+    uint64_t name, next, pos;
+};
+
+// a row of the suffix array, its suffix and that suffix's BWT character,
+// in the top byte of pos
+struct SettledRow
+{
+    uint64_t row, pos;
+};
+
+// the order a round scans in: by pos mod h, then pos, so that suffix i and
+// suffix i + h follow each other. a round's suffixes are sorted by their
+// place in it, key(pos), which spares the sort its divisions
+struct ScanOrder
+{
+    uint64_t h, q; // q = ceil(n / h)
+
+    ScanOrder(uint64_t n, uint64_t h) : h(h), q((n + h - 1) / h) {}
+
+    uint64_t key(uint64_t pos) const
+    {
+        return pos % h * q + pos / h;
+    }
+
+    uint64_t pos(uint64_t key) const
+    {
+        return key % q * h + key / q;
+    }
+};
+
+struct ByPair
+{
+    bool operator()(const PairedSuffix &a, const PairedSuffix &b) const
+    {
+        return a.name != b.name ? a.name < b.name : a.next < b.next;
+    }
+};
+
+struct ByName
+{
+    bool operator()(const NamedSuffix &a, const NamedSuffix &b) const
+    {
+        return a.name < b.name;
+    }
+};
+
+struct ByPos
+{
+    bool operator()(const NamedSuffix &a, const NamedSuffix &b) const
+    {
+        return (a.pos & ~UNIQUE_NAME) < (b.pos & ~UNIQUE_NAME);
+    }
+};
+
+struct ByRowDescending
+{
+    bool operator()(const SettledRow &a, const SettledRow &b) const
+    {
+        return a.row > b.row;
+    }
+};
+
+// the BWT of T[0, n) as bwt_bytes gives it, sorted in scratch files under
+// dir in about `memory` bytes and written to bwt[0, n). T is a byte pointer
+// or a packed text such as PackedBases, read front to back. row(i, j) sees
+// every row i and its suffix j, in descending order. returns the row of
+// suffix 0
+template <class Text, class F>
+size_t bwt_external(Text T, size_t n, size_t memory, const string &dir, ScratchFile &bwt, F row)
+{
+    // four sorters take input at once: the round being scanned, the pairs,
+    // the next round and the finished suffixes
+    size_t share = memory / 4;
+
+    // the first names cover as many characters as fit in 63 bits, each
+    // character as c + 1 and the end as 0
+    constexpr size_t sigma = text_sigma<Text>;
+    const unsigned bits = bit_width(sigma);
+    const size_t h0 = 63 / bits;
+    uint64_t mask = (uint64_t(1) << (bits * h0)) - 1;
+    ExternalSorter<NamedSuffix, ByPos> finished(share, dir);
+    auto round = make_unique<ExternalSorter<NamedSuffix, ByPos>>(share, dir);
+    ScanOrder order(n, h0);
+    {
+        // the keys are held in name until they are sorted
+        ExternalSorter<NamedSuffix, ByName> keys(share, dir);
+        uint64_t key = 0;
+        for (size_t i = 0; i + 1 < h0; i++)
+        {
+            key = key << bits | (i < n ? T[i] + 1 : 0);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            key = (key << bits | (i + h0 - 1 < n ? T[i + h0 - 1] + 1 : 0)) & mask;
+            keys.push({key, i});
+        }
+        keys.sort();
+        // a name is unique when its key differs from both neighbours'
+        NamedSuffix cur, ahead;
+        bool have = keys.next(cur), more = have && keys.next(ahead);
+        uint64_t rank = 0, group = 0, prev_key = ~uint64_t(0);
+        while (have)
+        {
+            if (cur.name != prev_key)
+            {
+                group = rank;
+            }
+            bool unique = cur.name != prev_key && (!more || ahead.name != cur.name);
+            prev_key = cur.name;
+            round->push({group, order.key(cur.pos) | (unique ? UNIQUE_NAME : 0)});
+            rank++;
+            have = more;
+            cur = ahead;
+            more = have && keys.next(ahead);
+        }
+    }
+
+    for (uint64_t h = h0;; h *= 2)
+    {
+        round->sort();
+        auto next_round = make_unique<ExternalSorter<NamedSuffix, ByPos>>(share, dir);
+        ScanOrder next_order(n, 2 * h);
+        ExternalSorter<PairedSuffix, ByPair> pairs(share, dir);
+        // a unique suffix is still needed next round by the suffix 2h
+        // before it, when that one and the one h before it are in the
+        // round and not unique; otherwise it is final
+        struct Seen
+        {
+            uint64_t pos = ~uint64_t(0);
+            bool unique = true;
+        };
+        Seen prev1, prev2;
+        bool pending = false;
+        NamedSuffix wait{}, x;
+        auto pair_up = [&](uint64_t next)
+        {
+            uint64_t pos = wait.pos & ~UNIQUE_NAME;
+            if (next == 0 && pos + h < n)
+            {
+                throw logic_error("external suffix sort lost a suffix");
+            }
+            pairs.push({wait.name, next, pos});
+            pending = false;
+        };
+        while (round->next(x))
+        {
+            bool unique = x.pos & UNIQUE_NAME;
+            uint64_t pos = order.pos(x.pos & ~UNIQUE_NAME);
+            x.pos = pos | (x.pos & UNIQUE_NAME);
+            if (pending)
+            {
+                pair_up((wait.pos & ~UNIQUE_NAME) + h == pos ? x.name + 1 : 0);
+            }
+            if (!unique)
+            {
+                wait = x;
+                pending = true;
+            }
+            else if (prev1.pos + h == pos && !prev1.unique && prev2.pos + 2 * h == pos && !prev2.unique)
+            {
+                next_round->push({x.name, next_order.key(pos) | UNIQUE_NAME});
+            }
+            else
+            {
+                finished.push(x);
+            }
+            prev2 = prev1;
+            prev1 = {pos, unique};
+        }
+        if (pending)
+        {
+            pair_up(0);
+        }
+        round.reset();
+        if (pairs.size() == 0)
+        {
+            next_round->sort();
+            while (next_round->next(x))
+            {
+                finished.push({x.name, next_order.pos(x.pos & ~UNIQUE_NAME) | UNIQUE_NAME});
+            }
+            break;
+        }
+        // within the suffixes named c, which are all in the round, the
+        // new name is c plus the count of those with a smaller pair
+        pairs.sort();
+        PairedSuffix cur, ahead;
+        bool have = pairs.next(cur), more = have && pairs.next(ahead);
+        uint64_t in_group = 0, name = 0;
+        bool first = true;
+        PairedSuffix prev{};
+        while (have)
+        {
+            bool new_name = first || cur.name != prev.name || cur.next != prev.next;
+            in_group = first || cur.name != prev.name ? 0 : in_group + 1;
+            if (new_name)
+            {
+                name = cur.name + in_group;
+            }
+            bool unique = new_name && (!more || ahead.name != cur.name || ahead.next != cur.next);
+            next_round->push({name, next_order.key(cur.pos) | (unique ? UNIQUE_NAME : 0)});
+            prev = cur;
+            first = false;
+            have = more;
+            cur = ahead;
+            more = have && pairs.next(ahead);
+        }
+        round = move(next_round);
+        order = next_order;
+    }
+
+    // every suffix is final: its name is its rank, and row rank + 1 as
+    // the sentinel's row 0 comes first. a pass in text order picks up the
+    // BWT characters
+    finished.sort();
+    ExternalSorter<SettledRow, ByRowDescending> rows(share, dir);
+    size_t primary = 0;
+    NamedSuffix x;
+    while (finished.next(x))
+    {
+        uint64_t pos = x.pos & ~UNIQUE_NAME;
+        if (pos == 0)
+        {
+            primary = x.name + 1;
+        }
+        uint64_t c = pos > 0 ? T[pos - 1] : 0;
+        rows.push({x.name + 1, pos | c << 56});
+    }
+    rows.push({0, n | (uint64_t)T[n - 1] << 56});
+    if (rows.size() != n + 1)
+    {
+        throw logic_error("external suffix sort lost a suffix");
+    }
+    rows.sort();
+
+    // the BWT goes out back to front, a piece at a time
+    vector<uint8_t> piece(min<size_t>(n, max(SCRATCH_READ_SIZE, share)));
+    size_t piece_end = n, filled = 0;
+    SettledRow r;
+    while (rows.next(r))
+    {
+        size_t j = r.pos & ((uint64_t(1) << 56) - 1);
+        row(r.row, j);
+        if (r.row == primary)
+        {
+            continue;
+        }
+        piece[piece.size() - ++filled] = r.pos >> 56;
+        if (filled == piece.size() || piece_end == filled)
+        {
+            bwt.write_at(piece_end - filled, piece.data() + piece.size() - filled, filled);
+            piece_end -= filled;
+            filled = 0;
+        }
+    }
+    if (piece_end != 0)
+    {
+        throw logic_error("external suffix sort lost a suffix");
+    }
+    return primary;
+}
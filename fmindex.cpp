@@ -0,0 +1,386 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bitvector.cpp"
+#include "mywt.cpp"
+#include "block.cpp"
+
+using namespace std;
+
+// a block of an archive opened as an FM-index: the wavelet tree levels are
+// decoded from their gamma runs and given rank9 directories, but the BWT is
+// never materialised. rows are rows of the full BWT, sentinel included, so
+// there are n + 1 of them and row `primary` holds the sentinel.
+class FMIndex
+{
+public:
+    WaveletTree wt;
+    vector<Rank9> rank;
+    size_t n = 0;
+    size_t primary = 0;
+    size_t C[257] = {0}; // C[c]: rows whose suffix starts below c
+    vector<uint8_t> symbols;
+    vector<array<size_t, 256>> start; // start[l][c]: offset of c's node in level l
+    BlockHeader header;
+    SuffixSamples samples;
+    Rank9 marked_rank;
+
+    FMIndex() {}
+
+    // the rank directories point at bit vectors owned by the index
+    FMIndex(const FMIndex &) = delete;
+    FMIndex &operator=(const FMIndex &) = delete;
+
+    void open(const uint8_t *in, const uint8_t *end, size_t raw_len)
+    {
+        if (is_dna_block(in, end))
+        {
+            throw runtime_error("block has no wavelet tree to query (compressed with -a dna)");
+        }
+        ByteReader payload(in, end);
+        read_block_header(payload, raw_len, header);
+        if (is_mtf_block(payload))
+        {
+            throw runtime_error("block has no wavelet tree to query (compressed with -m mtf)");
+        }
+        read_wt(wt, payload, raw_len);
+        read_suffix_samples(payload, raw_len, samples);
+        n = raw_len;
+        primary = header.primary;
+        if (samples.rate != 0)
+        {
+            marked_rank.build(samples.marked);
+        }
+
+        rank.resize(wt.depth());
+        for (size_t l = 0; l < wt.depth(); l++)
+        {
+            rank[l].build(wt.level[l]);
+        }
+        C[0] = 1; // the sentinel
+        for (size_t c = 0; c < 256; c++)
+        {
+            C[c + 1] = C[c] + wt.count[c];
+        }
+        symbols = symbols_by_code(wt);
+        start.resize(wt.depth());
+        for (size_t l = 0; l < wt.depth(); l++)
+        {
+            uint8_t node_of[256];
+            size_t node_start[256];
+            node_starts(wt, symbols, l, node_of, node_start);
+            for (uint8_t c : symbols)
+            {
+                start[l][c] = wt.len[c] > l ? node_start[node_of[c]] : 0;
+            }
+        }
+    }
+
+    // occurrences of c in BWT rows [0, row)
+    size_t occ(uint8_t c, size_t row) const
+    {
+        if (wt.count[c] == 0)
+        {
+            return 0;
+        }
+        size_t i = row > primary ? row - 1 : row; // position in the stored BWT
+        for (size_t l = 0; l < wt.len[c]; l++)
+        {
+            size_t s = start[l][c];
+            size_t ones = rank[l].rank1(s + i) - rank[l].rank1(s);
+            i = code_prefix(wt, c, l + 1) & 1 ? ones : i - ones;
+        }
+        return i;
+    }
+
+    // the BWT character of a row other than `primary`
+    uint8_t access(size_t row) const
+    {
+        size_t i = row > primary ? row - 1 : row;
+        // the symbols below the current node form symbols[lo, hi)
+        size_t lo = 0, hi = symbols.size();
+        for (size_t l = 0; l < wt.depth() && hi - lo > 1; l++)
+        {
+            size_t s = start[l][symbols[lo]];
+            bool bit = wt.level[l][s + i];
+            size_t ones = rank[l].rank1(s + i) - rank[l].rank1(s);
+            i = bit ? ones : i - ones;
+            size_t mid = lo;
+            while (mid < hi && !(code_prefix(wt, symbols[mid], l + 1) & 1))
+            {
+                mid++;
+            }
+            if (bit)
+            {
+                lo = mid;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        return symbols[lo];
+    }
+
+    // the first character of the suffix in `row` (row > 0)
+    uint8_t first(size_t row) const
+    {
+        return (uint8_t)(upper_bound(C, C + 257, row) - C - 1);
+    }
+
+    // the row of the suffix one position to the left
+    size_t lf(size_t row) const
+    {
+        uint8_t c = access(row);
+        return C[c] + occ(c, row);
+    }
+
+    // the row of the suffix one position to the right (row > 0)
+    size_t psi(size_t row) const
+    {
+        uint8_t c = first(row);
+        size_t k = row - C[c]; // the k-th c of the BWT
+        for (size_t l = wt.len[c]; l-- > 0;)
+        {
+            size_t s = start[l][c];
+            bool bit = code_prefix(wt, c, l + 1) & 1;
+            size_t before = bit ? rank[l].rank1(s) : rank[l].rank0(s);
+            k = rank[l].select(bit, before + k) - s;
+        }
+        return k >= primary ? k + 1 : k;
+    }
+
+    // backward search: the rows [sp, ep) whose suffixes are prefixed by P
+    pair<size_t, size_t> range(const string &P) const
+    {
+        size_t sp = 0, ep = n + 1;
+        for (size_t k = P.size(); k-- > 0 && sp < ep;)
+        {
+            uint8_t c = P[k];
+            sp = C[c] + occ(c, sp);
+            ep = C[c] + occ(c, ep);
+        }
+        return {sp, max(sp, ep)};
+    }
+
+    size_t count(const string &P) const
+    {
+        auto [sp, ep] = range(P);
+        return ep - sp;
+    }
+
+    // the text offset of the suffix in `row` (row > 0): LF until a sampled
+    // row, at most rate - 1 steps
+    size_t locate(size_t row) const
+    {
+        if (samples.rate == 0)
+        {
+            throw runtime_error("archive has no suffix samples");
+        }
+        size_t steps = 0;
+        while (!samples.marked[row])
+        {
+            row = lf(row);
+            steps++;
+        }
+        return samples.sa.get(marked_rank.rank1(row)) * samples.rate + steps;
+    }
+
+    // sorted text offsets of the occurrences of P
+    vector<size_t> locate(const string &P) const
+    {
+        auto [sp, ep] = range(P);
+        vector<size_t> hits;
+        for (size_t row = sp; row < ep; row++)
+        {
+            hits.push_back(locate(row));
+        }
+        sort(hits.begin(), hits.end());
+        return hits;
+    }
+
+    // the row of suffix pos, where pos is a multiple of the inverse SA step;
+    // blocks without samples fall back to the unbwt starting rows
+    size_t suffix_row(size_t pos) const
+    {
+        if (pos >= n)
+        {
+            return 0;
+        }
+        if (samples.rate != 0)
+        {
+            return samples.isa.get(pos / samples.rate);
+        }
+        return pos == 0 ? primary : header.rows[pos / header.step - 1];
+    }
+
+    // text[offset, offset + len), walking LF back from the next sampled suffix
+    string extract(size_t offset, size_t len) const
+    {
+        offset = min(offset, n);
+        size_t end = offset + min(len, n - offset);
+        size_t step = samples.rate != 0 ? samples.rate : header.step;
+        size_t pos = min((end + step - 1) / step * step, n);
+        size_t row = suffix_row(pos);
+        string out(end - offset, 0);
+        for (; pos > offset; pos--)
+        {
+            if (pos <= end)
+            {
+                out[pos - 1 - offset] = access(row);
+            }
+            row = lf(row);
+        }
+        return out;
+    }
+
+    // the last len characters of the block, walking LF from the sentinel
+    string tail(size_t len) const
+    {
+        len = min(len, n);
+        return extract(n - len, len);
+    }
+
+    // the first len characters of the block, walking psi from suffix 0
+    string head(size_t len) const
+    {
+        len = min(len, n);
+        string out(len, 0);
+        size_t row = primary;
+        for (size_t k = 0; k < len; k++)
+        {
+            out[k] = first(row);
+            row = psi(row);
+        }
+        return out;
+    }
+};
+
+// opens blocks [first, last) of an in-memory archive; the indexes copy
+// what they need, so `in` may be released afterwards
+void open_fm_indexes(const uint8_t *in, const ContainerIndex &index, size_t first, size_t last, unsigned threads,
+                     vector<FMIndex> &blocks)
+{
+    blocks = vector<FMIndex>(last - first);
+    for_each_block(blocks.size(), threads, [&](size_t k)
+    {
+        size_t b = first + k;
+        const uint8_t *block = in + index.comp_offset[b];
+        blocks[k].open(block, block + index.comp_len[b], index.raw_len[b]);
+    });
+}
+
+// opens every block of an in-memory archive, as count and locate need
+void open_fm_indexes(const uint8_t *in, size_t in_len, unsigned threads, vector<FMIndex> &blocks)
+{
+    ContainerIndex index = read_container(in, in_len);
+    open_fm_indexes(in, index, 0, index.size(), threads, blocks);
+}
+
+// calls hit(offset) for every occurrence of P that starts in one block and
+// ends in a later one. those are found in the few characters around each
+// boundary, recovered with LF and psi walks.
+template <class F>
+void boundary_matches(const vector<FMIndex> &blocks, const string &P, F hit)
+{
+    size_t block_end = 0;
+    for (size_t b = 0; b + 1 < blocks.size(); b++)
+    {
+        block_end += blocks[b].n;
+        if (P.size() < 2)
+        {
+            continue;
+        }
+        string window = blocks[b].tail(P.size() - 1);
+        size_t boundary = window.size();
+        for (size_t next = b + 1; next < blocks.size() && window.size() < boundary + P.size() - 1; next++)
+        {
+            window += blocks[next].head(boundary + P.size() - 1 - window.size());
+        }
+        for (size_t i = 0; i < boundary && i + P.size() <= window.size(); i++)
+        {
+            if (i + P.size() > boundary && window.compare(i, P.size(), P) == 0)
+            {
+                hit(block_end - boundary + i);
+            }
+        }
+    }
+}
+
+// occurrences of P in the whole archive
+size_t count(const vector<FMIndex> &blocks, const string &P)
+{
+    if (P.empty())
+    {
+        return 0;
+    }
+    size_t total = 0;
+    for (auto &block : blocks)
+    {
+        total += block.count(P);
+    }
+    boundary_matches(blocks, P, [&](size_t) { total++; });
+    return total;
+}
+
+// sorted archive offsets of the occurrences of P
+vector<size_t> locate(const vector<FMIndex> &blocks, const string &P)
+{
+    vector<size_t> hits;
+    if (P.empty())
+    {
+        return hits;
+    }
+    size_t offset = 0;
+    for (auto &block : blocks)
+    {
+        for (size_t pos : block.locate(P))
+        {
+            hits.push_back(offset + pos);
+        }
+        offset += block.n;
+    }
+    boundary_matches(blocks, P, [&](size_t pos) { hits.push_back(pos); });
+    sort(hits.begin(), hits.end());
+    return hits;
+}
+
+// text[offset, offset + len) of the whole archive, clipped to its end
+string extract(const vector<FMIndex> &blocks, size_t offset, size_t len)
+{
+    string out;
+    size_t block_begin = 0;
+    for (auto &block : blocks)
+    {
+        size_t block_end = block_begin + block.n;
+        if (len > 0 && offset < block_end)
+        {
+            string part = block.extract(offset - block_begin, min(len, block_end - offset));
+            out += part;
+            offset += part.size();
+            len -= part.size();
+        }
+        block_begin = block_end;
+    }
+    return out;
+}
+
+// text[offset, offset + len) of an in-memory archive, clipped to its end.
+// only the blocks the range overlaps are opened, found from the index
+string extract(const uint8_t *in, size_t in_len, size_t offset, size_t len, unsigned threads)
+{
+    ContainerIndex index = read_container(in, in_len);
+    if (len == 0 || offset >= index.raw_total)
+    {
+        return string();
+    }
+    size_t end = offset + min(len, index.raw_total - offset);
+    size_t first = index.block_at(offset), last = index.block_at(end - 1) + 1;
+    vector<FMIndex> blocks;
+    open_fm_indexes(in, index, first, last, threads, blocks);
+    return extract(blocks, offset - index.raw_offset[first], end - offset);
+}
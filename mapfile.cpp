@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// a read-only private mapping of a whole regular file. pages come in on
+// demand and stay clean, so reading the input costs no copy and no heap.
+// suffix sorting reads its block all over, so the default advice is normal
+// readahead; a straight pass can ask for MADV_SEQUENTIAL.
+struct MappedFile
+{
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    MappedFile(int fd, size_t size, int advice = MADV_NORMAL) : size(size)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            throw runtime_error(strerror(errno));
+        }
+        madvise(p, size, advice);
+        data = (const uint8_t *)p;
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (data)
+        {
+            munmap((void *)data, size);
+        }
+    }
+};
+
+// opens filename for reading and tells whether it is a regular file, which
+// can be mapped, and its size; -1 when it cannot be opened
+int open_input(const string &filename, bool &regular, size_t &size)
+{
+    int fd = filename == "-" ? dup(STDIN_FILENO) : open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    regular = S_ISREG(st.st_mode);
+    size = regular ? (size_t)st.st_size : 0;
+    return fd;
+}
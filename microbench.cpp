@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "simd.cpp"
+
+using namespace std;
+
+// times every kernel set the CPU supports against the scalar one and
+// checks that they agree.
+//   g++ -std=c++20 -O2 -o microbench microbench.cpp && ./microbench [MiB]
+
+template <class F>
+double seconds(F fn)
+{
+    auto start = chrono::steady_clock::now();
+    fn();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char const *argv[])
+{
+    size_t bytes = (argc > 1 ? stoull(argv[1]) : 64) << 20;
+    size_t words = bytes / 8;
+    mt19937_64 rng(42);
+
+    vector<uint64_t> random_bits(words), long_runs(words);
+    for (auto &w : random_bits)
+    {
+        w = rng();
+    }
+    // runs of about 4096 bits, mostly whole words
+    for (size_t i = 0; i < words; i++)
+    {
+        long_runs[i] = (i / 64) % 2 ? ~0ull : 0;
+        if (i % 64 == 63)
+        {
+            long_runs[i] = rng();
+        }
+    }
+    vector<uint8_t> text(bytes);
+    for (auto &c : text)
+    {
+        c = "acgtnACGT\n "[rng() % 11];
+    }
+    uint8_t table[32] = {0};
+    for (uint8_t c : {'c', 't', 'C', 'T', ' '})
+    {
+        table[c / 8] |= 1 << (c % 8);
+    }
+
+    vector<const BitKernels *> sets = {&SCALAR_KERNELS};
+#ifdef TLZ_X86
+    __builtin_cpu_init();
+    bool bmi2 = __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+    if (bmi2 && __builtin_cpu_supports("avx2"))
+    {
+        sets.push_back(&AVX2_SCALAR_SPLIT_KERNELS);
+        sets.push_back(&AVX2_KERNELS);
+    }
+    if (bmi2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    {
+        sets.push_back(&AVX512_KERNELS);
+    }
+#endif
+    printf("%zu MiB per kernel, dispatch picks %s\n", bytes >> 20, kernels().name);
+    printf("%-11s %14s %14s %14s %14s\n", "kernels", "popcount", "find_word_not", "level_bits", "split");
+
+    vector<uint64_t> bits((bytes + 63) / 64), reference_bits;
+    vector<uint8_t> out(bytes + 8), reference_out;
+    size_t reference_ones = 0, reference_pos = 0;
+    for (const BitKernels *k : sets)
+    {
+        size_t ones = 0, pos = 0;
+        double t_pop = seconds([&]() { ones = k->popcount(random_bits.data(), words); });
+        double t_find = seconds([&]()
+        {
+            // walk the long runs the way BitVector::for_each_run does
+            for (size_t w = 0; w < words; w++)
+            {
+                uint64_t fill = long_runs[w] >> 63 ? ~0ull : 0;
+                w = k->find_word_not(long_runs.data(), w + 1, words, fill);
+                pos += w;
+            }
+        });
+        double t_bits = seconds([&]() { k->level_bits(text.data(), bytes, table, bits.data()); });
+        double t_split = seconds([&]()
+        {
+            // one node whose two children are kept, as in build_levels
+            size_t ones_total = 0;
+            for (uint64_t w : bits)
+            {
+                ones_total += __builtin_popcountll(w);
+            }
+            uint8_t *dst[2] = {out.data(), out.data() + (bytes - ones_total)};
+            bool keep[2] = {true, true};
+            k->split(text.data(), bytes, bits.data(), 0, dst, keep);
+        });
+
+        if (k == &SCALAR_KERNELS)
+        {
+            reference_ones = ones;
+            reference_pos = pos;
+            reference_bits = bits;
+            reference_out = out;
+        }
+        else if (ones != reference_ones || pos != reference_pos || bits != reference_bits ||
+                 !equal(out.begin(), out.begin() + bytes, reference_out.begin()))
+        {
+            printf("%s disagrees with scalar\n", k->name);
+            return 1;
+        }
+        auto rate = [&](double t) { return to_string((int)(bytes / t / 1e6)) + " MB/s"; };
+        printf("%-11s %14s %14s %14s %14s\n", k->name, rate(t_pop).c_str(), rate(t_find).c_str(),
+               rate(t_bits).c_str(), rate(t_split).c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,382 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bitio.cpp"
+
+using namespace std;
+
+// the fast block back end: move-to-front over the BWT, runs of rank 0 in
+// bijective base 2 (RUNA / RUNB, as bzip2 has them), and a length-limited
+// canonical Huffman code per segment. it trades the wavelet tree's queries
+// and some ratio for a decoder that is a table lookup and a short memmove
+// per symbol.
+//
+// layout, in place of the wavelet tree:
+//   u8 MTF_TAG | per segment of MTF_SEGMENT BWT bytes (the last may be short):
+//     varint symbols | the code length of every symbol, a nibble each, high
+//     first | varint byte_len | the Huffman coded symbols, MSB first
+// the move-to-front list carries over from one segment to the next, a run
+// does not.
+const uint8_t MTF_TAG = 0x80; // the wavelet tree's shape byte never has its top bit set
+const size_t MTF_SEGMENT = size_t(1) << 18;
+const size_t MTF_SYMBOLS = 257; // RUNA, RUNB and ranks 1..255 as 2..256
+const size_t MTF_RUNA = 0, MTF_RUNB = 1;
+const size_t HUFF_MAX_LEN = 12; // a decoding table of 2^12 entries stays in L1
+
+// Huffman code lengths for count[0, symbols), none above max_len: the
+// weights are flattened and the tree rebuilt until it fits, as bzip2 does.
+// a lone symbol gets a 1-bit code
+void huffman_lengths(const uint64_t *count, size_t symbols, size_t max_len, uint8_t *len)
+{
+    vector<uint64_t> weight(count, count + symbols);
+    vector<size_t> used;
+    for (size_t s = 0; s < symbols; s++)
+    {
+        len[s] = 0;
+        if (count[s] != 0)
+        {
+            used.push_back(s);
+        }
+    }
+    if (used.size() == 1)
+    {
+        len[used[0]] = 1;
+        return;
+    }
+    vector<size_t> parent(2 * symbols);
+    while (!used.empty())
+    {
+        priority_queue<pair<uint64_t, size_t>, vector<pair<uint64_t, size_t>>, greater<>> heap;
+        for (size_t s : used)
+        {
+            heap.push({weight[s], s});
+        }
+        size_t next_node = symbols;
+        while (heap.size() > 1)
+        {
+            auto [w1, a] = heap.top();
+            heap.pop();
+            auto [w2, b] = heap.top();
+            heap.pop();
+            parent[a] = parent[b] = next_node;
+            heap.push({w1 + w2, next_node++});
+        }
+        size_t root = next_node - 1, longest = 0;
+        for (size_t s : used)
+        {
+            size_t l = 0;
+            for (size_t node = s; node != root; node = parent[node])
+            {
+                l++;
+            }
+            len[s] = l;
+            longest = max(longest, l);
+        }
+        if (longest <= max_len)
+        {
+            return;
+        }
+        for (size_t s : used)
+        {
+            weight[s] = 1 + weight[s] / 2;
+        }
+    }
+}
+
+// canonical codes for the lengths: shorter codes first, and symbol order
+// within a length. returns false if the lengths oversubscribe the code space
+bool canonical_codes(const uint8_t *len, size_t symbols, uint32_t *code)
+{
+    uint32_t per_len[HUFF_MAX_LEN + 1] = {0}, next[HUFF_MAX_LEN + 1];
+    for (size_t s = 0; s < symbols; s++)
+    {
+        per_len[len[s]]++;
+    }
+    uint32_t c = 0, space = 0;
+    per_len[0] = 0;
+    for (size_t l = 1; l <= HUFF_MAX_LEN; l++)
+    {
+        c = (c + per_len[l - 1]) << 1;
+        next[l] = c;
+        space += per_len[l] << (HUFF_MAX_LEN - l);
+    }
+    for (size_t s = 0; s < symbols; s++)
+    {
+        code[s] = len[s] ? next[len[s]]++ : 0;
+    }
+    return space <= (1u << HUFF_MAX_LEN);
+}
+
+// moves order[rank] to the front of the list. most ranks of a BWT are
+// small, and for those the list head is shifted as one 16-byte integer
+// instead of through memmove
+inline void move_to_front(uint8_t *order, size_t rank)
+{
+    uint8_t c = order[rank];
+    if (rank < 16)
+    {
+        unsigned __int128 head, low = rank == 15 ? ~(unsigned __int128)0 : ((unsigned __int128)1 << (8 * rank + 8)) - 1;
+        memcpy(&head, order, 16);
+        head = (head << 8 & low) | (head & ~low) | c;
+        memcpy(order, &head, 16);
+        return;
+    }
+    memmove(order + 1, order, rank);
+    order[0] = c;
+}
+
+// move-to-front and zero runs over bwt[0, n), Huffman coded segment by
+// segment into out
+void mtf_encode(const uint8_t *bwt, size_t n, string &out)
+{
+    out.push_back((char)MTF_TAG);
+    uint8_t order[256];
+    iota(order, order + 256, 0);
+    vector<uint16_t> symbols(MTF_SEGMENT);
+    for (size_t begin = 0; begin < n; begin += MTF_SEGMENT)
+    {
+        size_t end = min(n, begin + MTF_SEGMENT), m = 0, run = 0;
+        auto flush_run = [&]()
+        {
+            for (; run > 0; run = (run - 1) >> 1)
+            {
+                symbols[m++] = (run - 1) & 1 ? MTF_RUNB : MTF_RUNA;
+            }
+        };
+        for (size_t i = begin; i < end; i++)
+        {
+            uint8_t c = bwt[i];
+            if (c == order[0])
+            {
+                run++;
+                continue;
+            }
+            flush_run();
+            size_t rank = (const uint8_t *)memchr(order + 1, c, 255) - order;
+            move_to_front(order, rank);
+            symbols[m++] = rank + 1;
+        }
+        flush_run();
+
+        uint64_t count[MTF_SYMBOLS] = {0};
+        for (size_t k = 0; k < m; k++)
+        {
+            count[symbols[k]]++;
+        }
+        uint8_t len[MTF_SYMBOLS + 1] = {0};
+        uint32_t code[MTF_SYMBOLS];
+        huffman_lengths(count, MTF_SYMBOLS, HUFF_MAX_LEN, len);
+        canonical_codes(len, MTF_SYMBOLS, code);
+        put_varint(out, m);
+        for (size_t s = 0; s < MTF_SYMBOLS; s += 2)
+        {
+            out.push_back((char)(len[s] << 4 | len[s + 1]));
+        }
+        BitWriter bits;
+        bits.bytes.reserve(m * 3 / 2 + 8);
+        for (size_t k = 0; k < m; k++)
+        {
+            bits.put(code[symbols[k]], len[symbols[k]]);
+        }
+        bits.finish();
+        put_varint(out, bits.bytes.size());
+        out.append((const char *)bits.bytes.data(), bits.bytes.size());
+    }
+}
+
+// decodes a segment's symbols through a table indexed by the next
+// HUFF_MAX_LEN bits. an entry holds the symbol whose code starts there and,
+// when the code of the following symbol fits in the rest of the index, that
+// symbol too, so a lookup decodes two short codes at once.
+struct HuffmanDecoder
+{
+    struct Entry
+    {
+        uint16_t symbol[2];
+        uint8_t count;      // symbols decoded, 0 for a hole in an incomplete code
+        uint8_t bits;       // bits they take
+        uint8_t first_bits; // bits of symbol[0] alone
+    };
+    vector<Entry> table = vector<Entry>(size_t(1) << HUFF_MAX_LEN);
+
+    void build(const uint8_t *len, size_t symbols)
+    {
+        vector<uint32_t> code(symbols);
+        if (!canonical_codes(len, symbols, code.data()))
+        {
+            throw runtime_error("corrupt Huffman code");
+        }
+        fill(table.begin(), table.end(), Entry());
+        for (size_t s = 0; s < symbols; s++)
+        {
+            if (len[s] != 0)
+            {
+                size_t shift = HUFF_MAX_LEN - len[s];
+                for (size_t i = code[s] << shift; i < (code[s] + 1) << shift; i++)
+                {
+                    table[i] = {{(uint16_t)s, 0}, 1, len[s], len[s]};
+                }
+            }
+        }
+        vector<Entry> single = table;
+        const size_t mask = (size_t(1) << HUFF_MAX_LEN) - 1;
+        for (size_t i = 0; i < table.size(); i++)
+        {
+            Entry &e = table[i];
+            const Entry &next = single[(i << e.bits) & mask];
+            if (e.count == 1 && next.count == 1 && e.bits + next.bits <= HUFF_MAX_LEN)
+            {
+                e.symbol[1] = next.symbol[0];
+                e.count = 2;
+                e.bits += next.bits;
+            }
+        }
+    }
+
+    // the m symbols coded in in[0, in_len) into out, which has room for
+    // m + 8 of them
+    void decode(const uint8_t *in, size_t in_len, uint16_t *out, size_t m) const
+    {
+        size_t pos = 0, k = 0;
+        bool hole = false;
+        // a 64-bit window holds at least 57 valid bits, four lookups' worth
+        while (k + 8 <= m)
+        {
+            uint64_t w = peek_bits(in, in_len, pos);
+            for (size_t j = 0; j < 4; j++)
+            {
+                const Entry &e = table[w >> (64 - HUFF_MAX_LEN)];
+                out[k] = e.symbol[0];
+                out[k + 1] = e.symbol[1];
+                k += e.count;
+                pos += e.bits;
+                w <<= e.bits;
+                hole |= e.count == 0;
+            }
+            if (hole)
+            {
+                throw runtime_error("corrupt Huffman stream");
+            }
+        }
+        for (; k < m; k++)
+        {
+            const Entry &e = table[peek_bits(in, in_len, pos) >> (64 - HUFF_MAX_LEN)];
+            if (e.count == 0)
+            {
+                throw runtime_error("corrupt Huffman stream");
+            }
+            out[k] = e.symbol[0];
+            pos += e.first_bits;
+        }
+        if (pos > 8 * in_len)
+        {
+            throw runtime_error("truncated Huffman stream");
+        }
+    }
+};
+
+// whether the block body at `in` is mtf_encode output
+bool is_mtf_block(const ByteReader &in)
+{
+    return in.left() != 0 && *in.p == MTF_TAG;
+}
+
+// inverse of mtf_encode: the n BWT bytes at `in` into bwt
+void mtf_decode(ByteReader &in, uint8_t *bwt, size_t n)
+{
+    if (in.u8() != MTF_TAG)
+    {
+        throw runtime_error("not a move-to-front block");
+    }
+    uint8_t order[256];
+    iota(order, order + 256, 0);
+    vector<uint16_t> symbols(MTF_SEGMENT + 8);
+    HuffmanDecoder decoder;
+    for (size_t begin = 0; begin < n; begin += MTF_SEGMENT)
+    {
+        uint8_t *out = bwt + begin, *end = bwt + min(n, begin + MTF_SEGMENT);
+        size_t m = in.varint();
+        if (m > (size_t)(end - out))
+        {
+            throw runtime_error("corrupt move-to-front block");
+        }
+        const uint8_t *nibbles = in.take((MTF_SYMBOLS + 1) / 2);
+        uint8_t len[MTF_SYMBOLS + 1];
+        for (size_t s = 0; s < MTF_SYMBOLS + 1; s++)
+        {
+            len[s] = s % 2 ? nibbles[s / 2] & 15 : nibbles[s / 2] >> 4;
+            if (len[s] > HUFF_MAX_LEN)
+            {
+                throw runtime_error("corrupt Huffman code");
+            }
+        }
+        decoder.build(len, MTF_SYMBOLS);
+        size_t bytes = in.varint();
+        if (bytes > in.left())
+        {
+            throw runtime_error("truncated move-to-front block");
+        }
+        decoder.decode(in.take(bytes), bytes, symbols.data(), m);
+
+        // a run's digits are RUNA = 1 and RUNB = 2, lowest first. runs are
+        // checked against the room left as they grow, and literals as they
+        // are written, so a corrupt segment cannot overrun
+        size_t run = 0, digit = 1;
+        for (size_t k = 0; k < m; k++)
+        {
+            uint16_t s = symbols[k];
+            if (s <= MTF_RUNB)
+            {
+                run += digit << s;
+                digit <<= 1;
+                if (run > (size_t)(end - out))
+                {
+                    throw runtime_error("corrupt move-to-front block");
+                }
+                continue;
+            }
+            if (run != 0)
+            {
+                memset(out, order[0], run);
+                out += run;
+                run = 0;
+                digit = 1;
+            }
+            if (out == end)
+            {
+                throw runtime_error("corrupt move-to-front block");
+            }
+            move_to_front(order, s - 1);
+            *out++ = order[0];
+        }
+        memset(out, order[0], run);
+        out += run;
+        if (out != end)
+        {
+            throw runtime_error("corrupt move-to-front block");
+        }
+    }
+}
+
+// steps `in` over the mtf_encode output of n BWT bytes without decoding it
+void skip_mtf(ByteReader &in, size_t n)
+{
+    if (in.u8() != MTF_TAG)
+    {
+        throw runtime_error("not a move-to-front block");
+    }
+    for (size_t begin = 0; begin < n; begin += MTF_SEGMENT)
+    {
+        in.varint();
+        in.take((MTF_SYMBOLS + 1) / 2);
+        in.take(in.varint());
+    }
+}
@@ -1,276 +1,1169 @@
+#pragma once
+
 #include <vector>
 #include <algorithm>
-#include <iostream>
-#include <fstream>
-#include <boost/dynamic_bitset.hpp>
+#include <cstring>
+#include <stdexcept>
+#include <tuple>
+#include <numeric>
+#include <queue>
+
+#include "bitvector.cpp"
+#include "bitio.cpp"
+#include "rans.cpp"
 
 using namespace std;
 
 #define RUN_LENGTH 8
 #define RUN_LENGTH_MAX 255
+#define MAX_CODE_LENGTH 32
 
-size_t lastnode = 0;
+// how symbols are mapped to root-to-leaf paths
+enum WaveletShape : uint8_t
+{
+    WT_BALANCED = 0, // fixed-width codes, ceil(log2 sigma) levels
+    WT_HUFFMAN = 1,  // Huffman codes, about H0 bits per symbol in total
+};
 
-void init_wt(vector<boost::dynamic_bitset<>> &wt, vector<size_t> T, size_t index)
+// how the run lengths of the levels are coded
+enum LevelCoding : uint8_t
 {
+    LEVELS_GAMMA = 0,    // Elias gamma, no model
+    LEVELS_RANS = 1,     // run-length classes per node, interleaved rANS
+    LEVELS_ADAPTIVE = 2, // the cheapest NodeCoding for each node
+};
 
-    vector<size_t> char_count(256, 0);
+// how a node of an LEVELS_ADAPTIVE level is coded, in a NODE_TAG_BITS tag
+// in front of it. the run codings start with the node's first bit.
+enum NodeCoding : uint8_t
+{
+    NODE_RAW = 0,   // the bits as they are
+    NODE_RLE8 = 1,  // runs in RUN_LENGTH bits, longer ones split by empty runs
+    NODE_GAMMA = 2, // runs in Elias gamma
+    NODE_DELTA = 3, // runs in Elias delta
+    NODE_RICE = 4,  // 6-bit k, then run - 1 in Golomb-Rice with parameter k
+    NODE_EF = 5,    // the positions of the 1s in Elias-Fano
+};
+const size_t NODE_TAG_BITS = 3;
 
-    size_t low, high, mid;
+// a level-wise wavelet tree over bytes. symbol c is spelled by the len[c]
+// low bits of code[c], most significant first, and the tree is the binary
+// trie of those codes. level l stores one bit for every symbol whose code is
+// longer than l, with the nodes of depth l laid out in code-prefix order and
+// each node keeping its symbols in sequence order. node boundaries follow
+// from count[], so a level is a single bitvector.
+struct WaveletTree
+{
+    WaveletShape shape = WT_BALANCED;
+    LevelCoding coding = LEVELS_GAMMA;
+    size_t count[256] = {0};
+    uint64_t code[256] = {0};
+    uint8_t len[256] = {0};
+    vector<BitVector> level;
+    vector<BitWriter> encoded; // the levels run-length coded, for write_wt
 
-    for (size_t i = 0; i < T.size(); i++)
+    size_t depth() const
     {
-        char_count[T[i]]++;
+        return level.size();
     }
+};
 
-    for (size_t i = 0; i < char_count.size(); i++)
+// every present symbol gets its rank among the present symbols as a
+// fixed-width code, so the tree has ceil(log2 sigma) levels
+void assign_balanced_codes(WaveletTree &wt)
+{
+    size_t sigma = 0;
+    for (size_t c = 0; c < 256; c++)
+    {
+        sigma += wt.count[c] != 0;
+    }
+    uint8_t width = 0;
+    while (((size_t)1 << width) < sigma)
+    {
+        width++;
+    }
+    for (size_t c = 0, rank = 0; c < 256; c++)
     {
-        if (char_count[i] == 0)
+        if (wt.count[c] != 0)
         {
-            wt[0].push_back(0);
+            wt.code[c] = rank++;
+            wt.len[c] = width;
         }
-        else if (char_count[i] > 0)
+    }
+}
+
+// canonical Huffman codes over count[]. lengths above MAX_CODE_LENGTH are
+// avoided by flattening the weights and rebuilding, as bzip2 does.
+void assign_huffman_codes(WaveletTree &wt)
+{
+    vector<uint64_t> weight(wt.count, wt.count + 256);
+    vector<uint8_t> symbols;
+    for (size_t c = 0; c < 256; c++)
+    {
+        if (wt.count[c] != 0)
         {
-            wt[0].push_back(1);
+            symbols.push_back(c);
         }
     }
+    if (symbols.size() == 1)
+    {
+        wt.code[symbols[0]] = 0;
+        wt.len[symbols[0]] = 0;
+        return;
+    }
 
-    for (size_t i = 1; i < char_count.size(); i++)
+    while (true)
     {
-        if (char_count[i] != 0)
+        // nodes 0..255 are the leaves; ties go to the lower node id so that
+        // the decoder derives the same lengths
+        vector<size_t> parent(512, 0);
+        priority_queue<pair<uint64_t, size_t>, vector<pair<uint64_t, size_t>>, greater<>> heap;
+        for (uint8_t c : symbols)
+        {
+            heap.push({weight[c], c});
+        }
+        size_t next_node = 256;
+        while (heap.size() > 1)
+        {
+            auto [w1, a] = heap.top();
+            heap.pop();
+            auto [w2, b] = heap.top();
+            heap.pop();
+            parent[a] = parent[b] = next_node;
+            heap.push({w1 + w2, next_node++});
+        }
+        size_t root = next_node - 1;
+
+        size_t longest = 0;
+        for (uint8_t c : symbols)
+        {
+            size_t len = 0;
+            for (size_t node = c; node != root; node = parent[node])
+            {
+                len++;
+            }
+            wt.len[c] = len;
+            longest = max(longest, len);
+        }
+        if (longest <= MAX_CODE_LENGTH)
         {
-            low = i;
             break;
         }
+        for (uint8_t c : symbols)
+        {
+            weight[c] = 1 + weight[c] / 2;
+        }
+    }
+
+    stable_sort(symbols.begin(), symbols.end(), [&wt](uint8_t a, uint8_t b)
+                { return wt.len[a] < wt.len[b]; });
+    uint64_t code = 0;
+    uint8_t prev_len = wt.len[symbols[0]];
+    for (uint8_t c : symbols)
+    {
+        code <<= wt.len[c] - prev_len;
+        prev_len = wt.len[c];
+        wt.code[c] = code++;
+    }
+}
+
+void assign_codes(WaveletTree &wt)
+{
+    fill(wt.code, wt.code + 256, 0);
+    fill(wt.len, wt.len + 256, 0);
+    if (wt.shape == WT_HUFFMAN)
+    {
+        assign_huffman_codes(wt);
+    }
+    else
+    {
+        assign_balanced_codes(wt);
     }
+}
 
-    for (size_t i = char_count.size() - 1; i >= 0; i--)
+// present symbols in the order of their left-aligned codes, i.e. the order
+// of the leaves of the trie
+vector<uint8_t> symbols_by_code(const WaveletTree &wt)
+{
+    vector<uint8_t> symbols;
+    for (size_t c = 0; c < 256; c++)
     {
-        if (char_count[i] != 0)
+        if (wt.count[c] != 0)
         {
-            high = i;
-            break;
+            symbols.push_back(c);
         }
     }
+    auto key = [&wt](uint8_t c)
+    { return wt.len[c] == 0 ? 0 : wt.code[c] << (64 - wt.len[c]); };
+    sort(symbols.begin(), symbols.end(), [&key](uint8_t a, uint8_t b)
+         { return key(a) < key(b); });
+    return symbols;
+}
 
-    if (low == high)
+// the top `depth` bits of c's code, i.e. the node holding c at that depth
+uint64_t code_prefix(const WaveletTree &wt, uint8_t c, size_t depth)
+{
+    return wt.code[c] >> (wt.len[c] - depth);
+}
+
+// numbers the nodes of depth `depth` in level order: node_of[c] is the node
+// holding symbol c (for symbols still present at that depth) and start[k]
+// the first position of node k in the level
+void node_starts(const WaveletTree &wt, const vector<uint8_t> &symbols, size_t depth, uint8_t node_of[256], size_t start[256])
+{
+    size_t offset = 0, nodes = 0;
+    for (size_t k = 0; k < symbols.size();)
     {
-        return;
+        uint8_t c = symbols[k];
+        if (wt.len[c] <= depth)
+        {
+            k++;
+            continue;
+        }
+        uint64_t node = code_prefix(wt, c, depth);
+        start[nodes] = offset;
+        for (; k < symbols.size(); k++)
+        {
+            uint8_t d = symbols[k];
+            if (wt.len[d] <= depth)
+            {
+                continue;
+            }
+            if (code_prefix(wt, d, depth) != node)
+            {
+                break;
+            }
+            node_of[d] = nodes;
+            offset += wt.count[d];
+        }
+        nodes++;
     }
+}
 
-    mid = (low + high) / 2;
-
-    for (size_t i = 0; i < T.size(); i++)
+// the sizes of the nodes of depth `depth`, in level order
+vector<size_t> node_sizes(const WaveletTree &wt, const vector<uint8_t> &symbols, size_t depth)
+{
+    vector<size_t> sizes;
+    uint64_t node = 0;
+    for (uint8_t c : symbols)
     {
-        if (T[i] <= mid)
+        if (wt.len[c] <= depth)
         {
-            wt[index].push_back(0);
+            continue;
         }
-        else
+        if (sizes.empty() || code_prefix(wt, c, depth) != node)
         {
-            wt[index].push_back(1);
+            node = code_prefix(wt, c, depth);
+            sizes.push_back(0);
         }
+        sizes.back() += wt.count[c];
     }
+    return sizes;
+}
 
-    size_t num_1 = wt[index].count();
-    size_t num_0 = wt[index].size() - num_1;
+// number of symbols spelled by level `depth`
+size_t level_size(const WaveletTree &wt, size_t depth)
+{
+    size_t size = 0;
+    for (size_t c = 0; c < 256; c++)
+    {
+        size += wt.len[c] > depth ? wt.count[c] : 0;
+    }
+    return size;
+}
 
-    vector<size_t> left_T;
-    vector<size_t> right_T;
+// builds the levels of wt from the n symbols in T, whose codes must already
+// be assigned. each level is one pass that emits the level's bits as packed
+// words and stably scatters the symbols into their child nodes; T and the
+// n-byte scratch are used as the two halves of that scatter.
+void build_levels(WaveletTree &wt, uint8_t *T, size_t n, uint8_t *scratch)
+{
+    size_t depth = 0;
+    for (size_t c = 0; c < 256; c++)
+    {
+        depth = max<size_t>(depth, wt.len[c]);
+    }
+    vector<uint8_t> symbols = symbols_by_code(wt);
 
-    for (size_t i = 0; i < wt[index].size(); i++)
+    wt.level.resize(depth); // a reused tree keeps its levels' words
+    uint8_t *cur = T, *next = scratch;
+    size_t m = n;
+    for (size_t l = 0; l < depth; l++)
     {
-        if (wt[index][i] == 0)
+        // the level's bits come from a 256-bit table of each symbol's bit
+        uint8_t table[32] = {0};
+        for (uint8_t c : symbols)
         {
-            left_T.push_back(T[i]);
+            if (wt.len[c] > l)
+            {
+                table[c / 8] |= ((wt.code[c] >> (wt.len[c] - 1 - l)) & 1) << (c % 8);
+            }
         }
-        else
+        BitVector &B = wt.level[l];
+        B.words.assign((m + 63) / 64, 0);
+        B.length = m;
+        kernels().level_bits(cur, m, table, B.words.data());
+
+        // then every node is split stably into its two children; a leaf
+        // child is not carried to the next level and writes into a sink
+        uint8_t node_of[256];
+        size_t start[256];
+        node_starts(wt, symbols, l + 1, node_of, start);
+        uint8_t sink[8];
+        size_t j = 0;
+        for (size_t k = 0; k < symbols.size() && l + 1 < depth;)
         {
-            right_T.push_back(T[i]);
+            uint8_t c = symbols[k];
+            if (wt.len[c] <= l)
+            {
+                k++;
+                continue;
+            }
+            uint64_t node = code_prefix(wt, c, l);
+            uint8_t *dst[2] = {sink, sink};
+            bool keep[2] = {false, false};
+            size_t size = 0;
+            for (; k < symbols.size(); k++)
+            {
+                uint8_t d = symbols[k];
+                if (wt.len[d] <= l)
+                {
+                    continue;
+                }
+                if (code_prefix(wt, d, l) != node)
+                {
+                    break;
+                }
+                size_t b = code_prefix(wt, d, l + 1) & 1;
+                if (wt.len[d] > l + 1 && !keep[b])
+                {
+                    dst[b] = next + start[node_of[d]];
+                    keep[b] = true;
+                }
+                size += wt.count[d];
+            }
+            kernels().split(cur + j, size, B.words.data(), j, dst, keep);
+            j += size;
         }
+
+        m = level_size(wt, l + 1);
+        swap(cur, next);
     }
+}
 
-    if (index > lastnode)
+void init_wt(WaveletTree &wt, uint8_t *T, size_t n, uint8_t *scratch)
+{
+    fill(wt.count, wt.count + 256, 0);
+    for (size_t i = 0; i < n; i++)
     {
-        lastnode = index;
+        wt.count[T[i]]++;
     }
-
-    init_wt(wt, left_T, index * 2);
-    init_wt(wt, right_T, index * 2 + 1);
+    assign_codes(wt);
+    build_levels(wt, T, n, scratch);
 }
 
-void compress_bitset(boost::dynamic_bitset<> &B)
+// the first bit of B, then every run length as an Elias gamma code. `out`
+// may be a spent writer, whose buffer is reused
+BitWriter compress_bitset_gamma(const BitVector &B, BitWriter out = BitWriter())
 {
-    size_t counter = 0;
-    boost::dynamic_bitset<> temp;
-    temp.push_back(B[0]);
-
-    auto last = B[0];
+    out.clear();
+    out.put(B[0], 1);
+    B.for_each_run([&](size_t run) { out.put_gamma(run); });
+    out.finish();
+    return out;
+}
 
-    for (size_t j = 0; j < B.size(); j++)
+// the runs of B cut at the node boundaries: fn(node, bit, run) for each,
+// in order
+template <class F>
+void for_each_node_run(const BitVector &B, const vector<size_t> &nodes, F fn)
+{
+    size_t node = 0, left = nodes[0];
+    bool bit = B[0];
+    B.for_each_run([&](size_t run)
     {
-        auto bit = B[j];
-        if (bit != last)
+        if (run < left)
+        {
+            fn(node, bit, run);
+            left -= run;
+            bit = !bit;
+            return;
+        }
+        while (run > 0)
         {
-            for (size_t i = 0; i < RUN_LENGTH; i++)
+            size_t part = min(run, left);
+            fn(node, bit, part);
+            run -= part;
+            left -= part;
+            if (left == 0 && node + 1 < nodes.size())
             {
-                bool temp_bit = (counter >> (RUN_LENGTH - i - 1)) & 1;
-                temp.push_back(temp_bit);
+                left = nodes[++node];
             }
+        }
+        bit = !bit;
+    });
+}
 
-            counter = 1;
+// a run falls in class floor(log2 run) and is the class's power of two
+// plus that many extra bits. every node has a model of the classes for its
+// runs of 0s and another for its runs of 1s, as the two differ most where
+// a node is skewed. layout:
+//   varint runs << 1 | first bit, per node
+//   model of every (node, bit) with runs, node-major, bit 0 first
+//   varint raw_len | the extra bits of all runs, in order
+//   the classes in the same order as one rANS stream
+BitWriter compress_bitset_rans(const BitVector &B, const vector<size_t> &nodes, BitWriter level = BitWriter())
+{
+    vector<uint64_t> counts(2 * nodes.size() * RANS_SYMBOLS, 0);
+    for_each_node_run(B, nodes, [&](size_t node, bool bit, size_t run)
+    {
+        counts[(2 * node + bit) * RANS_SYMBOLS + (63 - __builtin_clzll(run))]++;
+    });
+    string out;
+    for (size_t k = 0, start = 0; k < nodes.size(); start += nodes[k++])
+    {
+        const uint64_t *c = counts.data() + 2 * k * RANS_SYMBOLS;
+        size_t runs = accumulate(c, c + 2 * RANS_SYMBOLS, (uint64_t)0);
+        put_varint(out, runs << 1 | B[start]);
+    }
+    vector<RansModel> models(2 * nodes.size());
+    for (size_t ctx = 0; ctx < models.size(); ctx++)
+    {
+        const uint64_t *c = counts.data() + ctx * RANS_SYMBOLS;
+        if (any_of(c, c + RANS_SYMBOLS, [](uint64_t k) { return k != 0; }))
+        {
+            models[ctx].normalize(c);
+            models[ctx].write(out);
         }
-        else if (bit == last)
+    }
+    vector<uint64_t>().swap(counts);
+
+    BitWriter raw;
+    string stream;
+    RansEncoder rans(stream);
+    for_each_node_run(B, nodes, [&](size_t node, bool bit, size_t run)
+    {
+        size_t cls = 63 - __builtin_clzll(run);
+        raw.put(run, cls);
+        rans.put(models[2 * node + bit], cls);
+    });
+    rans.flush();
+    raw.finish();
+    put_varint(out, raw.bytes.size());
+    out.append((const char *)raw.bytes.data(), raw.bytes.size());
+    out += stream;
+
+    level.clear();
+    level.bytes.assign(out.begin(), out.end());
+    level.bits = 8 * out.size();
+    return level;
+}
+
+// what one pass over a node's runs tells about the cost of each coding
+struct NodeRunStats
+{
+    size_t size = 0, runs = 0, ones = 0;
+    size_t long_runs = 0;                    // RUN_LENGTH_MAX splits for NODE_RLE8
+    size_t seen = 0, last_one = 0;           // bits passed so far, and the offset of the last 1
+    uint64_t count[64] = {0}, sum[64] = {0}; // runs and their total length per class floor(log2 run)
+};
+
+// Elias-Fano over `ones` positions below `size`: the low bits per position
+size_t ef_low_bits(size_t size, size_t ones)
+{
+    return ones == 0 || size <= ones ? 0 : 63 - __builtin_clzll(size / ones);
+}
+
+// the coding of a node with the fewest bits by its stats, and the Rice
+// parameter for NODE_RICE. the costs are exact but for Rice, whose
+// quotients are taken from the class sums. NODE_EF's high part is a stop
+// bit per 1 plus the high part of the last one in zeros
+NodeCoding choose_node_coding(const NodeRunStats &s, size_t &rice_k)
+{
+    auto log2 = [](uint64_t v) { return (uint64_t)(63 - __builtin_clzll(v)); };
+    uint64_t gamma = 1, delta = 1, top = 0;
+    for (size_t cls = 0; cls < 64; cls++)
+    {
+        gamma += s.count[cls] * (2 * cls + 1);
+        delta += s.count[cls] * (cls + 2 * log2(cls + 1) + 1);
+        top = s.count[cls] ? cls : top;
+    }
+    uint64_t rice = UINT64_MAX;
+    for (size_t k = 0; k <= min<size_t>(top, 57); k++)
+    {
+        uint64_t cost = 1 + 6 + s.runs * (k + 1);
+        for (size_t cls = k; cls <= top; cls++)
         {
-            counter++;
-            if (counter < RUN_LENGTH_MAX)
+            cost += (s.sum[cls] - s.count[cls]) >> k;
+        }
+        if (cost < rice)
+        {
+            rice = cost;
+            rice_k = k;
+        }
+    }
+    size_t low = ef_low_bits(s.size, s.ones);
+    uint64_t costs[] = {s.size,
+                        1 + RUN_LENGTH * (s.runs + 2 * s.long_runs),
+                        gamma,
+                        delta,
+                        rice,
+                        2 * log2(s.ones + 1) + 1 + s.ones * (low + 1) + (s.last_one >> low)};
+    // ties go to the lower tag, which decodes faster
+    return (NodeCoding)(min_element(begin(costs), end(costs)) - begin(costs));
+}
+
+// every node of a level coded on its own, after a 3-bit NodeCoding tag.
+// layouts past the tag:
+//   NODE_RAW:   the node's bits
+//   run codings: (NODE_RICE: 6-bit k) | the first bit | the runs
+//   NODE_EF:    gamma(ones + 1) | the ef_low_bits low bits of every 1's
+//               offset | the gaps between their high parts, in unary
+BitWriter compress_bitset_adaptive(const BitVector &B, const vector<size_t> &nodes, BitWriter out = BitWriter())
+{
+    vector<NodeRunStats> stats(nodes.size());
+    for_each_node_run(B, nodes, [&](size_t node, bool bit, size_t run)
+    {
+        NodeRunStats &s = stats[node];
+        size_t cls = 63 - __builtin_clzll(run);
+        s.runs++;
+        s.count[cls]++;
+        s.sum[cls] += run;
+        s.ones += bit ? run : 0;
+        s.long_runs += (run - 1) / RUN_LENGTH_MAX;
+        s.last_one = bit ? s.seen + run - 1 : s.last_one;
+        s.seen += run;
+    });
+    vector<NodeCoding> coding(nodes.size());
+    vector<size_t> rice_k(nodes.size(), 0), start(nodes.size(), 0);
+    for (size_t k = 0; k < nodes.size(); k++)
+    {
+        stats[k].size = nodes[k];
+        coding[k] = choose_node_coding(stats[k], rice_k[k]);
+        start[k] = k == 0 ? 0 : start[k - 1] + nodes[k - 1];
+    }
+    vector<NodeRunStats>().swap(stats);
+
+    out.clear();
+    size_t current = SIZE_MAX;
+    for_each_node_run(B, nodes, [&](size_t node, bool bit, size_t run)
+    {
+        if (node != current)
+        {
+            current = node;
+            out.put(coding[node], NODE_TAG_BITS);
+            size_t begin = start[node], end = begin + nodes[node];
+            if (coding[node] == NODE_RAW)
             {
-                ;
+                for (size_t pos = begin; pos < end; pos += 64)
+                {
+                    size_t width = min<size_t>(64, end - pos);
+                    out.put(reverse_bits(B.bits_at(pos, width)) >> (64 - width), width);
+                }
             }
-            else if (counter == RUN_LENGTH_MAX)
+            else if (coding[node] == NODE_EF)
             {
-                for (size_t i = 0; i < RUN_LENGTH; i++)
+                size_t ones = 0;
+                for (size_t pos = begin; pos < end; pos += 64)
                 {
-                    bool temp_bit = (counter >> (RUN_LENGTH - i - 1)) & 1;
-                    temp.push_back(temp_bit);
+                    ones += __builtin_popcountll(B.bits_at(pos, min<size_t>(64, end - pos)));
                 }
-                for (size_t i = 0; i < RUN_LENGTH; i++)
+                size_t low = ef_low_bits(nodes[node], ones);
+                out.put_gamma(ones + 1);
+                auto for_each_one = [&](auto fn)
+                {
+                    for (size_t pos = begin; pos < end; pos += 64)
+                    {
+                        for (uint64_t w = B.bits_at(pos, min<size_t>(64, end - pos)); w != 0; w &= w - 1)
+                        {
+                            fn(pos - begin + __builtin_ctzll(w));
+                        }
+                    }
+                };
+                for_each_one([&](size_t x) { out.put(x, low); });
+                size_t high = 0;
+                for_each_one([&](size_t x)
+                {
+                    out.put_rice((x >> low) - high, 0);
+                    high = x >> low;
+                });
+            }
+            else
+            {
+                if (coding[node] == NODE_RICE)
                 {
-                    temp.push_back(0);
+                    out.put(rice_k[node], 6);
                 }
-
-                counter = 0;
+                out.put(bit, 1);
             }
         }
-        if (j == B.size() - 1)
+        switch (coding[node])
         {
-            for (size_t i = 0; i < RUN_LENGTH; i++)
+        case NODE_RLE8:
+            // runs longer than RUN_LENGTH_MAX are split by empty runs of
+            // the other bit; one of exactly RUN_LENGTH_MAX is not, so a node
+            // never ends in an empty run
+            for (; run > RUN_LENGTH_MAX; run -= RUN_LENGTH_MAX)
             {
-                bool temp_bit = (counter >> (RUN_LENGTH - i - 1)) & 1;
-                temp.push_back(temp_bit);
+                out.put(RUN_LENGTH_MAX, RUN_LENGTH);
+                out.put(0, RUN_LENGTH);
             }
+            out.put(run, RUN_LENGTH);
+            break;
+        case NODE_GAMMA:
+            out.put_gamma(run);
+            break;
+        case NODE_DELTA:
+            out.put_delta(run);
+            break;
+        case NODE_RICE:
+            out.put_rice(run - 1, rice_k[node]);
+            break;
+        default:
+            break;
+        }
+    });
+    out.finish();
+    return out;
+}
+
+void compress_gamma(WaveletTree &wt)
+{
+    wt.coding = LEVELS_GAMMA;
+    wt.encoded.resize(wt.depth());
+    for (size_t i = 0; i < wt.depth(); i++)
+    {
+        if (wt.level[i].size() != 0)
+        {
+            wt.encoded[i] = compress_bitset_gamma(wt.level[i], move(wt.encoded[i]));
+        }
+        else
+        {
+            wt.encoded[i].clear();
         }
-        last = bit;
     }
+}
 
-    B.resize(0);
-    for (size_t i = 0; i < temp.size(); i++)
+void compress_rans(WaveletTree &wt)
+{
+    wt.coding = LEVELS_RANS;
+    wt.encoded.resize(wt.depth());
+    vector<uint8_t> symbols = symbols_by_code(wt);
+    for (size_t i = 0; i < wt.depth(); i++)
     {
-        B.push_back(temp[i]);
+        if (wt.level[i].size() != 0)
+        {
+            wt.encoded[i] = compress_bitset_rans(wt.level[i], node_sizes(wt, symbols, i), move(wt.encoded[i]));
+        }
+        else
+        {
+            wt.encoded[i].clear();
+        }
     }
 }
 
-void compress_bitset_gamma(boost::dynamic_bitset<> &B)
+void compress_adaptive(WaveletTree &wt)
 {
-    size_t counter = 0;
-    boost::dynamic_bitset<> temp;
-    temp.push_back(B[0]);
+    wt.coding = LEVELS_ADAPTIVE;
+    wt.encoded.resize(wt.depth());
+    vector<uint8_t> symbols = symbols_by_code(wt);
+    for (size_t i = 0; i < wt.depth(); i++)
+    {
+        if (wt.level[i].size() != 0)
+        {
+            wt.encoded[i] = compress_bitset_adaptive(wt.level[i], node_sizes(wt, symbols, i), move(wt.encoded[i]));
+        }
+        else
+        {
+            wt.encoded[i].clear();
+        }
+    }
+}
 
-    auto last = B[0];
+// layout: u8 shape | coding << 4 | 256-bit alphabet bitmap | varint
+// count per present symbol | varint bit_num per level | the levels' bytes,
+// back to back. the codes are rebuilt from the shape and the counts, and
+// the bit_num directory locates every level without decoding the ones
+// before it.
+void write_wt(const WaveletTree &wt, string &out)
+{
+    out.push_back((char)(wt.shape | wt.coding << 4));
+    BitWriter alphabet;
+    for (size_t c = 0; c < 256; c++)
+    {
+        alphabet.put(wt.count[c] != 0, 1);
+    }
+    alphabet.finish();
+    out.append((const char *)alphabet.bytes.data(), alphabet.bytes.size());
+    for (size_t c = 0; c < 256; c++)
+    {
+        if (wt.count[c] != 0)
+        {
+            put_varint(out, wt.count[c]);
+        }
+    }
+    for (size_t i = 0; i < wt.depth(); i++)
+    {
+        put_varint(out, wt.encoded[i].size());
+    }
+    for (size_t i = 0; i < wt.depth(); i++)
+    {
+        out.append((const char *)wt.encoded[i].bytes.data(), wt.encoded[i].bytes.size());
+    }
+}
 
-    for (size_t j = 0; j < B.size(); j++)
+// inverse of compress_bitset_gamma over the bit_num bits at `in`; `len` is
+// the length of the original bitvector. runs are decoded through a 64-bit
+// window and written with one ranged set each.
+BitVector decompress_bitset_gamma(const uint8_t *in, size_t bit_num, size_t len)
+{
+    BitReader reader(in, bit_num);
+    uint64_t bit;
+    if (!reader.get(1, bit))
+    {
+        throw runtime_error("corrupt gamma run");
+    }
+    BitVector B(len);
+    size_t filled = 0;
+    while (filled < len)
     {
-        auto bit = B[j];
-        if (bit != last)
+        uint64_t counter;
+        if (!reader.get_gamma(counter) || counter > len - filled)
         {
-            size_t l = log2(counter);
-            for (size_t i = 0; i < l; i++)
-            {
-                temp.push_back(0);
-            }
+            throw runtime_error("corrupt gamma run");
+        }
+        if (bit)
+        {
+            B.set_range(filled, counter);
+        }
+        filled += counter;
+        bit = !bit;
+    }
+    return B;
+}
 
-            for (size_t i = 0; i < l + 1; i++)
+// inverse of compress_bitset_rans over the `in_len` bytes at `in`, for a
+// level of nodes with the given sizes
+BitVector decompress_bitset_rans(const uint8_t *in, size_t in_len, const vector<size_t> &nodes)
+{
+    ByteReader reader(in, in + in_len);
+    vector<size_t> runs(nodes.size());
+    vector<bool> first(nodes.size());
+    size_t total = 0, len = 0;
+    for (size_t k = 0; k < nodes.size(); k++)
+    {
+        uint64_t v = reader.varint();
+        runs[k] = v >> 1;
+        first[k] = v & 1;
+        if (runs[k] == 0 || runs[k] > nodes[k])
+        {
+            throw runtime_error("corrupt rANS level");
+        }
+        total += runs[k];
+        len += nodes[k];
+    }
+    // a node's runs alternate from its first bit, so it has runs of the
+    // other bit, and a model for them, only when it has more than one
+    vector<RansModel> models(2 * nodes.size());
+    for (size_t k = 0; k < nodes.size(); k++)
+    {
+        for (size_t bit = 0; bit < 2; bit++)
+        {
+            if (bit == first[k] || runs[k] > 1)
             {
-                bool temp_bit = (counter >> (l - i)) & 1;
-                temp.push_back(temp_bit);
+                models[2 * k + bit].read(reader);
             }
-
-            counter = 1;
         }
-        else if (bit == last)
+    }
+    size_t raw_len = reader.varint();
+    const uint8_t *raw = reader.take(raw_len);
+    size_t raw_pos = 0;
+    RansDecoder rans(reader.p, reader.left());
+
+    // chunk by chunk: the contexts of a chunk's runs follow from the run
+    // counts alone, so its classes are decoded in one go, then turned into
+    // runs with their extra bits
+    BitVector B(len);
+    vector<uint32_t> ctx(min(total, RANS_CHUNK));
+    vector<uint8_t> classes(ctx.size());
+    size_t ctx_node = 0, ctx_run = 0;
+    bool ctx_bit = first[0];
+    size_t node = 0, run_index = 0, pos = 0, node_end = nodes[0];
+    bool bit = first[0];
+    uint64_t acc = 0;
+    for (size_t done = 0; done < total;)
+    {
+        size_t chunk = min(total - done, RANS_CHUNK);
+        for (size_t k = 0; k < chunk; k++)
         {
-            counter++;
+            ctx[k] = 2 * ctx_node + ctx_bit;
+            ctx_bit = !ctx_bit;
+            if (++ctx_run == runs[ctx_node] && ctx_node + 1 < nodes.size())
+            {
+                ctx_run = 0;
+                ctx_node++;
+                ctx_bit = first[ctx_node];
+            }
         }
-
-        if (j == B.size() - 1)
+        rans.decode_chunk(models.data(), ctx.data(), classes.data(), chunk);
+        for (size_t k = 0; k < chunk; k++)
         {
-            size_t l = log2(counter);
-            for (size_t i = 0; i < l; i++)
+            // the extra bits are read past the end as zeros and checked
+            // once at the end
+            size_t cls = classes[k];
+            size_t run = 1ull << cls | (peek_bits(raw, raw_len, raw_pos) >> 1 >> (63 - cls));
+            raw_pos += cls;
+            if (cls > 57 || run > node_end - pos)
             {
-                temp.push_back(0);
+                throw runtime_error("corrupt rANS level");
             }
-
-            for (size_t i = 0; i < l + 1; i++)
+            // the current word is built in acc, so a run costs no memory
+            // round trip until it completes the word
+            uint64_t ones = 0ull - bit;
+            if (pos % 64 + run < 64)
+            {
+                acc |= ones >> (64 - run) << (pos % 64);
+            }
+            else
+            {
+                B.words[pos / 64] = acc | ones << (pos % 64);
+                fill(B.words.begin() + pos / 64 + 1, B.words.begin() + (pos + run) / 64, ones);
+                acc = (pos + run) % 64 ? ones >> (64 - (pos + run) % 64) : 0;
+            }
+            pos += run;
+            bit = !bit;
+            if (++run_index == runs[node])
             {
-                bool temp_bit = (counter >> (l - i)) & 1;
-                temp.push_back(temp_bit);
+                if (pos != node_end)
+                {
+                    throw runtime_error("corrupt rANS level");
+                }
+                if (node + 1 < nodes.size())
+                {
+                    run_index = 0;
+                    node++;
+                    node_end += nodes[node];
+                    bit = first[node];
+                }
             }
         }
-
-        last = bit;
+        done += chunk;
+    }
+    if (raw_pos > 8 * raw_len)
+    {
+        throw runtime_error("corrupt rANS level");
+    }
+    if (pos % 64 != 0)
+    {
+        B.words[pos / 64] = acc;
     }
+    rans.finish();
+    return B;
+}
 
-    B.resize(0);
-    for (size_t i = 0; i < temp.size(); i++)
+// the runs of a node of size `size` at `start` of B, read by get_run(run)
+// from the node's first bit on
+template <class F>
+void decode_node_runs(BitReader &reader, BitVector &B, size_t start, size_t size, F get_run)
+{
+    uint64_t bit, run;
+    if (!reader.get(1, bit))
+    {
+        throw runtime_error("corrupt adaptive level");
+    }
+    for (size_t pos = start, end = start + size; pos < end; pos += run, bit = !bit)
     {
-        B.push_back(temp[i]);
+        if (!get_run(run) || run > end - pos)
+        {
+            throw runtime_error("corrupt adaptive level");
+        }
+        if (bit)
+        {
+            B.set_range(pos, run);
+        }
     }
 }
 
-void compress(vector<boost::dynamic_bitset<>> &wt)
+// inverse of compress_bitset_adaptive over the bit_num bits at `in`, for a
+// level of nodes with the given sizes
+BitVector decompress_bitset_adaptive(const uint8_t *in, size_t bit_num, const vector<size_t> &nodes)
 {
-    for (size_t i = 0; i <= lastnode; i++)
+    BitReader reader(in, bit_num);
+    BitVector B(accumulate(nodes.begin(), nodes.end(), (size_t)0));
+    for (size_t k = 0, start = 0; k < nodes.size(); start += nodes[k++])
     {
-        if (wt[i].size() != 0)
+        size_t size = nodes[k];
+        uint64_t tag, rice_k, ones;
+        if (!reader.get(NODE_TAG_BITS, tag))
+        {
+            throw runtime_error("corrupt adaptive level");
+        }
+        switch (tag)
+        {
+        case NODE_RAW:
+            for (size_t pos = 0; pos < size; pos += 56)
+            {
+                size_t width = min<size_t>(56, size - pos);
+                uint64_t v;
+                if (!reader.get(width, v))
+                {
+                    throw runtime_error("corrupt adaptive level");
+                }
+                B.or_bits(start + pos, reverse_bits(v) >> (64 - width), width);
+            }
+            break;
+        case NODE_RLE8:
+            // a run of 0 follows every split one
+            decode_node_runs(reader, B, start, size, [&](uint64_t &run) { return reader.get(RUN_LENGTH, run); });
+            break;
+        case NODE_GAMMA:
+            decode_node_runs(reader, B, start, size, [&](uint64_t &run) { return reader.get_gamma(run); });
+            break;
+        case NODE_DELTA:
+            decode_node_runs(reader, B, start, size, [&](uint64_t &run) { return reader.get_delta(run); });
+            break;
+        case NODE_RICE:
+            if (!reader.get(6, rice_k) || rice_k > 57)
+            {
+                throw runtime_error("corrupt adaptive level");
+            }
+            decode_node_runs(reader, B, start, size, [&](uint64_t &run)
+            {
+                bool ok = reader.get_rice(rice_k, run);
+                run++;
+                return ok;
+            });
+            break;
+        case NODE_EF:
         {
-            compress_bitset(wt[i]);
+            if (!reader.get_gamma(ones) || --ones > size)
+            {
+                throw runtime_error("corrupt adaptive level");
+            }
+            size_t low = ef_low_bits(size, ones);
+            if (ones * low > bit_num - reader.pos)
+            {
+                throw runtime_error("corrupt adaptive level");
+            }
+            BitReader lows = reader;
+            reader.pos += ones * low;
+            uint64_t high = 0;
+            for (size_t i = 0; i < ones; i++)
+            {
+                uint64_t gap, x;
+                if (!reader.get_rice(0, gap) || !lows.get(low, x) || (high += gap) > (size - 1) >> low)
+                {
+                    throw runtime_error("corrupt adaptive level");
+                }
+                x |= high << low;
+                if (x >= size)
+                {
+                    throw runtime_error("corrupt adaptive level");
+                }
+                B.or_bits(start + x, 1, 1);
+            }
+            break;
+        }
+        default:
+            throw runtime_error("corrupt adaptive level");
         }
     }
+    return B;
 }
 
-void compress_gamma(vector<boost::dynamic_bitset<>> &wt)
+// throws unless every node of level `depth` has as many 1s as its right
+// child has symbols; wt_sequence relies on it to stay inside the nodes
+void check_level_counts(const WaveletTree &wt, const vector<uint8_t> &symbols, size_t depth)
 {
-    for (size_t i = 0; i <= lastnode; i++)
+    const BitVector &B = wt.level[depth];
+    size_t pos = 0;
+    for (size_t k = 0; k < symbols.size();)
     {
-        if (wt[i].size() != 0)
+        uint8_t c = symbols[k];
+        if (wt.len[c] <= depth)
+        {
+            k++;
+            continue;
+        }
+        uint64_t node = code_prefix(wt, c, depth);
+        size_t size = 0, ones = 0;
+        for (; k < symbols.size(); k++)
         {
-            compress_bitset_gamma(wt[i]);
+            uint8_t d = symbols[k];
+            if (wt.len[d] <= depth)
+            {
+                continue;
+            }
+            if (code_prefix(wt, d, depth) != node)
+            {
+                break;
+            }
+            size += wt.count[d];
+            ones += (code_prefix(wt, d, depth + 1) & 1) ? wt.count[d] : 0;
         }
+        if (B.count_range(pos, size) != ones)
+        {
+            throw runtime_error("corrupt wavelet tree");
+        }
+        pos += size;
     }
 }
 
-void write_bitset(boost::dynamic_bitset<> B, ofstream &out)
+// parses the shape and the counts of a write_wt tree over `len` symbols and
+// rebuilds its codes. returns the bit_num directory.
+vector<size_t> read_wt_header(WaveletTree &wt, ByteReader &in, size_t len)
 {
-    uint8_t bits = 0;
-    for (size_t i = 0, j = 0; i < B.size(); i++)
+    uint8_t shape = in.u8();
+    if ((shape & 15) > WT_HUFFMAN || shape >> 4 > LEVELS_ADAPTIVE)
+    {
+        throw runtime_error("unknown wavelet tree shape");
+    }
+    wt.shape = (WaveletShape)(shape & 15);
+    wt.coding = (LevelCoding)(shape >> 4);
+    const uint8_t *alphabet = in.take(32);
+    size_t total = 0;
+    for (size_t c = 0; c < 256; c++)
     {
-        bool temp = B[i];
-        bits = bits << 1;
-        bits = bits | temp;
-        j++;
-        if (j == 8)
+        wt.count[c] = 0;
+        if ((alphabet[c / 8] >> (7 - c % 8)) & 1)
         {
-            out << bits;
-            bits = 0;
-            j = 0;
+            wt.count[c] = in.varint();
+            total += wt.count[c];
         }
     }
+    if (total != len)
+    {
+        throw runtime_error("corrupt wavelet tree");
+    }
+    assign_codes(wt);
+
+    size_t depth = 0;
+    for (size_t c = 0; c < 256; c++)
+    {
+        depth = max<size_t>(depth, wt.len[c]);
+    }
+    vector<size_t> bit_num(depth);
+    for (size_t l = 0; l < depth; l++)
+    {
+        bit_num[l] = in.varint();
+    }
+    return bit_num;
 }
 
-void write_wt(vector<boost::dynamic_bitset<>> &wt, const char *output_name)
+// inverse of compress_gamma, compress_rans or compress_adaptive + write_wt
+// for a tree over `len` symbols
+void read_wt(WaveletTree &wt, ByteReader &in, size_t len)
 {
+    vector<size_t> bit_num = read_wt_header(wt, in, len);
+    size_t depth = bit_num.size();
+    vector<uint8_t> symbols = symbols_by_code(wt);
+    wt.level.assign(depth, BitVector());
+    for (size_t l = 0; l < depth; l++)
+    {
+        if (bit_num[l] > 8 * in.left())
+        {
+            throw runtime_error("truncated wavelet tree");
+        }
+        const uint8_t *level = in.take((bit_num[l] + 7) / 8);
+        if (wt.coding == LEVELS_RANS)
+        {
+            wt.level[l] = decompress_bitset_rans(level, bit_num[l] / 8, node_sizes(wt, symbols, l));
+        }
+        else if (wt.coding == LEVELS_ADAPTIVE)
+        {
+            wt.level[l] = decompress_bitset_adaptive(level, bit_num[l], node_sizes(wt, symbols, l));
+        }
+        else
+        {
+            wt.level[l] = decompress_bitset_gamma(level, bit_num[l], level_size(wt, l));
+        }
+        check_level_counts(wt, symbols, l);
+    }
+}
 
-    ofstream out(output_name, ofstream::app | ofstream::out | ofstream::binary);
+// steps `in` over a write_wt tree of `len` symbols without decoding its
+// levels
+void skip_wt(ByteReader &in, size_t len)
+{
+    WaveletTree wt;
+    for (size_t bits : read_wt_header(wt, in, len))
+    {
+        in.take((bits + 7) / 8);
+    }
+}
 
-    write_bitset(wt[0], out);
+// rebuilds the sequence the tree was built from, level by level from the
+// deepest: every node of a level is the merge of its two children, which are
+// either constant leaves or nodes of the level below. out and scratch hold
+// the two levels in flight and need room for all symbols.
+void wt_sequence(const WaveletTree &wt, uint8_t *out, uint8_t *scratch)
+{
+    vector<uint8_t> symbols = symbols_by_code(wt);
+    if (wt.depth() == 0)
+    {
+        if (!symbols.empty())
+        {
+            fill(out, out + wt.count[symbols[0]], symbols[0]);
+        }
+        return;
+    }
 
-    for (size_t i = 0; i <= lastnode; i++)
+    // the level being written alternates so that level 0 lands in `out`
+    uint8_t *cur = wt.depth() % 2 == 1 ? out : scratch;
+    uint8_t *below = wt.depth() % 2 == 1 ? scratch : out;
+    for (size_t l = wt.depth(); l-- > 0;)
     {
-        if (wt[i].size() != 0)
+        uint8_t node_of[256];
+        size_t start[256];
+        node_starts(wt, symbols, l + 1, node_of, start);
+        const uint64_t *words = wt.level[l].words.data();
+        size_t j = 0;
+        for (size_t k = 0; k < symbols.size();)
         {
-            size_t bit_num = wt[i].size();
-            out << bit_num;
-            write_bitset(wt[i], out);
+            uint8_t c = symbols[k];
+            if (wt.len[c] <= l)
+            {
+                k++;
+                continue;
+            }
+            // one node: its children are read through src, advancing by
+            // stride 1 for an inner node and 0 for a leaf
+            uint64_t node = code_prefix(wt, c, l);
+            const uint8_t *src[2] = {nullptr, nullptr};
+            size_t stride[2] = {1, 1};
+            uint8_t leaf[2];
+            size_t size = 0;
+            for (; k < symbols.size(); k++)
+            {
+                uint8_t d = symbols[k];
+                if (wt.len[d] <= l)
+                {
+                    continue;
+                }
+                if (code_prefix(wt, d, l) != node)
+                {
+                    break;
+                }
+                size_t b = code_prefix(wt, d, l + 1) & 1;
+                if (wt.len[d] == l + 1)
+                {
+                    leaf[b] = d;
+                    src[b] = &leaf[b];
+                    stride[b] = 0;
+                }
+                else if (src[b] == nullptr)
+                {
+                    src[b] = below + start[node_of[d]];
+                }
+                size += wt.count[d];
+            }
+            for (size_t end = j + size; j < end; j++)
+            {
+                size_t b = (words[j / 64] >> (j % 64)) & 1;
+                cur[j] = *src[b];
+                src[b] += stride[b];
+            }
         }
+        swap(cur, below);
     }
 }
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bitio.cpp"
+
+using namespace std;
+
+// interleaved rANS over small alphabets (at most 64 symbols) with static,
+// per-context models. the states are 32 bits, renormalised 16 bits at a
+// time, and symbol k of a chunk belongs to lane k % RANS_LANES: the lanes
+// are independent dependency chains, which the scalar decoder overlaps.
+// (stepping all 8 in one vector register instead, with gathers for the
+// slot entries, makes a single chain whose latency is longer than the
+// scalar steps take, so there is no SIMD decoder.)
+//
+// stream layout, one chunk of up to RANS_CHUNK symbols after the other:
+//   u32 state per lane | u16 words, in the order the decoder reads them
+// every chunk starts from fresh states, so the encoder only ever buffers
+// one chunk, and the decoder checks that each one ends where it started.
+const size_t RANS_LANES = 8;
+const uint32_t RANS_PROB_BITS = 12;
+const uint32_t RANS_PROB_SCALE = 1u << RANS_PROB_BITS;
+const uint32_t RANS_LOW = 1u << 16;
+const size_t RANS_CHUNK = size_t(1) << 16;
+const size_t RANS_SYMBOLS = 64;
+
+// a static model: symbol s < symbols takes freq[s] of the RANS_PROB_SCALE
+// slots, starting at start[s]. the tables are inline, so a context is one
+// address away, and its slot table is a byte per slot
+struct RansModel
+{
+    size_t symbols = 0;
+    uint16_t freq[RANS_SYMBOLS], start[RANS_SYMBOLS];
+    uint8_t slots[RANS_PROB_SCALE]; // the symbol of every slot, for decoding
+    // ceil(2^45 / freq[s]), for encoding: floor(x * rcp >> 45) is x /
+    // freq[s] for every 32-bit state x, as freq[s] < 2^13
+    uint64_t rcp[RANS_SYMBOLS];
+
+    // frequencies proportional to counts, with every counted symbol kept
+    // at one slot at least; the rounding error goes to the largest ones
+    void normalize(const uint64_t *counts)
+    {
+        uint64_t total = 0;
+        symbols = 0;
+        for (size_t s = 0; s < RANS_SYMBOLS; s++)
+        {
+            total += counts[s];
+            symbols = counts[s] ? s + 1 : symbols;
+        }
+        int64_t left = RANS_PROB_SCALE;
+        for (size_t s = 0; s < symbols; s++)
+        {
+            freq[s] = counts[s] == 0 ? 0 : max<uint64_t>(1, (unsigned __int128)counts[s] * RANS_PROB_SCALE / total);
+            left -= freq[s];
+        }
+        while (left != 0)
+        {
+            size_t top = max_element(freq, freq + symbols) - freq;
+            int64_t step = left > 0 ? left : -min<int64_t>(-left, freq[top] - 1);
+            freq[top] += step;
+            left -= step;
+        }
+        set_starts();
+        for (size_t s = 0; s < symbols; s++)
+        {
+            rcp[s] = freq[s] == 0 ? 0 : ((uint64_t(1) << 45) + freq[s] - 1) / freq[s];
+        }
+    }
+
+    // varint symbols | varint freq per symbol
+    void write(string &out) const
+    {
+        put_varint(out, symbols);
+        for (size_t s = 0; s < symbols; s++)
+        {
+            put_varint(out, freq[s]);
+        }
+    }
+
+    void read(ByteReader &in)
+    {
+        symbols = in.varint();
+        if (symbols == 0 || symbols > RANS_SYMBOLS)
+        {
+            throw runtime_error("corrupt rANS model");
+        }
+        uint64_t total = 0;
+        for (size_t s = 0; s < symbols; s++)
+        {
+            uint64_t v = in.varint();
+            if (v > RANS_PROB_SCALE)
+            {
+                throw runtime_error("corrupt rANS model");
+            }
+            freq[s] = v;
+            total += v;
+        }
+        if (total != RANS_PROB_SCALE)
+        {
+            throw runtime_error("corrupt rANS model");
+        }
+        set_starts();
+        for (size_t s = 0; s < symbols; s++)
+        {
+            fill(slots + start[s], slots + start[s] + freq[s], s);
+        }
+    }
+
+private:
+    void set_starts()
+    {
+        uint32_t sum = 0;
+        for (size_t s = 0; s < symbols; s++)
+        {
+            start[s] = sum;
+            sum += freq[s];
+        }
+    }
+};
+
+// queues the symbols of a chunk with their models and codes them back to
+// front when the chunk is full, so that they decode front to back
+struct RansEncoder
+{
+    string &out;
+    vector<pair<const RansModel *, uint8_t>> queued;
+
+    RansEncoder(string &out) : out(out)
+    {
+        queued.reserve(RANS_CHUNK);
+    }
+
+    void put(const RansModel &model, uint8_t symbol)
+    {
+        queued.emplace_back(&model, symbol);
+        if (queued.size() == RANS_CHUNK)
+        {
+            flush();
+        }
+    }
+
+    // codes the queued symbols as one chunk
+    void flush()
+    {
+        if (queued.empty())
+        {
+            return;
+        }
+        uint32_t x[RANS_LANES];
+        fill(x, x + RANS_LANES, RANS_LOW);
+        // a symbol emits at most one word; it is stored either way and
+        // kept only when due, which beats a branch on a coin flip
+        vector<uint16_t> words(queued.size());
+        size_t emitted = 0;
+        for (size_t k = queued.size(); k-- > 0;)
+        {
+            uint32_t &state = x[k % RANS_LANES];
+            const RansModel &model = *queued[k].first;
+            uint8_t symbol = queued[k].second;
+            uint32_t f = model.freq[symbol];
+            bool renorm = state >= (uint64_t)f << (32 - RANS_PROB_BITS);
+            words[emitted] = state;
+            emitted += renorm;
+            state >>= 16 * renorm;
+            uint32_t q = (unsigned __int128)state * model.rcp[symbol] >> 45;
+            state += (q << RANS_PROB_BITS) - q * f + model.start[symbol];
+        }
+        for (uint32_t state : x)
+        {
+            for (size_t b = 0; b < 4; b++)
+            {
+                out.push_back((char)(state >> (8 * b)));
+            }
+        }
+        for (size_t k = emitted; k-- > 0;)
+        {
+            out.push_back((char)words[k]);
+            out.push_back((char)(words[k] >> 8));
+        }
+        queued.clear();
+    }
+};
+
+// decodes a RansEncoder stream at in[0, in_len) a chunk at a time. a
+// chunk is decoded lane-group by lane-group with the states in locals,
+// and refills are branchless, as whether a lane needs one is as good as
+// random
+struct RansDecoder
+{
+    const uint8_t *in, *end;
+
+    RansDecoder(const uint8_t *in, size_t in_len) : in(in), end(in + in_len) {}
+
+    // the len <= RANS_CHUNK symbols of the next chunk into out; symbol k
+    // is decoded with models[ctx[k]]
+    void decode_chunk(const RansModel *models, const uint32_t *ctx, uint8_t *out, size_t len)
+    {
+        if ((size_t)(end - in) < 4 * RANS_LANES)
+        {
+            throw runtime_error("truncated rANS stream");
+        }
+        const uint8_t *p = in, *stop = end;
+        uint32_t x[RANS_LANES];
+        for (uint32_t &state : x)
+        {
+            state = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+            p += 4;
+        }
+        // a lane group takes at most 2 * RANS_LANES bytes, so the refills
+        // need no bounds checks until the last groups
+        bool truncated = false;
+        auto step = [&]<bool checked>(uint32_t &state, size_t k)
+        {
+            const RansModel &model = models[ctx[k]];
+            uint32_t slot = state & (RANS_PROB_SCALE - 1);
+            uint8_t symbol = model.slots[slot];
+            state = model.freq[symbol] * (state >> RANS_PROB_BITS) + slot - model.start[symbol];
+            bool refill = state < RANS_LOW;
+            uint32_t word;
+            if constexpr (checked)
+            {
+                word = stop - p >= 2 ? p[0] | p[1] << 8 : 0;
+                truncated |= refill & (stop - p < 2);
+            }
+            else
+            {
+                word = p[0] | p[1] << 8;
+            }
+            state = state << (16 * refill) | (word & (0u - refill));
+            p += 2 * refill;
+            out[k] = symbol;
+        };
+        size_t k = 0;
+        for (; k + RANS_LANES <= len && stop - p >= 2 * (ptrdiff_t)RANS_LANES; k += RANS_LANES)
+        {
+#pragma GCC unroll 8
+            for (size_t lane = 0; lane < RANS_LANES; lane++)
+            {
+                step.template operator()<false>(x[lane], k + lane);
+            }
+        }
+        for (size_t lane = 0; k < len; k++, lane = (lane + 1) % RANS_LANES)
+        {
+            step.template operator()<true>(x[lane], k);
+        }
+        for (uint32_t state : x)
+        {
+            truncated |= state != RANS_LOW;
+        }
+        if (truncated)
+        {
+            throw runtime_error("corrupt rANS stream");
+        }
+        in = p;
+    }
+
+    // checks that the stream was used up
+    void finish() const
+    {
+        if (in != end)
+        {
+            throw runtime_error("corrupt rANS stream");
+        }
+    }
+};
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define TLZ_X86 1
+#endif
+
+using namespace std;
+
+// the bit-scan kernels behind BitVector and the wavelet tree builder, in a
+// scalar, an AVX2 and an AVX-512 flavour. kernels() picks the widest one the
+// CPU supports, once, unless TLZ_KERNELS names a narrower one. the vector
+// flavours exist on x86 only; elsewhere the scalar one is all there is.
+struct BitKernels
+{
+    const char *name;
+
+    // set bits in words[0, n)
+    size_t (*popcount)(const uint64_t *words, size_t n);
+
+    // the first i in [from, n) with words[i] != v, or n
+    size_t (*find_word_not)(const uint64_t *words, size_t from, size_t n, uint64_t v);
+
+    // bit i of out is bit src[i] of the 256-bit table (LSB-first bytes);
+    // out gets (n + 63) / 64 words, the last one zero padded
+    void (*level_bits)(const uint8_t *src, size_t n, const uint8_t table[32], uint64_t *out);
+
+    // stable split of src[0, n) by bits [pos, pos + n) of `bits`: a byte
+    // with bit b goes to *dst[b], which advances when keep[b]. a side that is
+    // not kept must point at 8 writable bytes.
+    void (*split)(const uint8_t *src, size_t n, const uint64_t *bits, size_t pos, uint8_t *dst[2], const bool keep[2]);
+};
+
+// bits [pos, pos + 64) of a bit array that holds all of them
+inline uint64_t word_at(const uint64_t *bits, size_t pos)
+{
+    uint64_t v = bits[pos / 64] >> (pos % 64);
+    if (pos % 64 != 0)
+    {
+        v |= bits[pos / 64 + 1] << (64 - pos % 64);
+    }
+    return v;
+}
+
+size_t scalar_popcount(const uint64_t *words, size_t n)
+{
+    size_t ones = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        ones += __builtin_popcountll(words[i]);
+    }
+    return ones;
+}
+
+size_t scalar_find_word_not(const uint64_t *words, size_t from, size_t n, uint64_t v)
+{
+    while (from < n && words[from] == v)
+    {
+        from++;
+    }
+    return from;
+}
+
+void scalar_level_bits(const uint8_t *src, size_t n, const uint8_t table[32], uint64_t *out)
+{
+    uint64_t bit_of[256];
+    for (size_t c = 0; c < 256; c++)
+    {
+        bit_of[c] = (table[c / 8] >> (c % 8)) & 1;
+    }
+    for (size_t w = 0; w < (n + 63) / 64; w++)
+    {
+        uint64_t word = 0;
+        for (size_t i = 64 * w, end = min(n, i + 64); i < end; i++)
+        {
+            word |= bit_of[src[i]] << (i % 64);
+        }
+        out[w] = word;
+    }
+}
+
+void scalar_split(const uint8_t *src, size_t n, const uint64_t *bits, size_t pos, uint8_t *dst[2], const bool keep[2])
+{
+    size_t step[2] = {keep[0], keep[1]};
+    uint8_t *out[2] = {dst[0], dst[1]};
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+    {
+        uint64_t mask = word_at(bits, pos + i);
+        for (size_t j = 0; j < 64; j++, mask >>= 1)
+        {
+            size_t b = mask & 1;
+            *out[b] = src[i + j];
+            out[b] += step[b];
+        }
+    }
+    for (; i < n; i++)
+    {
+        size_t b = (bits[(pos + i) / 64] >> ((pos + i) % 64)) & 1;
+        *out[b] = src[i];
+        out[b] += step[b];
+    }
+    dst[0] = out[0];
+    dst[1] = out[1];
+}
+
+#ifdef TLZ_X86
+__attribute__((target("popcnt,avx2"))) size_t avx2_popcount(const uint64_t *words, size_t n)
+{
+    // nibble lookup with pshufb, summed per 64-bit lane by psadbw
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+        __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    size_t ones = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++)
+    {
+        ones += _mm_popcnt_u64(words[i]);
+    }
+    return ones;
+}
+
+__attribute__((target("avx2"))) size_t avx2_find_word_not(const uint64_t *words, size_t from, size_t n, uint64_t v)
+{
+    const __m256i value = _mm256_set1_epi64x(v);
+    for (; from + 4 <= n; from += 4)
+    {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(words + from)), value);
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(eq);
+        if (mask != 0)
+        {
+            return from + __builtin_ctz(mask) / 8;
+        }
+    }
+    return scalar_find_word_not(words, from, n, v);
+}
+
+// table[c / 8] >> (c % 8) & 1 for 32 bytes: pshufb picks the table byte
+// from each half of the table by c / 8 and the bit by c % 8
+__attribute__((target("avx2"))) inline uint32_t avx2_lookup_bits(__m256i c, __m256i lo_table, __m256i hi_table)
+{
+    const __m256i pow2 = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i index = _mm256_and_si256(_mm256_srli_epi16(c, 3), _mm256_set1_epi8(0x0f));
+    __m256i t = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo_table, index), _mm256_shuffle_epi8(hi_table, index), c);
+    __m256i bit = _mm256_shuffle_epi8(pow2, _mm256_and_si256(c, _mm256_set1_epi8(7)));
+    __m256i zero = _mm256_cmpeq_epi8(_mm256_and_si256(t, bit), _mm256_setzero_si256());
+    return ~(uint32_t)_mm256_movemask_epi8(zero);
+}
+
+__attribute__((target("avx2"))) void avx2_level_bits(const uint8_t *src, size_t n, const uint8_t table[32], uint64_t *out)
+{
+    __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table));
+    __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + 16)));
+    size_t w = 0;
+    for (; 64 * w + 64 <= n; w++)
+    {
+        uint64_t lo = avx2_lookup_bits(_mm256_loadu_si256((const __m256i *)(src + 64 * w)), lo_table, hi_table);
+        uint64_t hi = avx2_lookup_bits(_mm256_loadu_si256((const __m256i *)(src + 64 * w + 32)), lo_table, hi_table);
+        out[w] = lo | hi << 32;
+    }
+    if (64 * w < n)
+    {
+        scalar_level_bits(src + 64 * w, n - 64 * w, table, out + w);
+    }
+}
+
+// 8 bytes at a time: pdep spreads 8 mask bits to byte masks and pext packs
+// the bytes of either side together, then one unaligned store per side. a
+// side stores all 8 bytes only while that much of its region is left, so it
+// never runs into the region that follows.
+__attribute__((target("popcnt,bmi2"))) void bmi2_split(const uint8_t *src, size_t n, const uint64_t *bits, size_t pos, uint8_t *dst[2], const bool keep[2])
+{
+    size_t chunks = n / 64;
+    size_t ones = 0;
+    for (size_t i = 0; i < chunks; i++)
+    {
+        ones += _mm_popcnt_u64(word_at(bits, pos + 64 * i));
+    }
+    for (size_t i = 64 * chunks; i < n; i++)
+    {
+        ones += (bits[(pos + i) / 64] >> ((pos + i) % 64)) & 1;
+    }
+    size_t left[2] = {keep[0] ? n - ones : SIZE_MAX, keep[1] ? ones : SIZE_MAX};
+
+    for (size_t i = 0; i < chunks; i++)
+    {
+        uint64_t mask = word_at(bits, pos + 64 * i);
+        for (size_t j = 0; j < 8; j++, mask >>= 8)
+        {
+            uint64_t x;
+            memcpy(&x, src + 64 * i + 8 * j, 8);
+            uint64_t ones_mask = _pdep_u64(mask, 0x0101010101010101ull) * 0xff;
+            size_t k1 = _mm_popcnt_u64(mask & 0xff);
+            uint64_t zeros = _pext_u64(x, ~ones_mask), ones = _pext_u64(x, ones_mask);
+            memcpy(dst[0], &zeros, left[0] >= 8 ? 8 : 8 - k1);
+            memcpy(dst[1], &ones, left[1] >= 8 ? 8 : k1);
+            if (keep[0])
+            {
+                dst[0] += 8 - k1;
+                left[0] -= 8 - k1;
+            }
+            if (keep[1])
+            {
+                dst[1] += k1;
+                left[1] -= k1;
+            }
+        }
+    }
+    scalar_split(src + 64 * chunks, n - 64 * chunks, bits, pos + 64 * chunks, dst, keep);
+}
+
+__attribute__((target("popcnt,avx512f,avx512bw"))) size_t avx512_popcount(const uint64_t *words, size_t n)
+{
+    const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low = _mm512_set1_epi8(0x0f);
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i v = _mm512_loadu_si512(words + i);
+        __m512i lo = _mm512_shuffle_epi8(lookup, _mm512_and_si512(v, low));
+        __m512i hi = _mm512_shuffle_epi8(lookup, _mm512_and_si512(_mm512_srli_epi16(v, 4), low));
+        total = _mm512_add_epi64(total, _mm512_sad_epu8(_mm512_add_epi8(lo, hi), _mm512_setzero_si512()));
+    }
+    size_t ones = _mm512_reduce_add_epi64(total);
+    for (; i < n; i++)
+    {
+        ones += _mm_popcnt_u64(words[i]);
+    }
+    return ones;
+}
+
+__attribute__((target("avx512f"))) size_t avx512_find_word_not(const uint64_t *words, size_t from, size_t n, uint64_t v)
+{
+    const __m512i value = _mm512_set1_epi64(v);
+    for (; from + 8 <= n; from += 8)
+    {
+        __mmask8 ne = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(words + from), value);
+        if (ne != 0)
+        {
+            return from + __builtin_ctz(ne);
+        }
+    }
+    return scalar_find_word_not(words, from, n, v);
+}
+
+__attribute__((target("avx512f,avx512bw"))) void avx512_level_bits(const uint8_t *src, size_t n, const uint8_t table[32], uint64_t *out)
+{
+    const __m512i lo_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)table));
+    const __m512i hi_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(table + 16)));
+    const __m512i pow2 = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0));
+    size_t w = 0;
+    for (; 64 * w + 64 <= n; w++)
+    {
+        __m512i c = _mm512_loadu_si512(src + 64 * w);
+        __m512i index = _mm512_and_si512(_mm512_srli_epi16(c, 3), _mm512_set1_epi8(0x0f));
+        __mmask64 high = _mm512_movepi8_mask(c);
+        __m512i t = _mm512_mask_blend_epi8(high, _mm512_shuffle_epi8(lo_table, index), _mm512_shuffle_epi8(hi_table, index));
+        __m512i bit = _mm512_shuffle_epi8(pow2, _mm512_and_si512(c, _mm512_set1_epi8(7)));
+        out[w] = _mm512_test_epi8_mask(t, bit);
+    }
+    if (64 * w < n)
+    {
+        scalar_level_bits(src + 64 * w, n - 64 * w, table, out + w);
+    }
+}
+
+#endif
+
+const BitKernels SCALAR_KERNELS = {"scalar", scalar_popcount, scalar_find_word_not, scalar_level_bits, scalar_split};
+#ifdef TLZ_X86
+const BitKernels AVX2_KERNELS = {"avx2", avx2_popcount, avx2_find_word_not, avx2_level_bits, bmi2_split};
+const BitKernels AVX512_KERNELS = {"avx512", avx512_popcount, avx512_find_word_not, avx512_level_bits, bmi2_split};
+// for AVX2 CPUs whose pdep and pext are microcode, slower than the scalar
+// split
+const BitKernels AVX2_SCALAR_SPLIT_KERNELS = {"avx2-nopdep", avx2_popcount, avx2_find_word_not, avx2_level_bits, scalar_split};
+
+// whether pdep and pext take a few cycles, as on every BMI2 CPU but AMD's
+// family 17h and Hygon's 18h (Zen 1 and 2), which run them in microcode
+bool fast_pdep()
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+    {
+        return true;
+    }
+    char vendor[13];
+    memcpy(vendor, &ebx, 4);
+    memcpy(vendor + 4, &edx, 4);
+    memcpy(vendor + 8, &ecx, 4);
+    vendor[12] = 0;
+    if (strcmp(vendor, "AuthenticAMD") != 0 && strcmp(vendor, "HygonGenuine") != 0)
+    {
+        return true;
+    }
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    unsigned family = (eax >> 8) & 0xf;
+    if (family == 0xf)
+    {
+        family += (eax >> 20) & 0xff;
+    }
+    return family != 0x17 && family != 0x18;
+}
+#endif
+
+const BitKernels &kernels()
+{
+    static const BitKernels &best = []() -> const BitKernels &
+    {
+#ifdef TLZ_X86
+        __builtin_cpu_init();
+        const char *force = getenv("TLZ_KERNELS");
+        string limit = force ? force : "avx512";
+        bool bmi2 = __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+        if (limit == "avx512" && bmi2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        {
+            return AVX512_KERNELS;
+        }
+        if ((limit == "avx512" || limit == "avx2") && bmi2 && __builtin_cpu_supports("avx2"))
+        {
+            return fast_pdep() ? AVX2_KERNELS : AVX2_SCALAR_SPLIT_KERNELS;
+        }
+#endif
+        return SCALAR_KERNELS;
+    }();
+    return best;
+}
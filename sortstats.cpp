@@ -0,0 +1,157 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// stats policies for the suffix sorters, which take one as a template
+// parameter and call its hooks at every level and phase. NoStats is the
+// default: its hooks are empty inline functions on empty types, so the
+// sorters compile to the same code as without them. SortStats records
+// what --stats prints.
+struct NoStats
+{
+    static constexpr bool enabled = false;
+
+    struct Timer
+    {
+    };
+
+    Timer time(const char *)
+    {
+        return Timer();
+    }
+    void level_begin(const char *, size_t, size_t) {}
+    void level_reduced(size_t, size_t, bool) {}
+    void level_end() {}
+    void shift(size_t) {}
+};
+
+struct SortStats
+{
+    static constexpr bool enabled = true;
+
+    struct Level
+    {
+        const char *sorter;
+        size_t depth, n, sigma;
+        size_t n1 = 0, max_rank = 0;
+        bool has_ties = false;
+        vector<pair<const char *, double>> phases; // seconds, in first-use order
+        size_t shifts = 0, shifted = 0;            // bucket shifts and elements they moved
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        double seconds = 0; // the whole level, deeper levels included
+    };
+
+    vector<Level> levels;
+    vector<size_t> open; // indices of the levels being sorted, innermost last
+
+    // adds the time until it is destroyed to a phase of the innermost level
+    struct Timer
+    {
+        SortStats *stats;
+        size_t level;
+        const char *phase;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        Timer(SortStats *stats, size_t level, const char *phase) : stats(stats), level(level), phase(phase) {}
+
+        Timer(const Timer &) = delete;
+
+        ~Timer()
+        {
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            auto &phases = stats->levels[level].phases;
+            for (auto &p : phases)
+            {
+                if (strcmp(p.first, phase) == 0)
+                {
+                    p.second += seconds;
+                    return;
+                }
+            }
+            phases.emplace_back(phase, seconds);
+        }
+    };
+
+    Timer time(const char *phase)
+    {
+        return Timer(this, open.back(), phase);
+    }
+
+    void level_begin(const char *sorter, size_t n, size_t sigma)
+    {
+        open.push_back(levels.size());
+        Level &level = levels.emplace_back();
+        level.sorter = sorter;
+        level.depth = open.size() - 1;
+        level.n = n;
+        level.sigma = sigma;
+    }
+
+    void level_reduced(size_t n1, size_t max_rank, bool has_ties)
+    {
+        Level &level = levels[open.back()];
+        level.n1 = n1;
+        level.max_rank = max_rank;
+        level.has_ties = has_ties;
+    }
+
+    void level_end()
+    {
+        Level &level = levels[open.back()];
+        level.seconds = chrono::duration<double>(chrono::steady_clock::now() - level.start).count();
+        open.pop_back();
+    }
+
+    void shift(size_t moved)
+    {
+        Level &level = levels[open.back()];
+        level.shifts++;
+        level.shifted += moved;
+    }
+
+    string json() const
+    {
+        size_t depth = 0, tie_recursions = 0, shifts = 0, shifted = 0;
+        string levels_json;
+        char buf[256];
+        for (const Level &l : levels)
+        {
+            depth = max(depth, l.depth + 1);
+            tie_recursions += l.has_ties;
+            shifts += l.shifts;
+            shifted += l.shifted;
+            snprintf(buf, sizeof(buf),
+                     "%s{\"depth\": %zu, \"sorter\": \"%s\", \"n\": %zu, \"sigma\": %zu, \"n1\": %zu, "
+                     "\"max_rank\": %zu, \"has_ties\": %s, \"bucket_shifts\": %zu, \"shifted_elements\": %zu, "
+                     "\"seconds\": %.6f, \"phases\": {",
+                     levels_json.empty() ? "" : ", ", l.depth, l.sorter, l.n, l.sigma, l.n1, l.max_rank,
+                     l.has_ties ? "true" : "false", l.shifts, l.shifted, l.seconds);
+            levels_json += buf;
+            for (size_t p = 0; p < l.phases.size(); p++)
+            {
+                snprintf(buf, sizeof(buf), "%s\"%s\": %.6f", p ? ", " : "", l.phases[p].first, l.phases[p].second);
+                levels_json += buf;
+            }
+            levels_json += "}}";
+        }
+        snprintf(buf, sizeof(buf),
+                 "{\"recursion_depth\": %zu, \"has_ties_recursions\": %zu, \"bucket_shifts\": %zu, "
+                 "\"shifted_elements\": %zu, \"levels\": [",
+                 depth, tie_recursions, shifts, shifted);
+        return buf + levels_json + "]}";
+    }
+};
+
+// the instance a sorter uses when it is given none
+template <class Stats>
+Stats &default_stats()
+{
+    static Stats stats;
+    return stats;
+}
@@ -21,39 +21,54 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
+#pragma once
+
 #include <algorithm>
 #include <cstddef>
 #include <iostream>
 #include <span>
 #include <tuple>
 #include <cmath>
+#include <cstring>
 #include <random>
 #include <vector>
 #include <limits>
 #include <fstream>
 
+#include "sortstats.cpp"
+
 using namespace std;
 
 using Character = uint32_t;
 
-constexpr std::size_t EMPTY = numeric_limits<std::size_t>::max();
-constexpr std::size_t UNIQUE = numeric_limits<std::size_t>::max() - 1;
-constexpr std::size_t MULTI = numeric_limits<std::size_t>::max() - 2;
-
-template <class T>
+template <class T, class I = std::size_t, class Stats = NoStats>
 class Solver
 {
 public:
+    // markers stored in SA slots while sorting; they sit above any index
+    static constexpr I EMPTY = numeric_limits<I>::max();
+    static constexpr I UNIQUE = numeric_limits<I>::max() - 1;
+    static constexpr I MULTI = numeric_limits<I>::max() - 2;
+
     span<T, dynamic_extent> t;
-    span<std::size_t, dynamic_extent> sa;
+    span<I, dynamic_extent> sa;
     T sigma;
-    std::size_t n;
-    Solver(span<T, dynamic_extent> t, span<std::size_t, dynamic_extent> sa, T sigma) : t(t), sa(sa), sigma(sigma)
+    I n;
+    Stats &stats;
+    Solver(span<T, dynamic_extent> t, span<I, dynamic_extent> sa, T sigma, Stats &stats = default_stats<Stats>())
+        : t(t), sa(sa), sigma(sigma), stats(stats)
     {
         n = t.size();
     }
 
     void solve(bool recursive)
+    {
+        stats.level_begin("solver", n, sigma);
+        solve_level(recursive);
+        stats.level_end();
+    }
+
+    void solve_level(bool recursive)
     {
         // cout << "Renaming..." << endl;
         rename();
@@ -76,30 +91,41 @@ public:
             }
             else
             {
-                std::size_t e = move_sorted_lms_substrs_to_the_end();
+                I e = move_sorted_lms_substrs_to_the_end();
                 auto [max_rank, has_ties] = construct_t1(e);
+                stats.level_reduced(n1, max_rank, has_ties);
                 // cout << "T1 max rank: " << max_rank << "; has ties: " << has_ties << endl;
-                auto t1 = sa.subspan(0, n1);
                 auto sa1 = sa.subspan(n - n1, n1);
-                fill(sa1.begin(), sa1.end(), 0); // prepare for renaming
-                Solver<std::size_t> subproblem = Solver<std::size_t>(t1, sa1, max_rank);
-                subproblem.solve(has_ties);
+                // the reduced string stores its bucket indices, so its
+                // character type only has to hold values below n1
+                if (n1 <= (I)numeric_limits<uint16_t>::max())
+                {
+                    solve_reduced<uint16_t>(n1, max_rank, has_ties);
+                }
+                else if (sizeof(I) > sizeof(uint32_t) && n1 <= (I)numeric_limits<uint32_t>::max())
+                {
+                    solve_reduced<uint32_t>(n1, max_rank, has_ties);
+                }
+                else
+                {
+                    solve_reduced<I>(n1, max_rank, has_ties);
+                }
                 // cout << "Moving T1 result from SA1 to the head" << endl;
-                for (std::size_t i = 0; i < n1; i++)
+                for (I i = 0; i < n1; i++)
                 {
                     sa[i] = sa1[i];
                 }
                 // cout << "Putting all LMS chars (unsorted) to the end..." << endl;
-                auto lms = sa1;         // for readability
-                std::size_t j = n1 - 1; // tail pointer
-                lms[j] = n - 1;         // sentinel
+                auto lms = sa1; // for readability
+                I j = n1 - 1;   // tail pointer
+                lms[j] = n - 1; // sentinel
                 j -= 1;
                 bool ti_is_s = false; // T[n-2] must be L
                 bool tim1_is_s;
                 T ti = t[n - 2];
                 T tim1;
-                std::size_t i = n - 2;
-                for (std::size_t im1 = n - 2; im1-- > 0;)
+                I i = n - 2;
+                for (I im1 = n - 2; im1-- > 0;)
                 {
                     tim1 = t[im1];
                     tim1_is_s = tim1 < ti || (tim1 == ti && ti_is_s);
@@ -117,18 +143,18 @@ public:
                     ti_is_s = tim1_is_s;
                 }
                 // cout << "Sorting LMS substrs in SA[0..n1), using `sa[i = lms[sa[i]]`..." << endl;
-                std::size_t *sa_i;
-                for (std::size_t i = 0; i < n1; i++)
+                I *sa_i;
+                for (I i = 0; i < n1; i++)
                 {
                     sa_i = &sa[i];
                     *sa_i = lms[*sa_i];
                 }
                 fill(lms.begin(), lms.end(), EMPTY);
                 // cout << "Placing sorted LMS substrs back to corresponding buckets..." << endl;
-                std::size_t sa_i_val;
-                std::size_t curr_tail = 0; // dummy
-                std::size_t offset = 0;
-                for (std::size_t i = n1; i-- > 1;)
+                I sa_i_val;
+                I curr_tail = 0; // dummy
+                I offset = 0;
+                for (I i = n1; i-- > 1;)
                 {
                     sa_i = &sa[i];
                     sa_i_val = *sa_i;
@@ -151,8 +177,26 @@ public:
         }
     }
 
+    // packs T1 = SA[0, n1) into the head of SA as U characters and sorts it
+    // into SA1 = SA[n - n1, n). U is never wider than I, so the forward
+    // copy never overwrites an unread element.
+    template <class U>
+    void solve_reduced(I n1, I max_rank, bool has_ties)
+    {
+        U *t1 = reinterpret_cast<U *>(sa.data());
+        for (I i = 0; i < n1; i++)
+        {
+            t1[i] = (U)sa[i];
+        }
+        auto sa1 = sa.subspan(n - n1, n1);
+        fill(sa1.begin(), sa1.end(), 0); // prepare for renaming
+        Solver<U, I, Stats> subproblem(span<U>(t1, n1), sa1, (U)max_rank, stats);
+        subproblem.solve(has_ties);
+    }
+
     void rename()
     {
+        [[maybe_unused]] auto timer = stats.time("rename");
         // idx 0 to sigma inclusive should be filled with 0
         for (auto &c : t)
         {
@@ -160,9 +204,9 @@ public:
         }
 
         // compute head indices
-        std::size_t prev = 1; // or sa[0]; the sentinel always occurs once
-        std::size_t *curr;
-        for (std::size_t i = 1; i < sigma; i++)
+        I prev = 1; // or sa[0]; the sentinel always occurs once
+        I *curr;
+        for (I i = 1; i < sigma; i++)
         {
             curr = &sa[i];
             *curr += prev;
@@ -182,7 +226,7 @@ public:
         }
         // compute all tail indices (inclusive)
         prev = 0; // tail of bucket 0 is always 0 (sentinel)
-        for (std::size_t i = 1; i < n; i++)
+        for (I i = 1; i < n; i++)
         {
             curr = &sa[i];
             *curr += prev;
@@ -192,7 +236,7 @@ public:
         bool tip1_is_s = true; // the last char (sentinel) is always S
         T tip1 = 0;
         T *t_i;
-        for (std::size_t i = n - 1; i-- > 0;)
+        for (I i = n - 1; i-- > 0;)
         {
             t_i = &t[i];
             tip1_is_s = (*t_i < tip1 || (*t_i == tip1 && tip1_is_s));
@@ -207,10 +251,10 @@ public:
         fill(sa.begin(), sa.end(), EMPTY);
     }
 
-    bool place_i_into_sa_ti_right_to_left(std::size_t i, T ti)
+    bool place_i_into_sa_ti_right_to_left(I i, T ti)
     {
         bool shifted = false;
-        std::size_t *sa_ti = &sa[ti];
+        I *sa_ti = &sa[ti];
         switch (*sa_ti)
         {
         case UNIQUE:
@@ -218,12 +262,12 @@ public:
             break;
         case MULTI:
         {
-            std::size_t *counter = &sa[ti - 1];
+            I *counter = &sa[ti - 1];
             if (*counter == EMPTY)
             {
                 if (ti >= 2)
                 {
-                    std::size_t *sa_tim2 = &sa[ti - 2];
+                    I *sa_tim2 = &sa[ti - 2];
                     if (*sa_tim2 == EMPTY)
                     {
                         *sa_tim2 = i;
@@ -238,7 +282,7 @@ public:
             {
                 if (ti >= *counter + 2)
                 {
-                    std::size_t *x = &sa[ti - *counter - 2];
+                    I *x = &sa[ti - *counter - 2];
                     if (*x == EMPTY)
                     {
                         *x = i;
@@ -246,9 +290,10 @@ public:
                         return false;
                     }
                 }
-                std::size_t counter_v = *counter;
-                std::size_t left_bound = ti - counter_v + 1;
-                for (std::size_t j = ti; j >= left_bound; j--)
+                I counter_v = *counter;
+                I left_bound = ti - counter_v + 1;
+                stats.shift(counter_v);
+                for (I j = ti; j >= left_bound; j--)
                 {
                     sa[j] = sa[j - 2];
                 }
@@ -260,7 +305,7 @@ public:
         }
         default:
         {
-            std::size_t j = ti;
+            I j = ti;
             while (sa[j] != EMPTY)
             {
                 j--;
@@ -272,11 +317,11 @@ public:
         return shifted;
     }
 
-    bool place_i_into_sa_ti_left_to_right(std::size_t i, T ti)
+    bool place_i_into_sa_ti_left_to_right(I i, T ti)
     {
         // cout << "Placing " << i << " into " << ti << endl;
         bool shifted = false;
-        std::size_t *sa_ti = &sa[ti];
+        I *sa_ti = &sa[ti];
         switch (*sa_ti)
         {
         case UNIQUE:
@@ -284,13 +329,13 @@ public:
             break;
         case MULTI:
         {
-            std::size_t *counter = &sa[ti + 1];
+            I *counter = &sa[ti + 1];
             if (*counter == EMPTY)
             {
-                std::size_t j = ti + 2;
+                I j = ti + 2;
                 if (j < sa.size())
                 {
-                    std::size_t *sa_tip2 = &sa[j];
+                    I *sa_tip2 = &sa[j];
                     if (*sa_tip2 == EMPTY)
                     {
                         *sa_tip2 = i;
@@ -303,10 +348,10 @@ public:
             }
             else
             {
-                std::size_t j = ti + *counter + 2;
+                I j = ti + *counter + 2;
                 if (j < sa.size())
                 {
-                    std::size_t *x = &sa[j];
+                    I *x = &sa[j];
                     if (*x == EMPTY)
                     {
                         *x = i;
@@ -314,9 +359,10 @@ public:
                         return false;
                     }
                 }
-                std::size_t counter_v = *counter;
-                std::size_t right_bound = ti + counter_v;
-                for (std::size_t j = ti; j < right_bound; j++)
+                I counter_v = *counter;
+                I right_bound = ti + counter_v;
+                stats.shift(counter_v);
+                for (I j = ti; j < right_bound; j++)
                 {
                     sa[j] = sa[j + 2];
                 }
@@ -328,7 +374,7 @@ public:
         }
         default:
         {
-            std::size_t j = ti;
+            I j = ti;
             while (sa[j] != EMPTY)
             {
                 j++;
@@ -340,14 +386,15 @@ public:
         return shifted;
     }
 
-    std::size_t sort_lms_chars()
+    I sort_lms_chars()
     {
+        [[maybe_unused]] auto timer = stats.time("sort_lms_chars");
         bool ti_is_s = false; // T[n-2] must be L
         bool tim1_is_s;
         T ti = t[n - 2];
         T tim1;
-        std::size_t *sa_ti;
-        for (std::size_t im1 = n - 2; im1-- > 0;)
+        I *sa_ti;
+        for (I im1 = n - 2; im1-- > 0;)
         {
             tim1 = t[im1];
             tim1_is_s = tim1 < ti || (tim1 == ti && ti_is_s);
@@ -370,12 +417,12 @@ public:
             ti = tim1;
             ti_is_s = tim1_is_s;
         }
-        sa[0] = n - 1;             // sentinel
-        std::size_t lms_count = 1; // including sentinel
+        sa[0] = n - 1;   // sentinel
+        I lms_count = 1; // including sentinel
         ti_is_s = false;
         ti = t[n - 2];
-        std::size_t i = n - 2;
-        for (std::size_t im1 = n - 2; im1-- > 0;)
+        I i = n - 2;
+        for (I im1 = n - 2; im1-- > 0;)
         {
             tim1 = t[im1];
             tim1_is_s = tim1 < ti || (tim1 == ti && ti_is_s);
@@ -391,15 +438,15 @@ public:
 
         // Remove MULTI and counters
         i = n - 1;
-        std::size_t count;
-        std::size_t left_bound;
+        I count;
+        I left_bound;
         while (i != 0)
         {
             if (sa[i] == MULTI)
             {
                 count = sa[i - 1];
                 left_bound = i - count + 1;
-                for (std::size_t j = i; j >= left_bound; j--)
+                for (I j = i; j >= left_bound; j--)
                 {
                     sa[j] = sa[j - 2];
                 }
@@ -415,13 +462,14 @@ public:
 
     void induced_sort_all()
     {
+        [[maybe_unused]] auto timer = stats.time("induced_sort_all");
         // cout << "Induced sorting..." << endl;
         // cout << "  Initialising SA for sorting L-type..." << endl;
         bool tip1_is_s = true; // the last char (sentinel) is always S
         T tip1 = 0;
         T *t_i;
-        std::size_t *sa_ti;
-        for (std::size_t i = n - 1; i-- > 0;)
+        I *sa_ti;
+        for (I i = n - 1; i-- > 0;)
         {
             t_i = &t[i];
             tip1_is_s = (*t_i < tip1 || (*t_i == tip1 && tip1_is_s));
@@ -441,9 +489,9 @@ public:
             tip1 = *t_i;
         }
         // cout << "  Induced-sorting L-type" << endl;
-        std::size_t i = 0;
-        std::size_t shifted_bucket_head = EMPTY; // dummy value
-        std::size_t sa_i;
+        I i = 0;
+        I shifted_bucket_head = EMPTY; // dummy value
+        I sa_i;
         while (i < n)
         {
             sa_i = sa[i];
@@ -455,7 +503,7 @@ public:
             }
             if (sa_i < UNIQUE && sa_i > 0)
             {
-                std::size_t j = sa_i - 1;
+                I j = sa_i - 1;
                 T tj = t[j];
                 bool suf_j_is_l = tj >= t[sa_i];
                 if (suf_j_is_l)
@@ -473,14 +521,14 @@ public:
             i += 1;
         }
         // cout << "  Removing MULTI and counters..." << endl;
-        std::size_t c;
+        I c;
         i = 1; // do not touch sentinel at idx 0
         while (i < n)
         {
             if (sa[i] == MULTI)
             {
                 c = sa[i + 1];
-                for (std::size_t j = i; j < i + c; j++)
+                for (I j = i; j < i + c; j++)
                 {
                     sa[j] = sa[j + 2];
                 }
@@ -496,7 +544,7 @@ public:
         // cout << "  Initialising SA for sorting S-type..." << endl;
         tip1_is_s = true; // the last char (sentinel) is always S
         tip1 = 0;
-        for (std::size_t i = n - 1; i-- > 0;)
+        for (I i = n - 1; i-- > 0;)
         {
             t_i = &t[i];
             tip1_is_s = (*t_i < tip1 || (*t_i == tip1 && tip1_is_s));
@@ -529,7 +577,7 @@ public:
             }
             if (sa_i < UNIQUE && sa_i > 0)
             {
-                std::size_t j = sa_i - 1;
+                I j = sa_i - 1;
                 T tj = t[j];
                 bool suf_j_is_s = false;
                 if (tj < t[sa_i])
@@ -544,8 +592,8 @@ public:
                     }
                     else
                     {
-                        std::size_t suspected_tail = tj;
-                        std::size_t sa_tj = sa[suspected_tail];
+                        I suspected_tail = tj;
+                        I sa_tj = sa[suspected_tail];
                         suf_j_is_s = sa_tj == MULTI || suspected_tail < t[sa[suspected_tail + 1]];
                     }
                 }
@@ -571,8 +619,8 @@ public:
         bool tim1_is_s;
         T ti = t[n - 2];
         T tim1;
-        std::size_t *sa_ti;
-        for (std::size_t im1 = n - 2; im1-- > 0;)
+        I *sa_ti;
+        for (I im1 = n - 2; im1-- > 0;)
         {
             tim1 = t[im1];
             tim1_is_s = tim1 < ti || (tim1 == ti && ti_is_s);
@@ -598,8 +646,8 @@ public:
             ti_is_s = tim1_is_s;
         }
         // don't touch sentinel
-        std::size_t i = n - 1;
-        std::size_t sa_i;
+        I i = n - 1;
+        I sa_i;
         while (i != 0)
         {
             sa_i = sa[i];
@@ -613,8 +661,8 @@ public:
             }
             case MULTI:
             {
-                std::size_t c = sa[i - 1];
-                for (std::size_t j = i + 1 - c; j <= i; j++)
+                I c = sa[i - 1];
+                for (I j = i + 1 - c; j <= i; j++)
                 {
                     sa[j] = EMPTY;
                 }
@@ -632,10 +680,11 @@ public:
 
     void retain_sorted_lms_substrs()
     {
+        [[maybe_unused]] auto timer = stats.time("retain_sorted_lms_substrs");
         // cout << "retaining sorted LMS substrs" << endl;
-        std::size_t i = n - 1;
-        std::size_t tail;
-        std::size_t sa_i;
+        I i = n - 1;
+        I tail;
+        I sa_i;
         auto is_s_type_bucket_tail = [this, &sa_i]()
         { return (*this).t[sa_i] < (*this).t[sa_i + 1]; };
         while (i > 0)
@@ -680,13 +729,14 @@ public:
         }
     }
 
-    std::size_t move_sorted_lms_substrs_to_the_end()
+    I move_sorted_lms_substrs_to_the_end()
     {
+        [[maybe_unused]] auto timer = stats.time("move_lms");
         // cout << "Moving sorted LMS substrs to the end of SA..." << endl;
-        std::size_t i = n - 1;
-        std::size_t end_pos = n - 1;
-        std::size_t tail;
-        std::size_t sa_i;
+        I i = n - 1;
+        I end_pos = n - 1;
+        I tail;
+        I sa_i;
         auto is_s_type_bucket_tail = [this, &sa_i]()
         { return (*this).t[sa_i] < (*this).t[sa_i + 1]; };
         while (i > 0)
@@ -733,15 +783,16 @@ public:
         return end_pos;
     }
 
-    tuple<std::size_t, bool> construct_t1(std::size_t end_pos)
+    tuple<I, bool> construct_t1(I end_pos)
     {
+        [[maybe_unused]] auto timer = stats.time("construct_t1");
         // cout << "Constructing T1..." << endl;
-        auto length_of_lms_str = [this](std::size_t k)
+        auto length_of_lms_str = [this](I k)
         {
             T prev = this->t[k];
             T curr;
-            std::size_t next_lms_index = 0; // dummy
-            std::size_t i = k + 1;
+            I next_lms_index = 0; // dummy
+            I i = k + 1;
             while (i != this->n)
             {
                 curr = this->t[i];
@@ -759,13 +810,13 @@ public:
             // the case of the last LMS substring
             return this->n - k;
         };
-        std::size_t prev_lms_len = 0; // sentinel actually has len of 1, but it is always smaller than the next LMS
-        std::size_t curr_lms_len;
-        std::size_t prev_lms_idx = 0; // dummy
-        std::size_t curr_lms_idx;
-        std::size_t rank = 0;
+        I prev_lms_len = 0; // sentinel actually has len of 1, but it is always smaller than the next LMS
+        I curr_lms_len;
+        I prev_lms_idx = 0; // dummy
+        I curr_lms_idx;
+        I rank = 0;
         bool has_ties = false;
-        for (std::size_t i = end_pos + 1; i < n; i++)
+        for (I i = end_pos + 1; i < n; i++)
         {
             curr_lms_idx = sa[i];
             curr_lms_len = length_of_lms_str(curr_lms_idx);
@@ -776,7 +827,7 @@ public:
             else
             {
                 bool identical = true;
-                for (std::size_t i = 0; i < curr_lms_len; i++)
+                for (I i = 0; i < curr_lms_len; i++)
                 {
                     if (t[prev_lms_idx + i] != t[curr_lms_idx + i])
                     {
@@ -798,9 +849,9 @@ public:
             prev_lms_idx = curr_lms_idx;
         }
         // collect t1
-        std::size_t sa_i;
-        std::size_t j = 0;
-        for (std::size_t i = 0; i < end_pos; i++)
+        I sa_i;
+        I j = 0;
+        for (I i = 0; i < end_pos; i++)
         {
             sa_i = sa[i];
             if (sa_i != EMPTY)
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// a fixed set of workers for fine-grained parallel loops. run() hands the
+// tasks out through a shared counter, the calling thread included, and
+// returns once all of them are done; the workers sleep in between, so one
+// pool serves the many short parallel steps of an algorithm without a
+// thread start per step.
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned threads)
+    {
+        for (unsigned i = 1; i < threads; i++)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &th : workers)
+        {
+            th.join();
+        }
+    }
+
+    unsigned size() const
+    {
+        return workers.size() + 1;
+    }
+
+    // fn(t) for every t < tasks
+    void run(size_t tasks, const function<void(size_t)> &fn)
+    {
+        if (tasks == 0)
+        {
+            return;
+        }
+        if (workers.empty() || tasks == 1)
+        {
+            for (size_t t = 0; t < tasks; t++)
+            {
+                fn(t);
+            }
+            return;
+        }
+        {
+            // a worker still leaving the last job must be out before the
+            // job changes under it
+            unique_lock<mutex> guard(lock);
+            done.wait(guard, [&]() { return active == 0; });
+            job = &fn;
+            job_tasks = tasks;
+            next = 0;
+            pending = tasks;
+            generation++;
+        }
+        wake.notify_all();
+        take_tasks();
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&]() { return pending == 0; });
+    }
+
+private:
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake, done;
+    const function<void(size_t)> *job = nullptr;
+    size_t job_tasks = 0;
+    atomic<size_t> next{0};
+    size_t pending = 0;  // tasks not finished
+    size_t active = 0;   // workers inside take_tasks
+    size_t generation = 0;
+    bool stopping = false;
+
+    void take_tasks()
+    {
+        size_t t, finished = 0;
+        while ((t = next++) < job_tasks)
+        {
+            (*job)(t);
+            finished++;
+        }
+        lock_guard<mutex> guard(lock);
+        pending -= finished;
+        if (pending == 0)
+        {
+            done.notify_all();
+        }
+    }
+
+    void work()
+    {
+        size_t seen = 0;
+        while (true)
+        {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&]() { return stopping || generation != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+                active++;
+            }
+            take_tasks();
+            lock_guard<mutex> guard(lock);
+            if (--active == 0)
+            {
+                done.notify_all();
+            }
+        }
+    }
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// number of independent LF walks the decoder interleaves; the compressor
+// stores the row of every step-th suffix so each walk has a starting point
+constexpr size_t UNBWT_LANES = 32;
+
+size_t unbwt_step(size_t n)
+{
+    return max<size_t>((n + UNBWT_LANES - 1) / UNBWT_LANES, 1);
+}
+
+// inverts a BWT whose sentinel was dropped and recorded as row `primary`.
+// each row keeps its LF target and its character in one word, so a walk
+// touches a single cache line per output byte. rows[s] is the row of suffix
+// (s + 1) * step; walking back from there yields segment s of the text, and
+// the segments are walked in lockstep so their cache misses overlap.
+template <class W>
+void unbwt_walk(const uint8_t *bwt, size_t n, size_t primary, const vector<size_t> &rows, size_t step, uint8_t *out)
+{
+    size_t C[256] = {0};
+    for (size_t i = 0; i < n; i++)
+    {
+        C[bwt[i]]++;
+    }
+    size_t sum = 1; // the sentinel sorts first
+    for (size_t c = 0; c < 256; c++)
+    {
+        size_t count = C[c];
+        C[c] = sum;
+        sum += count;
+    }
+
+    vector<W> lf(n + 1);
+    for (size_t i = 0, j = 0; i <= n; i++)
+    {
+        if (i == primary)
+        {
+            continue;
+        }
+        uint8_t c = bwt[j++];
+        lf[i] = ((W)C[c]++ << 8) | c;
+    }
+
+    // rows.size() full segments, plus the tail [lanes * step, n) which
+    // starts from the sentinel row 0
+    size_t lanes = rows.size();
+    size_t tail = n - lanes * step;
+    W row[UNBWT_LANES + 1];
+    for (size_t s = 0; s < lanes; s++)
+    {
+        row[s] = lf[rows[s]];
+    }
+    row[lanes] = lf[0];
+    for (size_t k = step; k-- > 0;)
+    {
+        for (size_t s = 0; s < lanes; s++)
+        {
+            out[s * step + k] = (uint8_t)row[s];
+            row[s] = lf[row[s] >> 8];
+        }
+        if (k < tail)
+        {
+            out[lanes * step + k] = (uint8_t)row[lanes];
+            row[lanes] = lf[row[lanes] >> 8];
+        }
+    }
+}
+
+void unbwt(const uint8_t *bwt, size_t n, size_t primary, const vector<size_t> &rows, size_t step, uint8_t *out)
+{
+    if (n < (1u << 24))
+    {
+        unbwt_walk<uint32_t>(bwt, n, primary, rows, step, out);
+    }
+    else
+    {
+        unbwt_walk<uint64_t>(bwt, n, primary, rows, step, out);
+    }
+}